@@ -8,6 +8,30 @@
 #include <utility>
 #include <stdlib.h>
 #include <cctype>
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+#include <cstdint>
+#include <chrono>
+#include <alloca.h>
+#include <set>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <list>
+#include <unordered_map>
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dlfcn.h>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <unistd.h>
 /*
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/IR/IRBuilder.h"
@@ -38,8 +62,20 @@ struct Token {
 	string rawStrVal;
 	string strVal;
 	double numVal;
+	//source line the token starts on
+	int line;
 };
 
+static int lexLine = 1;
+
+static int nextChar() {
+	int c = getchar();
+	if (c == '\n') {
+		lexLine++;
+	}
+	return c;
+}
+
 static Token gettok() {
 	Token token = Token();
 
@@ -47,14 +83,15 @@ static Token gettok() {
 
 	//skip whitespace
 	while (isspace(lastchar)) {
-		lastchar = getchar();
+		lastchar = nextChar();
 	}
+	token.line = lexLine;
 
 	//identifier
 	if (isalpha(lastchar)) {
 		token.strVal = lastchar;
 		//build up identifier
-		while (isalnum(lastchar = getchar())) {
+		while (isalnum(lastchar = nextChar())) {
 			token.strVal += lastchar;
 		}
 
@@ -87,7 +124,7 @@ static Token gettok() {
 		//build up number
 		do {
 			numStr += lastchar;
-			lastchar = getchar();
+			lastchar = nextChar();
 		} while (isdigit(lastchar) || lastchar == '.');
 
 		token.rawStrVal = numStr;
@@ -101,8 +138,11 @@ static Token gettok() {
 	else if (lastchar == '#') {
 		//comment until end of line
 		do {
-			lastchar = getchar();
+			lastchar = nextChar();
 		} while (lastchar != EOF && lastchar != '\n' && lastchar != '\r');
+
+		//the comment isn't a token, carry on with whatever follows it
+		return gettok();
 	}
 
 	//check for end of file
@@ -113,7 +153,7 @@ static Token gettok() {
 
 	//otherwise, just return the character as its ascii value
 	int currchar = lastchar;
-	lastchar = getchar();
+	lastchar = nextChar();
 	token.val = currchar;
 	token.rawStrVal = string(1, currchar);
 	return token;
@@ -156,6 +196,12 @@ void match(string ch) {
 
 //AST NODES
 
+//8 rows of a batch, and which of them are live, see BATCH
+//aligned explicitly, since without AVX-512 enabled the compiler would only give them the alignment of the widest register it knows
+typedef double BatchVec __attribute__((vector_size(64), aligned(64)));
+typedef int64_t BatchMask __attribute__((vector_size(64), aligned(64)));
+
+class Prototype;
 class Node {
 public:
 	virtual void prettyPrint(int tabCount) {
@@ -172,14 +218,35 @@ public:
 	virtual void asmGen() {
 		error("asmGen must be called on concrete node");
 	}
+
+	//adds every variable this node reads or writes, in order of first appearance
+	//identifiers also remember their index in names, which is their slot in an interpreter frame
+	virtual void collectVariables(vector<string>& names) {}
+
+	//adds every call this node makes
+	virtual void collectCalls(vector<Prototype*>& calls) {}
+
+	virtual double eval() {
+		error("eval must be called on concrete node");
+		return 0;
+	}
+
+	virtual void evalBatch(BatchVec* out, const BatchMask* mask) {
+		error("evalBatch must be called on concrete node");
+	}
+
+	virtual void byteGen() {
+		error("byteGen must be called on concrete node");
+	}
 };
 
 //identifier ::= 'A-Z'
 class Identifier : public Node {
 public:
 	string name;
+	int slot;
 
-	Identifier(string name) : name(name) {}
+	Identifier(string name) : name(name), slot(-1) {}
 
 	void prettyPrint(int tabCount) {
 		Node::prettyPrint(tabCount);
@@ -187,8 +254,21 @@ public:
 		cout << "[IDENTIFIER " << name << "]";
 	}
 
+	//prefixed so a variable can't collide with a C++ keyword
 	void codeGen() {
-		cout << name;
+		cout << "v_" << name;
+	}
+
+	void asmGen();
+	double eval();
+	void evalBatch(BatchVec* out, const BatchMask* mask);
+	void byteGen();
+
+	void collectVariables(vector<string>& names) {
+		slot = find(names.begin(), names.end(), name) - names.begin();
+		if (slot == (int)names.size()) {
+			names.push_back(name);
+		}
 	}
 };
 
@@ -207,17 +287,36 @@ public:
 	}
 
 	void codeGen() {
-		cout << value;
+		//a literal too long for a double is infinite, which C++ has no literal for
+		if (!isfinite(value)) {
+			cout << (value != value ? "__builtin_nan(\"\")" : value < 0 ? "(-__builtin_inf())" : "__builtin_inf()");
+			return;
+		}
+		//enough digits to round-trip every double, and always a double literal, or 1 / 2 would be integer division
+		char buf[32];
+		snprintf(buf, sizeof(buf), "%.17g", value);
+		cout << buf;
+		if (!strpbrk(buf, ".e")) {
+			cout << ".0";
+		}
 	}
+
+	void asmGen();
+	double eval();
+	void evalBatch(BatchVec* out, const BatchMask* mask);
+	void byteGen();
 };
 
 //prototype ::= <identifier> '(' [<identifier>] ')'
+class Function;
 class Prototype : public Node {
 public:
 	unique_ptr<Identifier> fnName;
 	vector<unique_ptr<Identifier> > args;
+	//resolved by resolveCalls() before the program runs
+	Function* callee;
 
-	Prototype(unique_ptr<Identifier> name, vector<unique_ptr<Identifier> > args) : fnName(move(name)), args(move(args)) {}
+	Prototype(unique_ptr<Identifier> name, vector<unique_ptr<Identifier> > args) : fnName(move(name)), args(move(args)), callee(nullptr) {}
 
 	void prettyPrint(int tabCount) {
 		Node::prettyPrint(tabCount);
@@ -239,16 +338,45 @@ public:
 		cout << "]";
 	}
 
+	//a prototype reached through an expression or statement is a call
 	void codeGen() {
-		fnName->codeGen();
-		cout << "(";
-		for (auto const& arg : args) {
-			//TODO Create explicit arglist which outputs type
+		cout << "frt_" << fnName->name << "(";
+		for (size_t i = 0; i < args.size(); i++) {
+			if (i) {
+				cout << ", ";
+			}
+			args[i]->codeGen();
+		}
+		cout << ")";
+	}
+
+	//the declaration form, used by Function
+	void signatureGen() {
+		cout << "double frt_" << fnName->name << "(";
+		for (size_t i = 0; i < args.size(); i++) {
+			if (i) {
+				cout << ", ";
+			}
 			cout << "double ";
-			arg->codeGen();
+			args[i]->codeGen();
 		}
 		cout << ")";
 	}
+
+	void asmGen();
+	double eval();
+	void evalBatch(BatchVec* out, const BatchMask* mask);
+	void byteGen();
+
+	void collectVariables(vector<string>& names) {
+		for (auto const& arg : args) {
+			arg->collectVariables(names);
+		}
+	}
+
+	void collectCalls(vector<Prototype*>& calls) {
+		calls.push_back(this);
+	}
 };
 
 //factor ::= <identifier> | <number> | <prototype>
@@ -276,6 +404,19 @@ public:
 	void codeGen() {
 		node->codeGen();
 	}
+
+	void asmGen();
+	double eval();
+	void evalBatch(BatchVec* out, const BatchMask* mask);
+	void byteGen();
+
+	void collectVariables(vector<string>& names) {
+		node->collectVariables(names);
+	}
+
+	void collectCalls(vector<Prototype*>& calls) {
+		node->collectCalls(calls);
+	}
 };
 
 //termop ::= '*' | '/'
@@ -298,6 +439,11 @@ public:
 	void codeGen() {
 		cout << name;
 	}
+
+	void asmGen();
+	double eval();
+	void evalBatch(BatchVec* out, const BatchMask* mask);
+	void byteGen();
 };
 
 //term ::= <factor> [<termop> <term>]
@@ -330,8 +476,23 @@ public:
 		}
 	}
 
-	void asmGen() {
+	void asmGen();
+	double eval();
+	void evalBatch(BatchVec* out, const BatchMask* mask);
+	void byteGen();
 
+	void collectVariables(vector<string>& names) {
+		lhs->collectVariables(names);
+		if (op) {
+			rhs->collectVariables(names);
+		}
+	}
+
+	void collectCalls(vector<Prototype*>& calls) {
+		lhs->collectCalls(calls);
+		if (op) {
+			rhs->collectCalls(calls);
+		}
 	}
 };
 
@@ -355,6 +516,11 @@ public:
 	void codeGen() {
 		cout << name;
 	}
+
+	void asmGen();
+	double eval();
+	void evalBatch(BatchVec* out, const BatchMask* mask);
+	void byteGen();
 };
 
 //expression ::= <term> [<exprop> <expression>]
@@ -386,6 +552,25 @@ public:
 			rhs->codeGen();
 		}
 	}
+
+	void asmGen();
+	double eval();
+	void evalBatch(BatchVec* out, const BatchMask* mask);
+	void byteGen();
+
+	void collectVariables(vector<string>& names) {
+		lhs->collectVariables(names);
+		if (op) {
+			rhs->collectVariables(names);
+		}
+	}
+
+	void collectCalls(vector<Prototype*>& calls) {
+		lhs->collectCalls(calls);
+		if (op) {
+			rhs->collectCalls(calls);
+		}
+	}
 };
 
 //assignment ::= <identifier> '=' <expression>
@@ -409,32 +594,65 @@ public:
 		cout << "]";
 	}
 
+	//locals are declared once at the top of the function, so a loop can reassign them
 	void codeGen() {
-		cout << "double ";
 		lhs->codeGen();
 		cout << " = ";
 		rhs->codeGen();
 	}
+
+	void asmGen();
+	double eval();
+	void evalBatch(BatchVec* out, const BatchMask* mask);
+	void byteGen();
+
+	void collectVariables(vector<string>& names) {
+		rhs->collectVariables(names);
+		lhs->collectVariables(names);
+	}
+
+	void collectCalls(vector<Prototype*>& calls) {
+		rhs->collectCalls(calls);
+	}
 };
 
-//condition ::= TODO flesh out
+//condition ::= <factor>
+//a condition holds when its factor is nonzero
 class Condition : public Node {
 public:
-	Condition() {}
+	unique_ptr<Factor> value;
+
+	Condition(unique_ptr<Factor> value) : value(move(value)) {}
 
 	void prettyPrint(int tabCount) {
 		Node::prettyPrint(tabCount);
 
-		cout << "[CONDITION ]";
+		cout << "[CONDITION ";
+		value->prettyPrint(tabCount+1);
+		cout << "]";
 	}
 
 	void codeGen() {
-		cout << "[CONDITION]";
+		value->codeGen();
+	}
+
+	void asmGen();
+	double eval();
+	void evalBatch(BatchVec* out, const BatchMask* mask);
+	void byteGen();
+
+	void collectVariables(vector<string>& names) {
+		value->collectVariables(names);
+	}
+
+	void collectCalls(vector<Prototype*>& calls) {
+		value->collectCalls(calls);
 	}
 };
 
 //if ::= 'if' '(' <condition> ')' '{' [<statement>] '}'
 class Statement;
+struct ProfileNode;
 class If : public Node {
 public:
 	unique_ptr<Condition> condition;
@@ -462,6 +680,25 @@ public:
 		}
 		cout << "}";
 	}
+
+	void asmGen();
+	double eval();
+	void evalBatch(BatchVec* out, const BatchMask* mask);
+	void byteGen();
+
+	void collectVariables(vector<string>& names) {
+		condition->collectVariables(names);
+		for (auto const& statement : statementList) {
+			statement->collectVariables(names);
+		}
+	}
+
+	void collectCalls(vector<Prototype*>& calls) {
+		condition->collectCalls(calls);
+		for (auto const& statement : statementList) {
+			statement->collectCalls(calls);
+		}
+	}
 };
 
 //while ::= 'while' '(' <condition> ')' '{' [<statement>] '}'
@@ -470,7 +707,11 @@ public:
 	unique_ptr<Condition> condition;
 	vector<unique_ptr<Node> > statementList;
 
-	While(unique_ptr<Condition> condition, vector<unique_ptr<Node> > statementList) : condition(move(condition)), statementList(move(statementList)) {}
+	//see PROFILE
+	int line;
+	ProfileNode* profile;
+
+	While(unique_ptr<Condition> condition, vector<unique_ptr<Node> > statementList, int line) : condition(move(condition)), statementList(move(statementList)), line(line), profile(nullptr) {}
 
 	void prettyPrint(int tabCount) {
 		Node::prettyPrint(tabCount);
@@ -492,6 +733,25 @@ public:
 		}
 		cout << "}";
 	}
+
+	void asmGen();
+	double eval();
+	void evalBatch(BatchVec* out, const BatchMask* mask);
+	void byteGen();
+
+	void collectVariables(vector<string>& names) {
+		condition->collectVariables(names);
+		for (auto const& statement : statementList) {
+			statement->collectVariables(names);
+		}
+	}
+
+	void collectCalls(vector<Prototype*>& calls) {
+		condition->collectCalls(calls);
+		for (auto const& statement : statementList) {
+			statement->collectCalls(calls);
+		}
+	}
 };
 
 //statement ::= <assignment> | <prototype> | <if> | <while> ';'
@@ -516,6 +776,49 @@ public:
 		node->codeGen();
 		cout << ";" << endl;
 	}
+
+	void asmGen();
+	double eval();
+	void evalBatch(BatchVec* out, const BatchMask* mask);
+	void byteGen();
+
+	void collectVariables(vector<string>& names) {
+		node->collectVariables(names);
+	}
+
+	void collectCalls(vector<Prototype*>& calls) {
+		node->collectCalls(calls);
+	}
+};
+
+//entry point taking the arguments as an array, so callers need not know the arity
+typedef double (*NativeEntry)(const double* args);
+
+struct MemoCache;
+
+//see BYTECODE
+enum ByteOp {
+	op_const,
+	op_load,
+	op_store,
+	op_pop,
+	op_add,
+	op_sub,
+	op_mul,
+	op_div,
+	//pops a condition and jumps when it is 0
+	op_jump_zero,
+	op_jump,
+	op_call,
+	op_return
+};
+
+struct Instr {
+	ByteOp op;
+	//slot, jump target or argument count
+	int arg;
+	double value;
+	Function* callee;
 };
 
 //function ::= 'func' <prototype> '{' [<statement>] '}'
@@ -524,7 +827,27 @@ public:
 	unique_ptr<Prototype> proto;
 	vector<unique_ptr<Node> > statementList;
 
-	Function(unique_ptr<Prototype> proto, vector<unique_ptr<Node> > statementList) : proto(move(proto)), statementList(move(statementList)) {}
+	//parameters first, then locals; filled in by main() once parsing is done
+	vector<string> variables;
+
+	//tiering state, see TIERS
+	long calls;
+	long backEdges;
+	NativeEntry native;
+	long promotedAtCall;
+	long promotedAtBackEdge;
+
+	//see MEMO
+	bool pure;
+	MemoCache* memo;
+
+	//see BYTECODE
+	vector<Instr> bytecode;
+
+	//see PROFILE
+	ProfileNode* profile;
+
+	Function(unique_ptr<Prototype> proto, vector<unique_ptr<Node> > statementList) : proto(move(proto)), statementList(move(statementList)), calls(0), backEdges(0), native(nullptr), promotedAtCall(0), promotedAtBackEdge(0), pure(false), memo(nullptr), profile(nullptr) {}
 
 	void prettyPrint(int tabCount) {
 		Node::prettyPrint(tabCount);
@@ -538,15 +861,39 @@ public:
 	}
 
 	void codeGen() {
-		cout << "double ";
-		proto->codeGen();
+		proto->signatureGen();
 		cout << " {" << endl;
+
+		//every local starts out as 0
+		vector<string> names;
+		collectVariables(names);
+		for (size_t i = proto->args.size(); i < names.size(); i++) {
+			cout << "double v_" << names[i] << " = 0;" << endl;
+		}
+
 		for (auto const& statement : statementList) {
 			statement->codeGen();
 		}
+		cout << "return 0;" << endl;
 		cout << "}";
 		cout << endl;
 	}
+
+	void asmGen();
+	void byteGen();
+
+	void collectVariables(vector<string>& names) {
+		proto->collectVariables(names);
+		for (auto const& statement : statementList) {
+			statement->collectVariables(names);
+		}
+	}
+
+	void collectCalls(vector<Prototype*>& calls) {
+		for (auto const& statement : statementList) {
+			statement->collectCalls(calls);
+		}
+	}
 };
 
 //return ::= 'return' <expression> ';'
@@ -569,6 +916,19 @@ public:
 		expr->codeGen();
 		cout << ";" << endl;
 	}
+
+	void asmGen();
+	double eval();
+	void evalBatch(BatchVec* out, const BatchMask* mask);
+	void byteGen();
+
+	void collectVariables(vector<string>& names) {
+		expr->collectVariables(names);
+	}
+
+	void collectCalls(vector<Prototype*>& calls) {
+		expr->collectCalls(calls);
+	}
 };
 
 
@@ -698,9 +1058,9 @@ static unique_ptr<Assignment> parseAssignment() {
 	return unique_ptr<Assignment>(new Assignment(move(lhs), move(rhs)));
 }
 
+//condition ::= <factor>
 static unique_ptr<Condition> parseCondition() {
-	getToken();
-	return unique_ptr<Condition>(new Condition());
+	return unique_ptr<Condition>(new Condition(parseFactor()));
 }
 
 static unique_ptr<Statement> parseStatement();
@@ -725,6 +1085,7 @@ static unique_ptr<If> parseIf() {
 
 //while ::= 'while' '(' <condition> ')' '{' [<statement>] '}'
 static unique_ptr<While> parseWhile() {
+	int line = curTok.line;
 	match("while");
 	match("(");
 	unique_ptr<Condition> condition (parseCondition());
@@ -738,7 +1099,7 @@ static unique_ptr<While> parseWhile() {
 
 	match("}");
 
-	return unique_ptr<While>(new While(move(condition), move(statementList)));
+	return unique_ptr<While>(new While(move(condition), move(statementList), line));
 }
 
 //statement ::= <assignment> | <prototype> | <if> | <while>
@@ -874,55 +1235,2704 @@ Value* Function::codeGen() {
 }
 
 */
-int main() {
-	cout << "ready> ";
-	getToken();
 
-	vector<Token> tokens;
-	vector<unique_ptr<Node> > ast;
 
-	do {
-		tokens.push_back(curTok);
 
-		if (curTok.type != tok_eof) {
-			unique_ptr<Node> ident (parseFunction());
 
-			ast.push_back(move(ident));
-		}
 
-		if (curTok.rawStrVal == "E") {
-			break;
+
+
+
+
+//X86-64
+
+//every parsed function by name, filled in by main() once the program has been read
+static map<string, Function*> functions;
+
+//SSE2 register file split: xmm0-xmm7 hold expression temporaries and outgoing arguments,
+//xmm8-xmm15 are handed out to variables by the linear-scan allocator
+static const int asmTempRegs = 8;
+static const int asmFirstVarReg = 8;
+static const int asmLastVarReg = 15;
+
+//the System V ABI passes the first 8 doubles in xmm0-xmm7, which is all we support
+static const int asmMaxArgs = 8;
+
+//where a variable lives while it is live: an xmm register, or a slot in the stack frame
+struct AsmHome {
+	int reg;
+	int slot;
+};
+
+//live range of one variable, measured in positions handed out as the function body is walked
+struct AsmInterval {
+	int start;
+	int end;
+	//read before any unconditional write, so it must start out as 0
+	bool needsInit;
+	AsmHome home;
+};
+
+struct Assembler {
+	vector<uint8_t> code;
+
+	//offset of each emitted function and of its array entry thunk
+	map<string, size_t> labels;
+	map<string, size_t> entryLabels;
+	//rel32 call operands waiting for their callee to be emitted
+	vector<pair<size_t, string> > callFixups;
+
+	//per function state
+	//the first pass over a function only measures live intervals, and its code is thrown away
+	bool measuring;
+	int position;
+	int depth;
+	map<string, AsmInterval> intervals;
+	vector<int> calls;
+	vector<pair<int, int> > loops;
+	int top;
+	int maxTop;
+	int spillSlots;
+	vector<size_t> returnFixups;
+};
+
+static Assembler as;
+static map<string, NativeEntry> asmEntries;
+
+static void emitByte(uint8_t byte) {
+	as.code.push_back(byte);
+}
+
+static void emit32(uint32_t value) {
+	for (int i = 0; i < 4; i++) {
+		emitByte((value >> (8 * i)) & 0xff);
+	}
+}
+
+static void emit64(uint64_t value) {
+	emit32((uint32_t)value);
+	emit32((uint32_t)(value >> 32));
+}
+
+static void patch32(size_t offset, uint32_t value) {
+	memcpy(&as.code[offset], &value, 4);
+}
+
+//<prefix> [REX] 0F <op> /r, register to register
+static void emitSSE(uint8_t prefix, uint8_t op, int reg, int rm) {
+	emitByte(prefix);
+	if (reg >= 8 || rm >= 8) {
+		emitByte(0x40 | ((reg >> 3) << 2) | (rm >> 3));
+	}
+	emitByte(0x0f);
+	emitByte(op);
+	emitByte(0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+//<prefix> [REX] 0F <op> /r, register and [base + disp32]
+static void emitSSEMem(uint8_t prefix, uint8_t op, int reg, int base, int32_t disp) {
+	emitByte(prefix);
+	if (reg >= 8) {
+		emitByte(0x44);
+	}
+	emitByte(0x0f);
+	emitByte(op);
+	emitByte(0x80 | ((reg & 7) << 3) | base);
+	emit32((uint32_t)disp);
+}
+
+static const uint8_t asmRDI = 7;
+static const uint8_t asmRBP = 5;
+
+static const uint8_t opMovsdLoad = 0x10;
+static const uint8_t opMovsdStore = 0x11;
+static const uint8_t opUcomisd = 0x2e;
+static const uint8_t opXorpd = 0x57;
+static const uint8_t opAddsd = 0x58;
+static const uint8_t opMulsd = 0x59;
+static const uint8_t opSubsd = 0x5c;
+static const uint8_t opDivsd = 0x5e;
+
+static void emitMove(int dst, int src) {
+	if (dst != src) {
+		emitSSE(0xf2, opMovsdLoad, dst, src);
+	}
+}
+
+static void emitZero(int reg) {
+	emitSSE(0x66, opXorpd, reg, reg);
+}
+
+static int32_t slotOffset(int slot) {
+	return -8 * (slot + 1);
+}
+
+static void asmLoad(int reg, AsmHome home) {
+	if (home.reg >= 0) {
+		emitMove(reg, home.reg);
+	}
+	else {
+		emitSSEMem(0xf2, opMovsdLoad, reg, asmRBP, slotOffset(home.slot));
+	}
+}
+
+static void asmStore(AsmHome home, int reg) {
+	if (home.reg >= 0) {
+		emitMove(home.reg, reg);
+	}
+	else {
+		emitSSEMem(0xf2, opMovsdStore, reg, asmRBP, slotOffset(home.slot));
+	}
+}
+
+//temporaries spill into the slots after the variables while a call is in flight
+static AsmHome tempHome(int temp) {
+	AsmHome home = {-1, as.spillSlots + temp};
+	return home;
+}
+
+static int asmPush() {
+	if (as.top == asmTempRegs) {
+		error("Expression too deep for asmGen");
+	}
+	as.maxTop = max(as.maxTop, as.top + 1);
+	return as.top++;
+}
+
+static void asmPop() {
+	as.top--;
+}
+
+//pops the two topmost temporaries and pushes lhs <op> rhs
+static void asmBinary(uint8_t op) {
+	emitSSE(0xf2, op, as.top - 2, as.top - 1);
+	asmPop();
+}
+
+//jcc/jmp with a rel32 operand to be bound later, returns the operand's offset
+static size_t asmJump(uint8_t cc) {
+	if (cc) {
+		emitByte(0x0f);
+		emitByte(cc);
+	}
+	else {
+		emitByte(0xe9);
+	}
+	size_t fixup = as.code.size();
+	emit32(0);
+	return fixup;
+}
+
+static void asmBind(size_t fixup) {
+	patch32(fixup, (uint32_t)(as.code.size() - (fixup + 4)));
+}
+
+static const uint8_t ccParity = 0x8a;
+static const uint8_t ccEqual = 0x84;
+
+//records a reference to a variable and returns its home
+static AsmHome asmUse(const string& name, bool write) {
+	int pos = ++as.position;
+	if (!as.measuring) {
+		return as.intervals[name].home;
+	}
+
+	auto it = as.intervals.find(name);
+	if (it == as.intervals.end()) {
+		AsmInterval interval = {pos, pos, !write || as.depth > 0, {-1, 0}};
+		as.intervals[name] = interval;
+	}
+	else {
+		it->second.end = pos;
+	}
+	return as.intervals[name].home;
+}
+
+//linear scan over the intervals measured by the first pass
+static void asmAllocate() {
+	//a value touched inside a loop has to survive the back edge, so it lives for the whole loop
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (auto& entry : as.intervals) {
+			AsmInterval& interval = entry.second;
+			for (auto const& loop : as.loops) {
+				if (interval.start <= loop.second && interval.end >= loop.first) {
+					if (interval.start > loop.first || interval.end < loop.second) {
+						interval.start = min(interval.start, loop.first);
+						interval.end = max(interval.end, loop.second);
+						changed = true;
+					}
+				}
+			}
 		}
-	} while (curTok.rawStrVal != "E");
+	}
 
-	cout << endl << endl << "AST: " << endl << endl;
+	vector<AsmInterval*> sorted;
+	for (auto& entry : as.intervals) {
+		if (entry.second.needsInit) {
+			entry.second.start = 0;
+		}
+		sorted.push_back(&entry.second);
+	}
+	stable_sort(sorted.begin(), sorted.end(), [](AsmInterval* a, AsmInterval* b) {
+		return a->start < b->start;
+	});
 
-	for (auto const& node : ast) {
-		node->prettyPrint(0);
+	vector<int> freeRegs;
+	for (int reg = asmLastVarReg; reg >= asmFirstVarReg; reg--) {
+		freeRegs.push_back(reg);
 	}
-/*
-	cout << endl << endl << "TRANSPILE: " << endl << endl;
+	vector<AsmInterval*> active;
+
+	for (AsmInterval* interval : sorted) {
+		//expire intervals that ended before this one starts
+		for (size_t i = 0; i < active.size();) {
+			if (active[i]->end < interval->start) {
+				freeRegs.push_back(active[i]->home.reg);
+				active.erase(active.begin() + i);
+			}
+			else {
+				i++;
+			}
+		}
 
-	std::ofstream out("out.cpp");
-    std::streambuf *coutbuf = std::cout.rdbuf(); //save old buf
-    std::cout.rdbuf(out.rdbuf()); //redirect std::cout to out.txt!
+		//System V has no callee-saved xmm registers, so anything live across a call stays in memory
+		bool crossesCall = false;
+		for (int call : as.calls) {
+			if (interval->start < call && call < interval->end) {
+				crossesCall = true;
+			}
+		}
 
-    //MAIN code gen
-    cout << "#import <iostream>" << endl;
-	for (auto const& node : ast) {
-		if (!hasFoundFirstFunction) {
-			//if (typeid(node).name()"Prototype") {
-				//unique_ptr<Prototype> proto (node);
-				cout << "found proto " << typeid(node).name() << endl;
-			//}
+		interval->home.reg = -1;
+		if (crossesCall) {
+			interval->home.slot = as.spillSlots++;
+		}
+		else if (!freeRegs.empty()) {
+			interval->home.reg = freeRegs.back();
+			freeRegs.pop_back();
+			active.push_back(interval);
+		}
+		else {
+			//spill whichever interval ends furthest away
+			AsmInterval* furthest = interval;
+			for (AsmInterval* other : active) {
+				if (other->end > furthest->end) {
+					furthest = other;
+				}
+			}
+			if (furthest != interval) {
+				interval->home.reg = furthest->home.reg;
+				furthest->home.reg = -1;
+				furthest->home.slot = as.spillSlots++;
+				active.erase(find(active.begin(), active.end(), furthest));
+				active.push_back(interval);
+			}
+			else {
+				interval->home.slot = as.spillSlots++;
+			}
 		}
+	}
+}
+
+void Identifier::asmGen() {
+	AsmHome home = asmUse(name, false);
+	asmLoad(asmPush(), home);
+}
 
+void Number::asmGen() {
+	int reg = asmPush();
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	if (bits == 0) {
+		emitZero(reg);
+		return;
+	}
+	//mov rax, imm64; movq xmm, rax
+	emitByte(0x48);
+	emitByte(0xb8);
+	emit64(bits);
+	emitByte(0x66);
+	emitByte(reg >= 8 ? 0x4c : 0x48);
+	emitByte(0x0f);
+	emitByte(0x6e);
+	emitByte(0xc0 | ((reg & 7) << 3));
+}
 
-		node->codeGen();
+//a prototype reached through an expression or statement is a call
+void Prototype::asmGen() {
+	auto callee = functions.find(fnName->name);
+	if (callee == functions.end()) {
+		error("Unknown function "+fnName->name);
+	}
+	if (callee->second->proto->args.size() != args.size()) {
+		error("Wrong number of arguments to "+fnName->name);
+	}
+	if (args.size() > asmMaxArgs) {
+		error("asmGen supports at most 8 arguments");
 	}
 
-	cout << "int main() {" << endl << "	" << "std::cout << dbl" << "(5);" << endl << "}";
-*/
+	//every xmm register is caller-saved, so live temporaries ride out the call in the frame
+	int live = as.top;
+	for (int i = 0; i < live; i++) {
+		asmStore(tempHome(i), i);
+	}
+	for (size_t i = 0; i < args.size(); i++) {
+		asmLoad(i, asmUse(args[i]->name, false));
+	}
+
+	int pos = ++as.position;
+	if (as.measuring) {
+		as.calls.push_back(pos);
+	}
+	emitByte(0xe8);
+	as.callFixups.push_back(make_pair(as.code.size(), fnName->name));
+	emit32(0);
+
+	int reg = asmPush();
+	emitMove(reg, 0);
+	for (int i = 0; i < live; i++) {
+		asmLoad(i, tempHome(i));
+	}
+}
+
+void Factor::asmGen() {
+	node->asmGen();
+}
+
+void TermOp::asmGen() {
+	asmBinary(name == "*" ? opMulsd : opDivsd);
+}
+
+//term chains are folded left to right, so a/b/c means (a/b)/c as it does in the transpiled C++
+void Term::asmGen() {
+	lhs->asmGen();
+	for (Term* term = this; term->op; term = term->rhs.get()) {
+		term->rhs->lhs->asmGen();
+		term->op->asmGen();
+	}
+}
+
+void ExprOp::asmGen() {
+	asmBinary(name == "+" ? opAddsd : opSubsd);
+}
+
+void Expression::asmGen() {
+	lhs->asmGen();
+	for (Expression* expr = this; expr->op; expr = expr->rhs.get()) {
+		expr->rhs->lhs->asmGen();
+		expr->op->asmGen();
+	}
+}
+
+void Assignment::asmGen() {
+	rhs->asmGen();
+	asmStore(asmUse(lhs->name, true), as.top - 1);
+	asmPop();
+}
+
+//leaves the flags of comparing the condition against 0
+void Condition::asmGen() {
+	value->asmGen();
+	int reg = as.top - 1;
+	int zero = asmPush();
+	emitZero(zero);
+	emitSSE(0x66, opUcomisd, reg, zero);
+	asmPop();
+	asmPop();
+}
+
+void If::asmGen() {
+	condition->asmGen();
+	//unordered (NaN) counts as nonzero, as it does in C
+	size_t toBody = asmJump(ccParity);
+	size_t toEnd = asmJump(ccEqual);
+	asmBind(toBody);
+
+	as.depth++;
+	for (auto const& statement : statementList) {
+		statement->asmGen();
+	}
+	as.depth--;
+
+	asmBind(toEnd);
+}
+
+void While::asmGen() {
+	int start = ++as.position;
+	size_t loopTop = as.code.size();
+	as.depth++;
+
+	condition->asmGen();
+	size_t toBody = asmJump(ccParity);
+	size_t toEnd = asmJump(ccEqual);
+	asmBind(toBody);
+
+	for (auto const& statement : statementList) {
+		statement->asmGen();
+	}
+	size_t back = asmJump(0);
+	patch32(back, (uint32_t)(loopTop - (back + 4)));
+
+	asmBind(toEnd);
+	as.depth--;
+	int end = ++as.position;
+	if (as.measuring) {
+		as.loops.push_back(make_pair(start, end));
+	}
+}
+
+void Statement::asmGen() {
+	//a call made for its own sake leaves a result nobody wants
+	int top = as.top;
+	node->asmGen();
+	as.top = top;
+}
+
+void Return::asmGen() {
+	expr->asmGen();
+	emitMove(0, as.top - 1);
+	asmPop();
+	as.returnFixups.push_back(asmJump(0));
+}
+
+void Function::asmGen() {
+	if (proto->args.size() > asmMaxArgs) {
+		error("asmGen supports at most 8 arguments");
+	}
+
+	size_t start = as.code.size();
+	for (int pass = 0; pass < 2; pass++) {
+		as.code.resize(start);
+		as.measuring = (pass == 0);
+		as.position = 0;
+		as.depth = 0;
+		as.top = 0;
+		as.returnFixups.clear();
+		size_t fixups = as.callFixups.size();
+
+		if (as.measuring) {
+			as.intervals.clear();
+			as.calls.clear();
+			as.loops.clear();
+			as.maxTop = 0;
+			as.spillSlots = 0;
+		}
+		else {
+			asmAllocate();
+		}
+
+		//push rbp; mov rbp, rsp; sub rsp, frame
+		int frame = 8 * (as.spillSlots + as.maxTop);
+		frame = (frame + 15) & ~15;
+		emitByte(0x55);
+		emitByte(0x48); emitByte(0x89); emitByte(0xe5);
+		emitByte(0x48); emitByte(0x81); emitByte(0xec);
+		emit32(frame);
+
+		for (size_t i = 0; i < proto->args.size(); i++) {
+			asmStore(asmUse(proto->args[i]->name, true), i);
+		}
+		if (!as.measuring) {
+			emitZero(0);
+			for (auto const& entry : as.intervals) {
+				if (entry.second.needsInit) {
+					asmStore(entry.second.home, 0);
+				}
+			}
+		}
+
+		for (auto const& statement : statementList) {
+			statement->asmGen();
+		}
+
+		//falling off the end returns 0
+		emitZero(0);
+		for (size_t fixup : as.returnFixups) {
+			asmBind(fixup);
+		}
+		//leave; ret
+		emitByte(0xc9);
+		emitByte(0xc3);
+
+		if (as.measuring) {
+			as.callFixups.resize(fixups);
+		}
+	}
+
+	as.labels[proto->fnName->name] = start;
+}
+
+//emits every function plus array entry thunks into one block of executable memory
+static void asmCompile() {
+	as = Assembler();
+	for (auto const& entry : functions) {
+		entry.second->asmGen();
+	}
+
+	for (auto const& entry : functions) {
+		//push rbp; mov rbp, rsp; movsd xmmN, [rdi+8N]...; call fn; pop rbp; ret
+		as.entryLabels[entry.first] = as.code.size();
+		emitByte(0x55);
+		emitByte(0x48); emitByte(0x89); emitByte(0xe5);
+		for (size_t i = 0; i < entry.second->proto->args.size(); i++) {
+			emitSSEMem(0xf2, opMovsdLoad, i, asmRDI, 8 * i);
+		}
+		emitByte(0xe8);
+		as.callFixups.push_back(make_pair(as.code.size(), entry.first));
+		emit32(0);
+		emitByte(0x5d);
+		emitByte(0xc3);
+	}
+
+	for (auto const& fixup : as.callFixups) {
+		patch32(fixup.first, (uint32_t)(as.labels[fixup.second] - (fixup.first + 4)));
+	}
+
+	size_t size = as.code.size();
+	void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		error("Could not map memory for native code");
+	}
+	memcpy(mem, as.code.data(), size);
+	if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+		error("Could not make native code executable");
+	}
+
+	for (auto const& entry : as.entryLabels) {
+		asmEntries[entry.first] = (NativeEntry)((uint8_t*)mem + entry.second);
+	}
+}
+
+
+
+
+
+
+
+
+
+//TRANSPILE
+
+//writes a complete translation unit for every parsed function to cout
+//each function also gets an extern "C" entry taking its arguments as an array, for dlsym
+static void transpile() {
+	cout << "//generated by frt" << endl << endl;
+
+	//forward declarations, so functions may call ones defined after them
+	for (auto const& entry : functions) {
+		entry.second->proto->signatureGen();
+		cout << ";" << endl;
+	}
+	cout << endl;
+
+	for (auto const& entry : functions) {
+		entry.second->codeGen();
+		cout << endl;
+	}
+
+	for (auto const& entry : functions) {
+		Prototype* proto = entry.second->proto.get();
+		cout << "extern \"C\" double frt_entry_" << entry.first << "(const double* args) {" << endl;
+		cout << "return frt_" << entry.first << "(";
+		for (size_t i = 0; i < proto->args.size(); i++) {
+			cout << (i ? ", " : "") << "args[" << i << "]";
+		}
+		cout << ");" << endl << "}" << endl;
+	}
+}
+
+static string transpileSource() {
+	ostringstream out;
+	streambuf* coutbuf = cout.rdbuf(out.rdbuf());
+	transpile();
+	cout.rdbuf(coutbuf);
+	return out.str();
+}
+
+//64-bit FNV-1a
+static uint64_t hashString(const string& str) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (unsigned char c : str) {
+		hash ^= c;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static string envOr(const char* name, string fallback) {
+	const char* value = getenv(name);
+	return value && *value ? value : fallback;
+}
+
+//FRT_CACHE_DIR, or $XDG_CACHE_HOME/frt, or ~/.cache/frt
+static string cacheDir() {
+	string dir = envOr("FRT_CACHE_DIR", "");
+	if (dir.empty()) {
+		string base = envOr("XDG_CACHE_HOME", envOr("HOME", "/tmp") + "/.cache");
+		mkdir(base.c_str(), 0755);
+		dir = base + "/frt";
+	}
+	mkdir(dir.c_str(), 0755);
+	return dir;
+}
+
+static map<string, NativeEntry> cxxEntries;
+
+//the model and feature flags of the cpu, as -march=native builds for the machine it runs on and the
+//cache dir may be shared with other machines, through an NFS home or a copied container image
+static string cpuIdentity() {
+	ifstream in("/proc/cpuinfo");
+	string line, model, features;
+	while (getline(in, line) && (model.empty() || features.empty())) {
+		if (model.empty() && line.compare(0, 10, "model name") == 0) {
+			model = line;
+		}
+		else if (features.empty() && (line.compare(0, 5, "flags") == 0 || line.compare(0, 8, "Features") == 0)) {
+			features = line;
+		}
+	}
+	return model + "\n" + features;
+}
+
+//runs a program without a shell, so no path or flag is ever parsed as shell text, and returns its exit status or -1
+static int runProgram(const vector<string>& words) {
+	vector<char*> argv;
+	for (string const& word : words) {
+		argv.push_back((char*)word.c_str());
+	}
+	argv.push_back(nullptr);
+	cout.flush();
+	pid_t pid = fork();
+	if (pid == 0) {
+		execvp(argv[0], argv.data());
+		_exit(127);
+	}
+	int status;
+	if (pid < 0 || waitpid(pid, &status, 0) != pid) {
+		return -1;
+	}
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+//compiles the transpiled program into a shared object and loads it
+//objects are cached on disk by a hash of the source, the compiler command and the cpu, so an unchanged program is only
+//compiled once per kind of machine
+static void cxxCompile() {
+	string compiler = envOr("CXX", "c++");
+	//no FMA contraction, so results match the other tiers bit for bit
+	string flags = envOr("FRT_CXXFLAGS", "-O2 -march=native -ffp-contract=off");
+	string source = transpileSource();
+
+	char key[17];
+	snprintf(key, sizeof(key), "%016llx", (unsigned long long)hashString(compiler + "\n" + flags + "\n" + cpuIdentity() + "\n" + source));
+	string dir = cacheDir();
+	string object = dir + "/" + key + ".so";
+
+	struct stat info;
+	if (stat(object.c_str(), &info) != 0) {
+		//build under a private name and rename into place, so concurrent runs never load a half-written object
+		string tmp = dir + "/" + key + "." + to_string(getpid());
+		ofstream(tmp + ".cpp") << source;
+		//CXX and FRT_CXXFLAGS are split into words on whitespace, as a shell would
+		vector<string> command;
+		istringstream words(compiler + " " + flags);
+		for (string word; words >> word; ) {
+			command.push_back(word);
+		}
+		command.insert(command.end(), {"-shared", "-fPIC", "-o", tmp + ".so", tmp + ".cpp"});
+		int status = runProgram(command);
+		remove((tmp + ".cpp").c_str());
+		if (status != 0 || rename((tmp + ".so").c_str(), object.c_str()) != 0) {
+			remove((tmp + ".so").c_str());
+			error("Could not compile transpiled program with "+compiler);
+		}
+	}
+
+	void* handle = dlopen(object.c_str(), RTLD_NOW | RTLD_LOCAL);
+	if (!handle) {
+		error("Could not load "+object+": "+dlerror());
+	}
+	for (auto const& entry : functions) {
+		void* symbol = dlsym(handle, ("frt_entry_" + entry.first).c_str());
+		if (!symbol) {
+			error("Missing entry for "+entry.first+" in "+object);
+		}
+		cxxEntries[entry.first] = (NativeEntry)symbol;
+	}
+}
+
+
+
+
+
+
+
+
+
+//INTERPRETER
+
+//points every call at its callee, so running code never looks functions up by name
+static void resolveCalls() {
+	for (auto const& entry : functions) {
+		vector<Prototype*> calls;
+		entry.second->collectCalls(calls);
+		for (Prototype* call : calls) {
+			auto found = functions.find(call->fnName->name);
+			if (found == functions.end()) {
+				error("Unknown function "+call->fnName->name);
+			}
+			if (found->second->proto->args.size() != call->args.size()) {
+				error("Wrong number of arguments to "+call->fnName->name);
+			}
+			call->callee = found->second;
+		}
+	}
+}
+
+//state of the innermost interpreted call
+static double* evalFrame;
+static Function* evalFunction;
+static bool evalReturning;
+static double evalResult;
+
+//see PROFILE
+static bool profiling;
+static ProfileNode* profileEnter(Function* function, While* loop);
+static void profileBackEdge(ProfileNode* node);
+static void profileLeave();
+
+static double callFunction(Function* function, const double* args);
+
+double Identifier::eval() {
+	return evalFrame[slot];
+}
+
+double Number::eval() {
+	return value;
+}
+
+//a prototype reached through an expression or statement is a call
+double Prototype::eval() {
+	double* values = (double*)alloca(sizeof(double) * args.size());
+	for (size_t i = 0; i < args.size(); i++) {
+		values[i] = args[i]->eval();
+	}
+	return callFunction(callee, values);
+}
+
+double Factor::eval() {
+	return node->eval();
+}
+
+//the operators are applied by Term and Expression, which fold their chains left to right
+double TermOp::eval() {
+	return 0;
+}
+
+double ExprOp::eval() {
+	return 0;
+}
+
+double Term::eval() {
+	double value = lhs->eval();
+	for (Term* term = this; term->op; term = term->rhs.get()) {
+		double rhsValue = term->rhs->lhs->eval();
+		value = term->op->name == "*" ? value * rhsValue : value / rhsValue;
+	}
+	return value;
+}
+
+double Expression::eval() {
+	double value = lhs->eval();
+	for (Expression* expr = this; expr->op; expr = expr->rhs.get()) {
+		double rhsValue = expr->rhs->lhs->eval();
+		value = expr->op->name == "+" ? value + rhsValue : value - rhsValue;
+	}
+	return value;
+}
+
+double Assignment::eval() {
+	evalFrame[lhs->slot] = rhs->eval();
+	return 0;
+}
+
+double Condition::eval() {
+	return value->eval() != 0;
+}
+
+double If::eval() {
+	if (condition->eval()) {
+		for (auto const& statement : statementList) {
+			statement->eval();
+			if (evalReturning) {
+				break;
+			}
+		}
+	}
+	return 0;
+}
+
+static void tierBackEdge(Function* function);
+
+double While::eval() {
+	Function* function = evalFunction;
+	ProfileNode* node = profiling ? profileEnter(function, this) : nullptr;
+	while (condition->eval()) {
+		for (auto const& statement : statementList) {
+			statement->eval();
+			if (evalReturning) {
+				break;
+			}
+		}
+		if (evalReturning) {
+			break;
+		}
+		if (node) {
+			profileBackEdge(node);
+		}
+		tierBackEdge(function);
+	}
+	if (node) {
+		profileLeave();
+	}
+	return 0;
+}
+
+double Statement::eval() {
+	return node->eval();
+}
+
+double Return::eval() {
+	evalResult = expr->eval();
+	evalReturning = true;
+	return 0;
+}
+
+static double interpret(Function* function, const double* args) {
+	size_t numArgs = function->proto->args.size();
+	size_t numVariables = function->variables.size();
+
+	//every local starts out as 0
+	double* frame = (double*)alloca(sizeof(double) * (numVariables + 1));
+	for (size_t i = 0; i < numVariables; i++) {
+		frame[i] = i < numArgs ? args[i] : 0;
+	}
+
+	double* callerFrame = evalFrame;
+	Function* caller = evalFunction;
+	evalFrame = frame;
+	evalFunction = function;
+	evalReturning = false;
+	if (profiling) {
+		profileEnter(function, nullptr);
+	}
+
+	for (auto const& statement : function->statementList) {
+		statement->eval();
+		if (evalReturning) {
+			break;
+		}
+	}
+	double result = evalReturning ? evalResult : 0;
+
+	if (profiling) {
+		profileLeave();
+	}
+	evalFrame = callerFrame;
+	evalFunction = caller;
+	evalReturning = false;
+	return result;
+}
+
+
+
+
+
+
+
+
+
+//TIERS
+
+//functions start out interpreted, and are promoted to native code once they get hot
+//the counters only tick in the interpreter: once a function is native, its calls to other
+//native functions go straight from native code to native code
+struct TierConfig {
+	long callThreshold;
+	long backEdgeThreshold;
+	//"asm" or "cxx"
+	string nativeTier;
+	//off keeps everything in the interpreter
+	bool enabled;
+};
+
+static TierConfig tiers = {1000, 10000, "asm", false};
+
+//native code for the whole program is built once, on the first promotion
+static map<string, NativeEntry>* tierEntries;
+static double tierCompileSeconds;
+
+static void tierPromote(Function* function) {
+	if (!tierEntries) {
+		//the x86-64 backend only passes arguments in registers, so it is all or nothing
+		if (tiers.nativeTier == "asm") {
+			for (auto const& entry : functions) {
+				if (entry.second->proto->args.size() > asmMaxArgs) {
+					tiers.enabled = false;
+					return;
+				}
+			}
+		}
+
+		auto start = chrono::steady_clock::now();
+		if (tiers.nativeTier == "cxx") {
+			cxxCompile();
+			tierEntries = &cxxEntries;
+		}
+		else {
+			asmCompile();
+			tierEntries = &asmEntries;
+		}
+		tierCompileSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	}
+
+	function->native = (*tierEntries)[function->proto->fnName->name];
+	function->promotedAtCall = function->calls;
+	function->promotedAtBackEdge = function->backEdges;
+}
+
+static void tierBackEdge(Function* function) {
+	//an activation already in the interpreter finishes there, the next call runs native
+	if (++function->backEdges == tiers.backEdgeThreshold && tiers.enabled && !function->native) {
+		tierPromote(function);
+	}
+}
+
+static double runFunction(Function* function, const double* args) {
+	if (function->native) {
+		return function->native(args);
+	}
+	return interpret(function, args);
+}
+
+static double memoCall(Function* function, const double* args);
+
+//every call made from the interpreter comes through here
+static double callFunction(Function* function, const double* args) {
+	if (++function->calls == tiers.callThreshold && tiers.enabled && !function->native) {
+		tierPromote(function);
+	}
+	if (function->memo) {
+		return memoCall(function, args);
+	}
+	return runFunction(function, args);
+}
+
+//FRT_CALL_THRESHOLD, FRT_BACKEDGE_THRESHOLD and FRT_NATIVE_TIER override the defaults
+static void tierConfigure() {
+	tiers.enabled = true;
+	tiers.callThreshold = atol(envOr("FRT_CALL_THRESHOLD", to_string(tiers.callThreshold)).c_str());
+	tiers.backEdgeThreshold = atol(envOr("FRT_BACKEDGE_THRESHOLD", to_string(tiers.backEdgeThreshold)).c_str());
+	tiers.nativeTier = envOr("FRT_NATIVE_TIER", tiers.nativeTier);
+	if (tiers.nativeTier != "asm" && tiers.nativeTier != "cxx") {
+		error("FRT_NATIVE_TIER must be asm or cxx");
+	}
+}
+
+static void tierStats(ostream& out) {
+	out << "tier stats: native tier " << tiers.nativeTier
+		<< ", call threshold " << tiers.callThreshold
+		<< ", back-edge threshold " << tiers.backEdgeThreshold << endl;
+	if (tierEntries) {
+		out << "native compile: " << tierCompileSeconds * 1000 << " ms" << endl;
+	}
+	out << "function\tcalls\tback-edges\ttier\tpromoted at call\tpromoted at back-edge" << endl;
+	for (auto const& entry : functions) {
+		Function* function = entry.second;
+		out << entry.first << "\t" << function->calls << "\t" << function->backEdges << "\t";
+		if (function->native) {
+			out << tiers.nativeTier << "\t" << function->promotedAtCall << "\t" << function->promotedAtBackEdge << endl;
+		}
+		else {
+			out << "interp\t-\t-" << endl;
+		}
+	}
+}
+
+
+
+
+
+
+
+
+
+//PROFILE
+
+//FRT_PROFILE=<file> profiles a run in the interpreter at function and loop granularity
+//calls, loop entries and back edges are plain counters bumped as the interpreter goes, and time comes from a
+//SIGPROF sampler (FRT_PROFILE_HZ per second of cpu time, default 1000) that copies a shadow stack of the
+//active functions and loops, so the cost per call is a push and a pop and per loop iteration one counter
+//on bench/ the median of ten paired runs of the profile path against interp is between -2% and +2.4%
+//the samples are written to <file> as folded stacks for flamegraph.pl, and a text report goes to stderr
+//functions already promoted to native code are not seen, their time counts towards the interpreted caller
+struct ProfileNode {
+	string name;
+	long calls;
+	long backEdges;
+	long selfSamples;
+	long totalSamples;
+	//the last sample that counted towards totalSamples, so recursion is only counted once
+	long lastSample;
+	//a loop's function, which the report credits with the loop's back edges
+	ProfileNode* function;
+};
+
+static const int profileMaxDepth = 1024;
+static const size_t profileMaxSamples = 1 << 16;
+static const size_t profileBufferSize = 1 << 20;
+
+static vector<unique_ptr<ProfileNode> > profileNodes;
+static string profileFile;
+static long profileHz;
+static chrono::steady_clock::time_point profileStartTime;
+static double profileStartCpu;
+
+//written by the interpreter and read by the signal handler on the same thread
+static ProfileNode* volatile profileStack[profileMaxDepth];
+static volatile sig_atomic_t profileDepth;
+
+//filled in by the signal handler, which must not allocate
+static ProfileNode* profileBuffer[profileBufferSize];
+static size_t profileUsed;
+static int profileSampleDepth[profileMaxSamples];
+static size_t profileSamples;
+static volatile long profileDropped;
+
+//loops are named after their function and the line they start on, e.g. fib:while@3
+//kept out of line so profileEnter stays small
+static __attribute__((noinline)) ProfileNode* profileNode(Function* function, While* loop) {
+	string name = loop ? function->proto->fnName->name+":while@"+to_string(loop->line) : function->proto->fnName->name;
+	ProfileNode* parent = loop ? (function->profile ? function->profile : profileNode(function, nullptr)) : nullptr;
+	profileNodes.push_back(unique_ptr<ProfileNode>(new ProfileNode {name, 0, 0, 0, 0, -1, parent}));
+	return (loop ? loop->profile : function->profile) = profileNodes.back().get();
+}
+
+static ProfileNode* profileEnter(Function* function, While* loop) {
+	ProfileNode* node = loop ? loop->profile : function->profile;
+	if (__builtin_expect(!node, 0)) {
+		node = profileNode(function, loop);
+	}
+	node->calls++;
+
+	//frames past the maximum depth still count, they are just left out of the samples
+	int depth = profileDepth;
+	if (depth < profileMaxDepth) {
+		profileStack[depth] = node;
+	}
+	atomic_signal_fence(memory_order_seq_cst);
+	profileDepth = depth + 1;
+	return node;
+}
+
+//one counter per iteration, a function's back edges are added up from its loops in the report
+static void profileBackEdge(ProfileNode* node) {
+	node->backEdges++;
+}
+
+static void profileLeave() {
+	profileDepth = profileDepth - 1;
+}
+
+static void profileSignal(int) {
+	int depth = min((int)profileDepth, profileMaxDepth);
+	if (profileSamples == profileMaxSamples || profileUsed + depth > profileBufferSize) {
+		profileDropped = profileDropped + 1;
+		return;
+	}
+	for (int i = 0; i < depth; i++) {
+		profileBuffer[profileUsed + i] = profileStack[i];
+	}
+	profileUsed += depth;
+	profileSampleDepth[profileSamples++] = depth;
+}
+
+static void profileTimer(long hz) {
+	struct itimerval timer;
+	timer.it_interval.tv_sec = 0;
+	timer.it_interval.tv_usec = hz ? 1000000 / hz : 0;
+	timer.it_value = timer.it_interval;
+	setitimer(ITIMER_PROF, &timer, 0);
+}
+
+static double profileCpuMs() {
+	struct timespec now;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+	return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
+
+static void profileStart(const string& file, long hz) {
+	if (hz <= 0 || hz > 1000000) {
+		error("FRT_PROFILE_HZ must be between 1 and 1000000");
+	}
+	profileFile = file;
+	profileHz = hz;
+	profiling = true;
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = profileSignal;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGPROF, &action, 0);
+
+	profileStartTime = chrono::steady_clock::now();
+	profileStartCpu = profileCpuMs();
+	profileTimer(hz);
+}
+
+static void profileConfigure() {
+	string file = envOr("FRT_PROFILE", "");
+	if (!file.empty()) {
+		profileStart(file, atol(envOr("FRT_PROFILE_HZ", "1000").c_str()));
+	}
+}
+
+static void profileStop() {
+	profileTimer(0);
+	signal(SIGPROF, SIG_IGN);
+	profiling = false;
+}
+
+static void profileReport(ostream& out) {
+	double wallMs = chrono::duration<double, milli>(chrono::steady_clock::now() - profileStartTime).count();
+	double cpuMs = profileCpuMs() - profileStartCpu;
+	profileStop();
+
+	map<string, long> folded;
+	size_t offset = 0;
+	for (size_t sample = 0; sample < profileSamples; sample++) {
+		int depth = profileSampleDepth[sample];
+		ProfileNode** stack = &profileBuffer[offset];
+		offset += depth;
+		if (depth == 0) {
+			continue;
+		}
+
+		string key;
+		for (int i = 0; i < depth; i++) {
+			key += (i ? ";" : "")+stack[i]->name;
+			if (stack[i]->lastSample != (long)sample) {
+				stack[i]->lastSample = sample;
+				stack[i]->totalSamples++;
+			}
+		}
+		stack[depth-1]->selfSamples++;
+		folded[key]++;
+	}
+
+	ofstream foldedOut(profileFile);
+	if (!foldedOut) {
+		error("Could not write "+profileFile);
+	}
+	for (auto const& entry : folded) {
+		foldedOut << entry.first << " " << entry.second << endl;
+	}
+
+	//the kernel may deliver fewer signals than asked for, so a sample is worth its share of the cpu time
+	double sampleMs = profileSamples ? cpuMs / (profileSamples + profileDropped) : 0;
+	out << "profile: " << profileSamples << " samples (" << profileHz << " Hz asked for), "
+		<< profileDropped << " dropped, " << cpuMs << " ms cpu, " << wallMs << " ms wall, folded stacks in " << profileFile << endl;
+
+	vector<ProfileNode*> nodes;
+	for (auto const& node : profileNodes) {
+		nodes.push_back(node.get());
+		if (node->function) {
+			node->function->backEdges += node->backEdges;
+		}
+	}
+	sort(nodes.begin(), nodes.end(), [](ProfileNode* a, ProfileNode* b) {
+		return a->selfSamples != b->selfSamples ? a->selfSamples > b->selfSamples : a->name < b->name;
+	});
+	out << "function/loop\tcalls\tback-edges\tinclusive ms\tinclusive %\texclusive ms\texclusive %" << endl;
+	for (ProfileNode* node : nodes) {
+		out << node->name << "\t" << node->calls << "\t" << node->backEdges
+			<< "\t" << node->totalSamples * sampleMs << "\t" << (profileSamples ? 100.0 * node->totalSamples / profileSamples : 0)
+			<< "\t" << node->selfSamples * sampleMs << "\t" << (profileSamples ? 100.0 * node->selfSamples / profileSamples : 0) << endl;
+	}
+}
+
+
+
+
+
+
+
+
+
+//MEMO
+
+//a function is pure when its result depends on nothing but its arguments and calling it changes nothing else
+//statements can only reach their own frame, so the one way to become impure is to call an impure function;
+//this starts from every function being pure and takes that away until nothing changes
+static void analyzePurity() {
+	for (auto const& entry : functions) {
+		entry.second->pure = true;
+	}
+
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (auto const& entry : functions) {
+			Function* function = entry.second;
+			if (!function->pure) {
+				continue;
+			}
+			vector<Prototype*> calls;
+			function->collectCalls(calls);
+			for (Prototype* call : calls) {
+				if (!call->callee->pure) {
+					function->pure = false;
+					changed = true;
+					break;
+				}
+			}
+		}
+	}
+}
+
+//functions with more arguments than this are not memoized, so a key fits in a fixed-width array
+static const int memoMaxArgs = 8;
+
+static uint64_t memoHash(const uint64_t* bits, size_t arity);
+
+//the exact bits of the arguments, unused words zero
+struct MemoKey {
+	uint64_t bits[memoMaxArgs];
+
+	bool operator==(const MemoKey& other) const {
+		return memcmp(bits, other.bits, sizeof(bits)) == 0;
+	}
+};
+
+struct MemoKeyHash {
+	size_t operator()(const MemoKey& key) const {
+		return memoHash(key.bits, memoMaxArgs);
+	}
+};
+
+//bounded cache of a pure function's results, keyed on the exact bits of its arguments
+//"direct" maps each key to one slot and overwrites whatever was there, "lru" evicts the least recently used entry
+struct MemoCache {
+	string policy;
+	size_t arity;
+	size_t capacity;
+
+	//direct: capacity slots of {valid, arguments..., result}
+	vector<uint64_t> slots;
+
+	//lru: most recently used first
+	list<pair<MemoKey, double> > order;
+	unordered_map<MemoKey, list<pair<MemoKey, double> >::iterator, MemoKeyHash> index;
+
+	long hits;
+	long misses;
+	long evictions;
+};
+
+struct MemoConfig {
+	//"off", "direct" or "lru"
+	string policy;
+	size_t size;
+};
+
+static MemoConfig memo = {"off", 4096};
+
+//the murmur3 finalizer for each word, since small integral doubles only differ in their top bits
+static uint64_t memoHash(const uint64_t* bits, size_t arity) {
+	uint64_t hash = 0x9e3779b97f4a7c15ULL;
+	for (size_t i = 0; i < arity; i++) {
+		hash ^= bits[i];
+		hash ^= hash >> 33;
+		hash *= 0xff51afd7ed558ccdULL;
+		hash ^= hash >> 33;
+		hash *= 0xc4ceb9fe1a85ec53ULL;
+		hash ^= hash >> 33;
+	}
+	return hash;
+}
+
+static double memoCall(Function* function, const double* args) {
+	MemoCache* cache = function->memo;
+	const uint64_t* bits = (const uint64_t*)args;
+
+	if (cache->policy == "direct") {
+		size_t width = cache->arity + 2;
+		uint64_t* slot = &cache->slots[(memoHash(bits, cache->arity) & (cache->capacity - 1)) * width];
+		if (slot[0] && memcmp(slot + 1, bits, sizeof(uint64_t) * cache->arity) == 0) {
+			cache->hits++;
+			double result;
+			memcpy(&result, slot + width - 1, sizeof(result));
+			return result;
+		}
+
+		cache->misses++;
+		double result = runFunction(function, args);
+		//the call may have filled the same slot in the meantime, recursion included, which only
+		//counts as an eviction when it holds some other key
+		if (slot[0] && memcmp(slot + 1, bits, sizeof(uint64_t) * cache->arity) != 0) {
+			cache->evictions++;
+		}
+		slot[0] = 1;
+		memcpy(slot + 1, bits, sizeof(uint64_t) * cache->arity);
+		memcpy(slot + width - 1, &result, sizeof(result));
+		return result;
+	}
+
+	MemoKey key = {};
+	memcpy(key.bits, bits, sizeof(uint64_t) * cache->arity);
+	auto found = cache->index.find(key);
+	if (found != cache->index.end()) {
+		cache->hits++;
+		cache->order.splice(cache->order.begin(), cache->order, found->second);
+		return found->second->second;
+	}
+
+	cache->misses++;
+	double result = runFunction(function, args);
+	//a recursive call may have cached this key already
+	if (cache->index.find(key) == cache->index.end()) {
+		if (cache->order.size() == cache->capacity) {
+			cache->index.erase(cache->order.back().first);
+			cache->order.pop_back();
+			cache->evictions++;
+		}
+		cache->order.push_front(make_pair(key, result));
+		cache->index[key] = cache->order.begin();
+	}
+	return result;
+}
+
+//gives every pure function an empty cache, or takes them away when the policy is off
+static void memoReset() {
+	analyzePurity();
+	for (auto const& entry : functions) {
+		Function* function = entry.second;
+		delete function->memo;
+		function->memo = nullptr;
+		if (memo.policy == "off" || !function->pure || function->proto->args.size() > (size_t)memoMaxArgs) {
+			continue;
+		}
+
+		MemoCache* cache = new MemoCache();
+		cache->policy = memo.policy;
+		cache->arity = function->proto->args.size();
+		cache->capacity = max((size_t)1, memo.size);
+		if (memo.policy == "direct") {
+			//a power of two, so a slot is just the low bits of the hash
+			size_t capacity = 1;
+			while (capacity < cache->capacity) {
+				capacity *= 2;
+			}
+			cache->capacity = capacity;
+			cache->slots.assign(capacity * (cache->arity + 2), 0);
+		}
+		function->memo = cache;
+	}
+}
+
+//FRT_MEMO picks the policy and FRT_MEMO_SIZE the number of entries per function
+static void memoConfigure() {
+	memo.policy = envOr("FRT_MEMO", memo.policy);
+	memo.size = strtoul(envOr("FRT_MEMO_SIZE", to_string(memo.size)).c_str(), 0, 10);
+	if (memo.policy != "off" && memo.policy != "direct" && memo.policy != "lru") {
+		error("FRT_MEMO must be off, direct or lru");
+	}
+	memoReset();
+}
+
+static void memoStats(ostream& out) {
+	out << "memo stats: policy " << memo.policy << ", " << memo.size << " entries per function" << endl;
+	out << "function\tpure\thits\tmisses\thit rate\tevictions" << endl;
+	for (auto const& entry : functions) {
+		Function* function = entry.second;
+		out << entry.first << "\t" << (function->pure ? "yes" : "no");
+		MemoCache* cache = function->memo;
+		if (cache) {
+			long lookups = cache->hits + cache->misses;
+			out << "\t" << cache->hits << "\t" << cache->misses
+				<< "\t" << (lookups ? 100.0 * cache->hits / lookups : 0) << "%"
+				<< "\t" << cache->evictions << endl;
+		}
+		else {
+			out << "\t-\t-\t-\t-" << endl;
+		}
+	}
+}
+
+//frt -memobench <function> [args...]
+//times the interpreter without a cache and with each policy
+static void memoBenchmark(Function* function, const vector<double>& args) {
+	double baseline = 0;
+	for (string policy : {"off", "direct", "lru"}) {
+		memo.policy = policy;
+		memoReset();
+
+		auto start = chrono::steady_clock::now();
+		double result = callFunction(function, args.data());
+		double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		if (policy == "off") {
+			baseline = seconds;
+		}
+
+		cout << policy << ": " << result << " in " << seconds * 1000 << " ms, " << baseline / seconds << "x";
+		if (function->memo) {
+			long lookups = function->memo->hits + function->memo->misses;
+			cout << ", " << (lookups ? 100.0 * function->memo->hits / lookups : 0) << "% hits";
+		}
+		cout << endl;
+	}
+}
+
+
+
+
+
+
+
+
+
+//BATCH
+
+//evaluates one function over many rows at once: every variable holds a column of batchRows values,
+//and statements run under a mask of the rows they apply to, so if and while never branch per row
+//calls are followed into the callee on the same rows, except into recursive functions, which can't be
+//unrolled into columns and are called once per row instead
+static const int batchLanes = sizeof(BatchVec) / sizeof(double);
+static const int batchVecs = 32;
+static const int batchRows = batchVecs * batchLanes;
+
+//each kernel is built for AVX-512, AVX2 and baseline SSE2, and the best one the CPU supports is picked at load time
+#define BATCH_KERNEL __attribute__((target_clones("avx512f", "avx2", "default")))
+
+BATCH_KERNEL static void batchArith(char op, BatchVec* out, const BatchVec* rhs) {
+	switch (op) {
+		case '+':
+			for (int i = 0; i < batchVecs; i++) out[i] += rhs[i];
+			break;
+		case '-':
+			for (int i = 0; i < batchVecs; i++) out[i] -= rhs[i];
+			break;
+		case '*':
+			for (int i = 0; i < batchVecs; i++) out[i] *= rhs[i];
+			break;
+		case '/':
+			for (int i = 0; i < batchVecs; i++) out[i] /= rhs[i];
+			break;
+	}
+}
+
+BATCH_KERNEL static void batchBroadcast(BatchVec* out, double value) {
+	for (int i = 0; i < batchVecs; i++) {
+		out[i] = value - (BatchVec){};
+	}
+}
+
+//dst = mask ? src : dst
+BATCH_KERNEL static void batchBlend(BatchVec* dst, const BatchVec* src, const BatchMask* mask) {
+	for (int i = 0; i < batchVecs; i++) {
+		dst[i] = (BatchVec)((mask[i] & (BatchMask)src[i]) | (~mask[i] & (BatchMask)dst[i]));
+	}
+}
+
+//out = the rows of mask whose value is nonzero, returns whether there are any
+BATCH_KERNEL static bool batchTruth(BatchMask* out, const BatchVec* value, const BatchMask* mask) {
+	BatchMask any = {};
+	BatchVec zero = {};
+	for (int i = 0; i < batchVecs; i++) {
+		out[i] = mask[i] & (value[i] != zero);
+		any |= out[i];
+	}
+	for (int i = 0; i < batchLanes; i++) {
+		if (any[i]) {
+			return true;
+		}
+	}
+	return false;
+}
+
+//out = mask & ~except, returns whether any rows are left
+BATCH_KERNEL static bool batchExcept(BatchMask* out, const BatchMask* mask, const BatchMask* except) {
+	BatchMask any = {};
+	for (int i = 0; i < batchVecs; i++) {
+		out[i] = mask[i] & ~except[i];
+		any |= out[i];
+	}
+	for (int i = 0; i < batchLanes; i++) {
+		if (any[i]) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static double& batchLane(BatchVec* column, int row) {
+	return ((double*)column)[row];
+}
+
+static bool batchLaneSet(const BatchMask* mask, int row) {
+	return ((const int64_t*)mask)[row] != 0;
+}
+
+//state of the innermost function being evaluated, per thread
+static thread_local BatchVec* batchFrame;
+static thread_local BatchVec* batchResult;
+static thread_local BatchMask* batchReturned;
+
+//filled in by batchPrepare(), read-only while batches run
+static map<Function*, bool> batchRecursive;
+static map<Function*, NativeEntry> batchEntries;
+static bool batchThreadSafe;
+
+static BatchVec* batchColumn(BatchVec* frame, int slot) {
+	return frame + slot * batchVecs;
+}
+
+static BatchVec* batchAllocFrame(Function* function) {
+	size_t size = sizeof(BatchVec) * batchVecs * max((size_t)1, function->variables.size());
+	BatchVec* frame = (BatchVec*)aligned_alloc(alignof(BatchVec), size);
+	if (!frame) {
+		error("Out of memory for batch frame");
+	}
+	//every local starts out as 0
+	memset(frame, 0, size);
+	return frame;
+}
+
+//runs the body of function on the rows in mask, with its arguments already in frame
+static void batchBody(Function* function, BatchVec* frame, BatchVec* out, const BatchMask* mask) {
+	BatchVec* callerFrame = batchFrame;
+	BatchVec* callerResult = batchResult;
+	BatchMask* callerReturned = batchReturned;
+
+	BatchMask returned[batchVecs] = {};
+	BatchMask live[batchVecs];
+	memset(out, 0, sizeof(BatchVec) * batchVecs);
+	batchFrame = frame;
+	batchResult = out;
+	batchReturned = returned;
+
+	for (auto const& statement : function->statementList) {
+		if (!batchExcept(live, mask, returned)) {
+			break;
+		}
+		statement->evalBatch(nullptr, live);
+	}
+
+	batchFrame = callerFrame;
+	batchResult = callerResult;
+	batchReturned = callerReturned;
+}
+
+void Identifier::evalBatch(BatchVec* out, const BatchMask* mask) {
+	memcpy(out, batchColumn(batchFrame, slot), sizeof(BatchVec) * batchVecs);
+}
+
+void Number::evalBatch(BatchVec* out, const BatchMask* mask) {
+	batchBroadcast(out, value);
+}
+
+void Prototype::evalBatch(BatchVec* out, const BatchMask* mask) {
+	if (batchRecursive.at(callee)) {
+		auto found = batchEntries.find(callee);
+		NativeEntry entry = found == batchEntries.end() ? nullptr : found->second;
+		double* values = (double*)alloca(sizeof(double) * (args.size() + 1));
+		for (int row = 0; row < batchRows; row++) {
+			if (!batchLaneSet(mask, row)) {
+				continue;
+			}
+			for (size_t i = 0; i < args.size(); i++) {
+				values[i] = batchLane(batchColumn(batchFrame, args[i]->slot), row);
+			}
+			batchLane(out, row) = entry ? entry(values) : interpret(callee, values);
+		}
+		return;
+	}
+
+	BatchVec* frame = batchAllocFrame(callee);
+	for (size_t i = 0; i < args.size(); i++) {
+		memcpy(batchColumn(frame, i), batchColumn(batchFrame, args[i]->slot), sizeof(BatchVec) * batchVecs);
+	}
+	batchBody(callee, frame, out, mask);
+	free(frame);
+}
+
+void Factor::evalBatch(BatchVec* out, const BatchMask* mask) {
+	node->evalBatch(out, mask);
+}
+
+//the operators are applied by Term and Expression, which fold their chains left to right
+void TermOp::evalBatch(BatchVec* out, const BatchMask* mask) {}
+
+void ExprOp::evalBatch(BatchVec* out, const BatchMask* mask) {}
+
+void Term::evalBatch(BatchVec* out, const BatchMask* mask) {
+	lhs->evalBatch(out, mask);
+	BatchVec rhsValue[batchVecs];
+	for (Term* term = this; term->op; term = term->rhs.get()) {
+		term->rhs->lhs->evalBatch(rhsValue, mask);
+		batchArith(term->op->name[0], out, rhsValue);
+	}
+}
+
+void Expression::evalBatch(BatchVec* out, const BatchMask* mask) {
+	lhs->evalBatch(out, mask);
+	BatchVec rhsValue[batchVecs];
+	for (Expression* expr = this; expr->op; expr = expr->rhs.get()) {
+		expr->rhs->lhs->evalBatch(rhsValue, mask);
+		batchArith(expr->op->name[0], out, rhsValue);
+	}
+}
+
+void Assignment::evalBatch(BatchVec* out, const BatchMask* mask) {
+	BatchVec value[batchVecs];
+	rhs->evalBatch(value, mask);
+	batchBlend(batchColumn(batchFrame, lhs->slot), value, mask);
+}
+
+void Condition::evalBatch(BatchVec* out, const BatchMask* mask) {
+	value->evalBatch(out, mask);
+}
+
+void If::evalBatch(BatchVec* out, const BatchMask* mask) {
+	BatchVec value[batchVecs];
+	BatchMask taken[batchVecs];
+	condition->evalBatch(value, mask);
+	if (!batchTruth(taken, value, mask)) {
+		return;
+	}
+	for (auto const& statement : statementList) {
+		statement->evalBatch(nullptr, taken);
+	}
+}
+
+//rows drop out of the loop one by one, and it ends when none are left
+void While::evalBatch(BatchVec* out, const BatchMask* mask) {
+	BatchVec value[batchVecs];
+	BatchMask live[batchVecs];
+	memcpy(live, mask, sizeof(live));
+	while (true) {
+		condition->evalBatch(value, live);
+		if (!batchTruth(live, value, live)) {
+			break;
+		}
+		for (auto const& statement : statementList) {
+			statement->evalBatch(nullptr, live);
+		}
+	}
+}
+
+void Statement::evalBatch(BatchVec* out, const BatchMask* mask) {
+	BatchVec value[batchVecs];
+	node->evalBatch(value, mask);
+}
+
+void Return::evalBatch(BatchVec* out, const BatchMask* mask) {
+	BatchVec value[batchVecs];
+	expr->evalBatch(value, mask);
+	batchBlend(batchResult, value, mask);
+	for (int i = 0; i < batchVecs; i++) {
+		batchReturned[i] |= mask[i];
+	}
+}
+
+static bool batchReaches(Function* from, Function* to, set<Function*>& seen) {
+	vector<Prototype*> calls;
+	from->collectCalls(calls);
+	for (Prototype* call : calls) {
+		if (call->callee == to) {
+			return true;
+		}
+		if (seen.insert(call->callee).second && batchReaches(call->callee, to, seen)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+//finds the recursive functions, and builds native code for calling them one row at a time
+static void batchPrepare() {
+	batchRecursive.clear();
+	batchEntries.clear();
+	bool anyRecursive = false;
+	for (auto const& entry : functions) {
+		set<Function*> seen;
+		batchRecursive[entry.second] = batchReaches(entry.second, entry.second, seen);
+		anyRecursive = anyRecursive || batchRecursive[entry.second];
+	}
+
+	bool asmSupported = true;
+	for (auto const& entry : functions) {
+		asmSupported = asmSupported && entry.second->proto->args.size() <= asmMaxArgs;
+	}
+	if (anyRecursive && asmSupported) {
+		asmCompile();
+		for (auto const& entry : functions) {
+			batchEntries[entry.second] = asmEntries[entry.first];
+		}
+	}
+	//the interpreter keeps its state in globals, so rows that fall back to it can only run on one thread
+	batchThreadSafe = !anyRecursive || asmSupported;
+}
+
+static void batchBlock(Function* function, const vector<const double*>& columns, double* results, size_t first, size_t rows) {
+	BatchVec* frame = batchAllocFrame(function);
+	for (size_t i = 0; i < columns.size(); i++) {
+		memcpy(batchColumn(frame, i), columns[i] + first, sizeof(double) * rows);
+	}
+
+	BatchMask mask[batchVecs] = {};
+	for (size_t row = 0; row < rows; row++) {
+		((int64_t*)mask)[row] = -1;
+	}
+
+	BatchVec out[batchVecs];
+	batchBody(function, frame, out, mask);
+	memcpy(results + first, out, sizeof(double) * rows);
+	free(frame);
+}
+
+//evaluates function once per row: columns[i][row] is its i-th argument, and results[row] receives its result
+//rows are handed out to the threads in chunks, call batchPrepare() first
+static void batchEval(Function* function, const vector<const double*>& columns, double* results, size_t rows, int threads) {
+	const size_t chunk = 16 * batchRows;
+	atomic<size_t> next(0);
+	auto worker = [&]() {
+		for (size_t start = next.fetch_add(chunk); start < rows; start = next.fetch_add(chunk)) {
+			size_t end = min(rows, start + chunk);
+			for (size_t first = start; first < end; first += batchRows) {
+				batchBlock(function, columns, results, first, min((size_t)batchRows, end - first));
+			}
+		}
+	};
+
+	if (!batchThreadSafe) {
+		threads = 1;
+	}
+	vector<thread> pool;
+	for (int i = 1; i < threads; i++) {
+		pool.push_back(thread(worker));
+	}
+	worker();
+	for (auto& t : pool) {
+		t.join();
+	}
+}
+
+//frt -batch <function> <rows> [threads]
+//compares a plain per-row call loop against batches, on arguments drawn from 0..15
+static void batchBenchmark(Function* function, size_t rows, int threads) {
+	size_t numArgs = function->proto->args.size();
+	vector<vector<double> > inputs(numArgs, vector<double>(rows));
+	uint64_t seed = 88172645463325252ULL;
+	for (auto& column : inputs) {
+		for (double& value : column) {
+			seed ^= seed << 13;
+			seed ^= seed >> 7;
+			seed ^= seed << 17;
+			value = seed % 16;
+		}
+	}
+	vector<const double*> columns;
+	for (auto const& column : inputs) {
+		columns.push_back(column.data());
+	}
+
+	auto report = [&](string name, std::function<void(double*)> run) {
+		vector<double> results(rows);
+		auto start = chrono::steady_clock::now();
+		run(results.data());
+		double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		cout << name << ": " << (long)(rows / seconds) << " rows/s" << endl;
+		return results;
+	};
+	auto perRow = [&](NativeEntry entry) {
+		return [&, entry](double* results) {
+			vector<double> values(numArgs + 1);
+			for (size_t row = 0; row < rows; row++) {
+				for (size_t i = 0; i < numArgs; i++) {
+					values[i] = inputs[i][row];
+				}
+				results[row] = entry ? entry(values.data()) : interpret(function, values.data());
+			}
+		};
+	};
+
+	vector<double> expected = report("per-row interp", perRow(nullptr));
+	if (numArgs <= asmMaxArgs) {
+		asmCompile();
+		report("per-row asm", perRow(asmEntries[function->proto->fnName->name]));
+	}
+
+	batchPrepare();
+	for (int n : {1, threads}) {
+		vector<double> results = report("batch, " + to_string(n) + " thread(s)", [&](double* out) {
+			batchEval(function, columns, out, rows, n);
+		});
+		if (memcmp(results.data(), expected.data(), sizeof(double) * rows) != 0) {
+			error("Batch results differ from the per-row interpreter");
+		}
+		if (threads == 1) {
+			break;
+		}
+	}
+}
+
+
+
+
+
+
+
+
+
+//BYTECODE
+
+//a stack machine over doubles, so a running function can be suspended anywhere and picked up later
+//instructions are defined with Function, which owns its code
+
+//the function being compiled, and how many values its code leaves on the operand stack at this point
+static vector<Instr>* byteCode;
+static int byteDepth;
+
+static size_t byteEmit(ByteOp op, int arg = 0, double value = 0, Function* callee = nullptr) {
+	Instr instr = {op, arg, value, callee};
+	byteCode->push_back(instr);
+	return byteCode->size() - 1;
+}
+
+void Identifier::byteGen() {
+	byteEmit(op_load, slot);
+	byteDepth++;
+}
+
+void Number::byteGen() {
+	byteEmit(op_const, 0, value);
+	byteDepth++;
+}
+
+//a prototype reached through an expression or statement is a call
+void Prototype::byteGen() {
+	for (auto const& arg : args) {
+		arg->byteGen();
+	}
+	byteEmit(op_call, args.size(), 0, callee);
+	byteDepth += 1 - (int)args.size();
+}
+
+void Factor::byteGen() {
+	node->byteGen();
+}
+
+void TermOp::byteGen() {
+	byteEmit(name == "*" ? op_mul : op_div);
+	byteDepth--;
+}
+
+void ExprOp::byteGen() {
+	byteEmit(name == "+" ? op_add : op_sub);
+	byteDepth--;
+}
+
+//term and expression chains are folded left to right
+void Term::byteGen() {
+	lhs->byteGen();
+	for (Term* term = this; term->op; term = term->rhs.get()) {
+		term->rhs->lhs->byteGen();
+		term->op->byteGen();
+	}
+}
+
+void Expression::byteGen() {
+	lhs->byteGen();
+	for (Expression* expr = this; expr->op; expr = expr->rhs.get()) {
+		expr->rhs->lhs->byteGen();
+		expr->op->byteGen();
+	}
+}
+
+void Assignment::byteGen() {
+	rhs->byteGen();
+	byteEmit(op_store, lhs->slot);
+	byteDepth--;
+}
+
+void Condition::byteGen() {
+	value->byteGen();
+}
+
+void If::byteGen() {
+	condition->byteGen();
+	size_t toEnd = byteEmit(op_jump_zero);
+	byteDepth--;
+	for (auto const& statement : statementList) {
+		statement->byteGen();
+	}
+	(*byteCode)[toEnd].arg = byteCode->size();
+}
+
+void While::byteGen() {
+	int loopTop = byteCode->size();
+	condition->byteGen();
+	size_t toEnd = byteEmit(op_jump_zero);
+	byteDepth--;
+	for (auto const& statement : statementList) {
+		statement->byteGen();
+	}
+	byteEmit(op_jump, loopTop);
+	(*byteCode)[toEnd].arg = byteCode->size();
+}
+
+void Statement::byteGen() {
+	//a call made for its own sake leaves a result nobody wants
+	int depth = byteDepth;
+	node->byteGen();
+	for (; byteDepth > depth; byteDepth--) {
+		byteEmit(op_pop);
+	}
+}
+
+void Return::byteGen() {
+	expr->byteGen();
+	byteEmit(op_return);
+	byteDepth--;
+}
+
+void Function::byteGen() {
+	bytecode.clear();
+	byteCode = &bytecode;
+	byteDepth = 0;
+	for (auto const& statement : statementList) {
+		statement->byteGen();
+	}
+	//falling off the end returns 0
+	byteEmit(op_const, 0, 0);
+	byteEmit(op_return);
+}
+
+
+
+
+
+
+
+
+
+//FIBERS
+
+//a fiber is one execution of a function with its own operand stack and call frames, both of which grow as needed
+//it runs until it has made a given number of calls and loop back edges, then yields so others get a turn
+struct FiberFrame {
+	Function* function;
+	size_t pc;
+	//index of the frame's first variable on the stack, its operands come after them
+	size_t base;
+};
+
+struct Fiber {
+	vector<double> stack;
+	vector<FiberFrame> frames;
+	double result;
+};
+
+static void fiberStart(Fiber* fiber, Function* function, const double* args) {
+	size_t numArgs = function->proto->args.size();
+	fiber->stack.assign(args, args + numArgs);
+	fiber->stack.resize(function->variables.size());
+	fiber->frames.clear();
+	FiberFrame frame = {function, 0, 0};
+	fiber->frames.push_back(frame);
+}
+
+//runs fiber until it finishes, or until it has passed slice yield points, returns whether it finished
+static bool fiberRun(Fiber* fiber, long slice) {
+	vector<double>& stack = fiber->stack;
+	FiberFrame* frame = &fiber->frames.back();
+	const Instr* code = frame->function->bytecode.data();
+	size_t pc = frame->pc;
+	size_t base = frame->base;
+
+	while (true) {
+		const Instr& instr = code[pc++];
+		switch (instr.op) {
+			case op_const:
+				stack.push_back(instr.value);
+				break;
+			case op_load:
+				stack.push_back(stack[base + instr.arg]);
+				break;
+			case op_store:
+				stack[base + instr.arg] = stack.back();
+				stack.pop_back();
+				break;
+			case op_pop:
+				stack.pop_back();
+				break;
+			case op_add:
+				stack[stack.size() - 2] += stack.back();
+				stack.pop_back();
+				break;
+			case op_sub:
+				stack[stack.size() - 2] -= stack.back();
+				stack.pop_back();
+				break;
+			case op_mul:
+				stack[stack.size() - 2] *= stack.back();
+				stack.pop_back();
+				break;
+			case op_div:
+				stack[stack.size() - 2] /= stack.back();
+				stack.pop_back();
+				break;
+			case op_jump_zero: {
+				double condition = stack.back();
+				stack.pop_back();
+				if (condition == 0) {
+					pc = instr.arg;
+				}
+				break;
+			}
+			case op_jump:
+				pc = instr.arg;
+				//a jump back is a loop back edge
+				if (--slice <= 0) {
+					frame->pc = pc;
+					return false;
+				}
+				break;
+			case op_call: {
+				//the arguments already on the stack become the callee's first variables
+				frame->pc = pc;
+				FiberFrame callee = {instr.callee, 0, stack.size() - instr.arg};
+				stack.resize(callee.base + instr.callee->variables.size());
+				fiber->frames.push_back(callee);
+				frame = &fiber->frames.back();
+				code = frame->function->bytecode.data();
+				pc = 0;
+				base = frame->base;
+				if (--slice <= 0) {
+					return false;
+				}
+				break;
+			}
+			case op_return: {
+				double result = stack.back();
+				stack.resize(base);
+				fiber->frames.pop_back();
+				if (fiber->frames.empty()) {
+					fiber->result = result;
+					return true;
+				}
+				stack.push_back(result);
+				frame = &fiber->frames.back();
+				code = frame->function->bytecode.data();
+				pc = frame->pc;
+				base = frame->base;
+				break;
+			}
+		}
+	}
+}
+
+//work-stealing pool: each worker runs fibers off the back of its own deque, and when that is empty
+//takes one off the front of another worker's; a fiber that yields goes to the front of its worker's deque
+struct FiberWorker {
+	mutex lock;
+	deque<Fiber*> fibers;
+};
+
+struct FiberPool {
+	vector<unique_ptr<FiberWorker> > workers;
+	atomic<long> remaining;
+	atomic<long> steals;
+	long slice;
+};
+
+static Fiber* fiberTake(FiberPool& pool, size_t self) {
+	FiberWorker& own = *pool.workers[self];
+	{
+		lock_guard<mutex> guard(own.lock);
+		if (!own.fibers.empty()) {
+			Fiber* fiber = own.fibers.back();
+			own.fibers.pop_back();
+			return fiber;
+		}
+	}
+	for (size_t i = 1; i < pool.workers.size(); i++) {
+		FiberWorker& victim = *pool.workers[(self + i) % pool.workers.size()];
+		lock_guard<mutex> guard(victim.lock);
+		if (!victim.fibers.empty()) {
+			Fiber* fiber = victim.fibers.front();
+			victim.fibers.pop_front();
+			pool.steals++;
+			return fiber;
+		}
+	}
+	return nullptr;
+}
+
+static void fiberWorker(FiberPool& pool, size_t self) {
+	while (pool.remaining > 0) {
+		Fiber* fiber = fiberTake(pool, self);
+		if (!fiber) {
+			this_thread::yield();
+			continue;
+		}
+		if (fiberRun(fiber, pool.slice)) {
+			pool.remaining--;
+		}
+		else {
+			lock_guard<mutex> guard(pool.workers[self]->lock);
+			pool.workers[self]->fibers.push_front(fiber);
+		}
+	}
+}
+
+//runs every fiber to completion on threads workers, returns the number of steals
+static long fiberRunAll(vector<Fiber>& fibers, int threads, long slice) {
+	FiberPool pool;
+	pool.remaining = fibers.size();
+	pool.steals = 0;
+	pool.slice = slice;
+	for (int i = 0; i < threads; i++) {
+		pool.workers.push_back(unique_ptr<FiberWorker>(new FiberWorker()));
+	}
+	for (size_t i = 0; i < fibers.size(); i++) {
+		pool.workers[i % threads]->fibers.push_back(&fibers[i]);
+	}
+
+	vector<thread> threadList;
+	for (int i = 1; i < threads; i++) {
+		threadList.push_back(thread(fiberWorker, ref(pool), i));
+	}
+	fiberWorker(pool, 0);
+	for (auto& t : threadList) {
+		t.join();
+	}
+	return pool.steals;
+}
+
+static void byteCompile() {
+	for (auto const& entry : functions) {
+		entry.second->byteGen();
+	}
+}
+
+//frt -fibers <function> <executions> <threads> [args...]
+//runs that many fibers of function at once, on 1, 2, 4... up to threads workers
+//FRT_FIBER_SLICE sets how many calls and back edges a fiber gets before it yields (default 1000)
+static void fiberBenchmark(Function* function, long executions, int maxThreads, const vector<double>& args) {
+	byteCompile();
+	long slice = atol(envOr("FRT_FIBER_SLICE", "1000").c_str());
+	double expected = interpret(function, args.data());
+
+	for (int threads = 1; ; threads = min(threads * 2, maxThreads)) {
+		vector<Fiber> fibers(executions);
+		auto start = chrono::steady_clock::now();
+		for (Fiber& fiber : fibers) {
+			fiberStart(&fiber, function, args.data());
+		}
+		long steals = fiberRunAll(fibers, threads, max(1L, slice));
+		double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+		for (Fiber const& fiber : fibers) {
+			if (fiber.result != expected && !(fiber.result != fiber.result && expected != expected)) {
+				error("Fiber result differs from the interpreter");
+			}
+		}
+		cout << threads << " thread(s): " << (long)(executions / seconds) << " executions/s, " << steals << " steals" << endl;
+		if (threads == maxThreads) {
+			break;
+		}
+	}
+}
+
+
+
+
+
+
+
+
+
+//BENCH
+
+//frt -bench <corpus dir> [baseline.json]
+//runs every program in the corpus along every execution path, each in a fresh process, and writes JSON to stdout
+//a program names its entry point and arguments in a comment line: # entry: fib 24
+//startup covers parsing and any compilation, steady state is the median of repeated calls after a warm-up call,
+//and memory is the child's peak resident set
+//each path runs in FRT_BENCH_RUNS fresh processes (default 5) and every metric is the median over them
+//the cxx path compiles into an empty cache, so its startup is a cold compile
+//a path that fails, or whose result differs from the interpreter's, is reported on stderr and the exit status is 1
+//given a baseline, so is a path that got worse by more than a tolerance in percent: FRT_BENCH_TOLERANCE for the
+//steady state, FRT_BENCH_STARTUP_TOLERANCE for startup, and FRT_BENCH_RSS_TOLERANCE for memory
+//the defaults are wider than the spread of reruns of one build on a shared machine, and startups under
+//FRT_BENCH_MIN_STARTUP_MS (default 5) are reported but never count, as they are mostly process creation
+static void parseProgram(vector<unique_ptr<Node> >& ast);
+
+struct BenchResult {
+	string program;
+	string path;
+	double startupMs;
+	double steadyMs;
+	long maxRssKb;
+	double result;
+	bool ok;
+};
+
+//profile is the interpreter with the profiler on, to keep an eye on its overhead
+static const char* benchPaths[] = {"interp", "profile", "bytecode", "tiered", "asm", "cxx"};
+
+static double benchSince(chrono::steady_clock::time_point start) {
+	return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+//the loaded object stays mapped after its file is gone
+static void benchRemoveDir(const string& dir) {
+	if (DIR* listing = opendir(dir.c_str())) {
+		while (struct dirent* entry = readdir(listing)) {
+			remove((dir + "/" + entry->d_name).c_str());
+		}
+		closedir(listing);
+	}
+	rmdir(dir.c_str());
+}
+
+//runs in the child: parse, prepare the path, then time calls
+static BenchResult benchChild(const string& file, const string& path, const string& entry, const vector<double>& args) {
+	BenchResult result = {"", path, 0, 0, 0, 0, false};
+	auto start = chrono::steady_clock::now();
+
+	if (!freopen(file.c_str(), "r", stdin)) {
+		error("Could not open "+file);
+	}
+	vector<unique_ptr<Node> > ast;
+	parseProgram(ast);
+	if (functions.find(entry) == functions.end()) {
+		error("No function "+entry+" in "+file);
+	}
+	Function* function = functions[entry];
+	if (function->proto->args.size() != args.size()) {
+		error("Wrong number of arguments to "+entry);
+	}
+	resolveCalls();
+
+	std::function<double()> run;
+	if (path == "interp") {
+		run = [&]() { return callFunction(function, args.data()); };
+	}
+	else if (path == "profile") {
+		profileStart("/dev/null", 1000);
+		run = [&]() { return callFunction(function, args.data()); };
+	}
+	else if (path == "bytecode") {
+		byteCompile();
+		run = [&]() {
+			Fiber fiber;
+			fiberStart(&fiber, function, args.data());
+			while (!fiberRun(&fiber, 1000)) {}
+			return fiber.result;
+		};
+	}
+	else if (path == "tiered") {
+		tierConfigure();
+		run = [&]() { return callFunction(function, args.data()); };
+	}
+	else if (path == "asm") {
+		asmCompile();
+		run = [&]() { return asmEntries[entry](args.data()); };
+	}
+	else if (path == "cxx") {
+		//a private cache, so the compile is never a hit left by an earlier run
+		char cache[] = "/tmp/frt-bench-XXXXXX";
+		if (!mkdtemp(cache)) {
+			error("Could not create a compile cache");
+		}
+		setenv("FRT_CACHE_DIR", cache, 1);
+		cxxCompile();
+		benchRemoveDir(cache);
+		run = [&]() { return cxxEntries[entry](args.data()); };
+	}
+	else {
+		error("Unknown path "+path);
+	}
+	result.startupMs = benchSince(start);
+
+	result.result = run();
+	//at least 5 calls and at least 200ms, the median is less noisy than the mean
+	vector<double> times;
+	auto total = chrono::steady_clock::now();
+	while (times.size() < 5 || benchSince(total) < 200) {
+		start = chrono::steady_clock::now();
+		run();
+		times.push_back(benchSince(start));
+	}
+	sort(times.begin(), times.end());
+	result.steadyMs = times[times.size()/2];
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	result.maxRssKb = usage.ru_maxrss;
+	result.ok = true;
+	return result;
+}
+
+static BenchResult benchRun(const string& file, const string& path, const string& entry, const vector<double>& args) {
+	int fds[2];
+	if (pipe(fds) != 0) {
+		error("Could not create pipe");
+	}
+	cout.flush();
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		//error() reports on stdout, which belongs to the JSON
+		close(fds[0]);
+		dup2(2, 1);
+		BenchResult result = benchChild(file, path, entry, args);
+		char line[256];
+		int length = snprintf(line, sizeof(line), "%.17g %.17g %ld %.17g\n", result.startupMs, result.steadyMs, result.maxRssKb, result.result);
+		if (write(fds[1], line, length) != length) {
+			_exit(1);
+		}
+		_exit(0);
+	}
+
+	close(fds[1]);
+	string output;
+	char buf[256];
+	ssize_t length;
+	while ((length = read(fds[0], buf, sizeof(buf))) > 0) {
+		output.append(buf, length);
+	}
+	close(fds[0]);
+	int status;
+	waitpid(pid, &status, 0);
+
+	BenchResult result = {"", path, 0, 0, 0, 0, false};
+	result.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0
+		&& sscanf(output.c_str(), "%lf %lf %ld %lf", &result.startupMs, &result.steadyMs, &result.maxRssKb, &result.result) == 4;
+	return result;
+}
+
+//the median of each metric over several runs, so one run on a busy machine moves none of them
+static BenchResult benchMedian(const string& file, const string& path, const string& entry, const vector<double>& args, int runs) {
+	vector<BenchResult> results;
+	for (int i = 0; i < runs; i++) {
+		results.push_back(benchRun(file, path, entry, args));
+		if (!results.back().ok) {
+			return results.back();
+		}
+	}
+	BenchResult result = results[0];
+	vector<double> startup, steady, rss;
+	for (BenchResult const& run : results) {
+		startup.push_back(run.startupMs);
+		steady.push_back(run.steadyMs);
+		rss.push_back(run.maxRssKb);
+	}
+	sort(startup.begin(), startup.end());
+	sort(steady.begin(), steady.end());
+	sort(rss.begin(), rss.end());
+	result.startupMs = startup[runs/2];
+	result.steadyMs = steady[runs/2];
+	result.maxRssKb = rss[runs/2];
+	return result;
+}
+
+static string benchField(const string& line, const string& name) {
+	size_t at = line.find("\"" + name + "\":");
+	if (at == string::npos) {
+		return "";
+	}
+	at += name.size() + 3;
+	while (at < line.size() && (line[at] == ' ' || line[at] == '"')) {
+		at++;
+	}
+	size_t end = line.find_first_of("\",}", at);
+	return line.substr(at, end - at);
+}
+
+//every program/path in a file written by -bench, one result per line
+static map<string, BenchResult> benchBaseline(const string& file) {
+	map<string, BenchResult> baseline;
+	ifstream in(file);
+	if (!in) {
+		error("Could not read baseline "+file);
+	}
+	string line;
+	while (getline(in, line)) {
+		string program = benchField(line, "program");
+		if (!program.empty() && benchField(line, "ok") == "true") {
+			BenchResult& result = baseline[program + "/" + benchField(line, "path")];
+			result.startupMs = strtod(benchField(line, "startup_ms").c_str(), 0);
+			result.steadyMs = strtod(benchField(line, "steady_ms").c_str(), 0);
+			result.maxRssKb = strtol(benchField(line, "max_rss_kb").c_str(), 0, 10);
+		}
+	}
+	return baseline;
+}
+
+static int benchMain(const string& dir, const string& baselineFile) {
+	vector<string> files;
+	DIR* listing = opendir(dir.c_str());
+	if (!listing) {
+		error("Could not open corpus "+dir);
+	}
+	while (struct dirent* entry = readdir(listing)) {
+		string name = entry->d_name;
+		if (name.size() > 4 && name.substr(name.size() - 4) == ".frt") {
+			files.push_back(name);
+		}
+	}
+	closedir(listing);
+	sort(files.begin(), files.end());
+
+	int runs = max(1, atoi(envOr("FRT_BENCH_RUNS", "5").c_str()));
+	vector<BenchResult> results;
+	for (string const& name : files) {
+		string file = dir + "/" + name;
+		ifstream in(file);
+		string line, entry;
+		vector<double> args;
+		while (getline(in, line)) {
+			if (line.compare(0, 9, "# entry: ") == 0) {
+				istringstream words(line.substr(9));
+				words >> entry;
+				double arg;
+				while (words >> arg) {
+					args.push_back(arg);
+				}
+				break;
+			}
+		}
+		if (entry.empty()) {
+			cerr << "skipping " << file << ": no # entry: line" << endl;
+			continue;
+		}
+
+		for (const char* path : benchPaths) {
+			BenchResult result = benchMedian(file, path, entry, args, runs);
+			result.program = name.substr(0, name.size() - 4);
+			results.push_back(result);
+		}
+	}
+
+	cout << "{\"results\": [" << endl;
+	for (size_t i = 0; i < results.size(); i++) {
+		BenchResult const& result = results[i];
+		char line[512];
+		snprintf(line, sizeof(line), "{\"program\": \"%s\", \"path\": \"%s\", \"ok\": %s, \"startup_ms\": %.4f, \"steady_ms\": %.4f, \"max_rss_kb\": %ld, \"result\": %.17g}",
+			result.program.c_str(), result.path.c_str(), result.ok ? "true" : "false",
+			result.startupMs, result.steadyMs, result.maxRssKb, result.result);
+		cout << line << (i + 1 < results.size() ? "," : "") << endl;
+	}
+	cout << "]}" << endl;
+
+	//every path of a program runs the same computation, so its result must match the interpreter's exactly
+	int failures = 0;
+	for (BenchResult const& result : results) {
+		string key = result.program + "/" + result.path;
+		if (!result.ok) {
+			cerr << key << ": failed" << endl;
+			failures++;
+			continue;
+		}
+		for (BenchResult const& reference : results) {
+			if (reference.program != result.program || reference.path != benchPaths[0] || !reference.ok) {
+				continue;
+			}
+			bool same = result.result == reference.result || (result.result != result.result && reference.result != reference.result);
+			if (!same) {
+				fprintf(stderr, "%s: result %.17g differs from %s's %.17g\n", key.c_str(), result.result, benchPaths[0], reference.result);
+				failures++;
+			}
+		}
+	}
+
+	if (baselineFile.empty()) {
+		return failures ? 1 : 0;
+	}
+
+	map<string, BenchResult> baseline = benchBaseline(baselineFile);
+	double tolerance = strtod(envOr("FRT_BENCH_TOLERANCE", "50").c_str(), 0);
+	double startupTolerance = strtod(envOr("FRT_BENCH_STARTUP_TOLERANCE", "50").c_str(), 0);
+	double rssTolerance = strtod(envOr("FRT_BENCH_RSS_TOLERANCE", "25").c_str(), 0);
+	double minStartup = strtod(envOr("FRT_BENCH_MIN_STARTUP_MS", "5").c_str(), 0);
+	int regressions = 0;
+	auto compare = [&](const string& key, const char* metric, double now, double before, const char* unit, double tolerance, bool counts) {
+		double change = 100 * (now / before - 1);
+		bool regressed = counts && change > tolerance;
+		regressions += regressed;
+		fprintf(stderr, "%s %s: %.4f %s vs %.4f %s (%+.1f%%)%s\n", key.c_str(), metric, now, unit, before, unit, change, regressed ? " REGRESSION" : "");
+	};
+	for (BenchResult const& result : results) {
+		string key = result.program + "/" + result.path;
+		auto found = baseline.find(key);
+		if (!result.ok) {
+			continue;
+		}
+		if (found == baseline.end() || found->second.steadyMs <= 0) {
+			cerr << key << ": no baseline" << endl;
+			continue;
+		}
+		BenchResult const& before = found->second;
+		compare(key, "steady", result.steadyMs, before.steadyMs, "ms", tolerance, true);
+		if (before.startupMs > 0) {
+			compare(key, "startup", result.startupMs, before.startupMs, "ms", startupTolerance, before.startupMs >= minStartup);
+		}
+		if (before.maxRssKb > 0) {
+			compare(key, "rss", result.maxRssKb, before.maxRssKb, "kB", rssTolerance, true);
+		}
+	}
+	return failures || regressions ? 1 : 0;
+}
+
+//reads functions from stdin up to an E or the end of input
+static void parseProgram(vector<unique_ptr<Node> >& ast) {
+	getToken();
+
+	vector<Token> tokens;
+
+	do {
+		tokens.push_back(curTok);
+
+		if (curTok.type == tok_eof) {
+			break;
+		}
+
+		unique_ptr<Function> function (parseFunction());
+		function->collectVariables(function->variables);
+		functions[function->proto->fnName->name] = function.get();
+		ast.push_back(move(function));
+
+		if (curTok.rawStrVal == "E") {
+			break;
+		}
+	} while (curTok.rawStrVal != "E");
+}
+
+//with no arguments, reads a program and prints its AST
+//-transpile writes the program as C++ to out.cpp
+//otherwise runs <function> from the program on the numbers that follow, e.g. frt -asm fib 20
+//-interp walks the AST, -asm runs the x86-64 backend, -cxx the transpiled C++ built by the system compiler,
+//and -tiered starts out interpreting and promotes hot functions to native code (stats on stderr with FRT_TIER_STATS=1)
+//FRT_PROFILE=<file> profiles -interp and -tiered runs, see PROFILE
+//FRT_MEMO=direct|lru caches the results of pure functions called from the interpreter (stats on stderr with FRT_MEMO_STATS=1)
+//frt -batch <function> <rows> [threads] benchmarks batch evaluation against a per-row loop
+//frt -memobench <function> [args...] times the interpreter with and without memoization
+//frt -fibers <function> <executions> <threads> [args...] runs many executions at once as fibers
+//frt -bench <corpus dir> [baseline.json] times a corpus of programs along every path, see BENCH
+int main(int argc, char* argv[]) {
+	string mode = argc > 1 ? argv[1] : "";
+	if (mode == "-bench") {
+		if (argc < 3) {
+			error("Usage: frt -bench <corpus dir> [baseline.json]");
+		}
+		return benchMain(argv[2], argc > 3 ? argv[3] : "");
+	}
+	if (mode.empty()) {
+		cout << "ready> ";
+	}
+	vector<unique_ptr<Node> > ast;
+	parseProgram(ast);
+
+	if (mode == "-transpile") {
+		ofstream("out.cpp") << transpileSource();
+		return 0;
+	}
+
+	if (!mode.empty()) {
+		if (argc < 3 || functions.find(argv[2]) == functions.end()) {
+			error("Usage: frt -asm <function> [args...]");
+		}
+		Function* function = functions[argv[2]];
+		resolveCalls();
+
+		if (mode == "-fibers") {
+			if (argc < 5) {
+				error("Usage: frt -fibers <function> <executions> <threads> [args...]");
+			}
+			vector<double> args;
+			for (int i = 5; i < argc; i++) {
+				args.push_back(strtod(argv[i], 0));
+			}
+			if (args.size() != function->proto->args.size()) {
+				error("Wrong number of arguments to "+string(argv[2]));
+			}
+			fiberBenchmark(function, atol(argv[3]), max(1, atoi(argv[4])), args);
+			return 0;
+		}
+
+		if (mode == "-batch") {
+			size_t rows = argc > 3 ? strtoul(argv[3], 0, 10) : 1000000;
+			int threads = argc > 4 ? atoi(argv[4]) : thread::hardware_concurrency();
+			batchBenchmark(function, rows, max(1, threads));
+			return 0;
+		}
+
+		vector<double> args;
+		for (int i = 3; i < argc; i++) {
+			args.push_back(strtod(argv[i], 0));
+		}
+		if (args.size() != function->proto->args.size()) {
+			error("Wrong number of arguments to "+string(argv[2]));
+		}
+
+		memoConfigure();
+		if (mode == "-interp") {
+			profileConfigure();
+			cout << callFunction(function, args.data()) << endl;
+		}
+		else if (mode == "-tiered") {
+			tierConfigure();
+			profileConfigure();
+			cout << callFunction(function, args.data()) << endl;
+			if (envOr("FRT_TIER_STATS", "") == "1") {
+				tierStats(cerr);
+			}
+		}
+		else if (mode == "-memobench") {
+			memoBenchmark(function, args);
+		}
+		else if (mode == "-asm") {
+			asmCompile();
+			cout << asmEntries[argv[2]](args.data()) << endl;
+		}
+		else if (mode == "-cxx") {
+			cxxCompile();
+			cout << cxxEntries[argv[2]](args.data()) << endl;
+		}
+		else {
+			error("Unknown mode "+mode);
+		}
+		if (profiling) {
+			profileReport(cerr);
+		}
+		if (envOr("FRT_MEMO_STATS", "") == "1") {
+			memoStats(cerr);
+		}
+		return 0;
+	}
+
+	cout << endl << endl << "AST: " << endl << endl;
+
+	for (auto const& node : ast) {
+		node->prettyPrint(0);
+	}
 	return 0;
 }
 
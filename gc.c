@@ -1,58 +1,482 @@
+//for dladdr, which names the frames of allocation sites
+#define _GNU_SOURCE
+#import <stddef.h>
 #import <stdio.h>
 #import <stdlib.h>
+#import <stdint.h>
+#import <string.h>
+#import <time.h>
+#import <pthread.h>
+#import <sched.h>
+#import <fcntl.h>
+#import <unistd.h>
+#import <sys/mman.h>
+#import <execinfo.h>
+#import <dlfcn.h>
+#import <malloc.h>
+#import <sys/resource.h>
+#import <sys/stat.h>
 
 #define STACK_MAX 256
-#define INITIAL_GC_THRESHOLD 1000
+//bytes of objects allocated before the first collection, and the least any collection allows before the next
+#define INITIAL_GC_THRESHOLD (1000 * sizeof(Object))
 
+//the range an adaptive heap keeps its growth factor in
+#define MIN_GROWTH_FACTOR 1.1
+#define MAX_GROWTH_FACTOR 64.0
+
+//the heap is carved into pages aligned on their size, each holding cells of a single size class
+#define PAGE_SIZE (64 * 1024)
+#define NUM_SIZE_CLASSES 15
+//objects bigger than the largest size class go to the large object space, each on pages of its own
+#define MAX_CELL_SIZE 2048
+#define LARGE_SIZE_CLASS (-1)
+
+//the capacity of the elements an array gets with its first append, doubled whenever they fill up
+#define ARRAY_INITIAL_CAPACITY 4
+
+//the mark stack starts small and doubles up to its limit, past which marking falls back to rescanning the heap
+#define MARK_STACK_INITIAL 256
+#define MARK_STACK_LIMIT (1024 * 1024)
+
+//each parallel mark worker has a fixed size deque, and a full one overflows into the same rescan
+//both sizes are powers of two
+#define MARK_DEQUE_SIZE (64 * 1024)
+//grey objects a worker keeps to itself before sharing them through its deque
+#define MARK_LOCAL_SIZE 256
+
+//pages allocation sweeps looking for a free cell before it gives up and makes a new page
+#define LAZY_SWEEP_PAGES 8
+
+//the allocation profiler keeps this many frames of each sampled stack, and up to this many distinct stacks
+#define MAX_SITE_FRAMES 8
+#define MAX_SITES 65535
+
+//heap dumps list this many of the objects retaining the most
+#define DUMP_TOP_RETAINERS 16
+
+const int sizeClasses[NUM_SIZE_CLASSES] = {16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048};
+
+//ints and floats are stored inline in a Value, only strings, pairs and arrays live on the heap
 typedef enum {
-	OBJ_INT,
-	OBJ_FLOAT,
+	//a cell on a free list
+	OBJ_FREE,
+	//a nursery object that has been copied out by a minor collection
+	OBJ_FORWARD,
 	OBJ_STRING,
-	OBJ_PAIR
+	OBJ_PAIR,
+	OBJ_ARRAY,
+	//the values of an array, only ever reached through it
+	OBJ_ELEMENTS,
+	NUM_OBJECT_TYPES
 } ObjectType;
 
-typedef struct sObject {
-	//each object retains a reference to the next in a linked list
-	//this is so we can walk through and find all unmarked objects to be collected in GC, even if the reference is lost to the language
-	struct sObject* next;
+const char* typeNames[NUM_OBJECT_TYPES] = {"free", "forward", "string", "pair", "array", "elements"};
+
+//a value is NaN-boxed into 64 bits: a number is stored as its double, and anything else hides in the payload of a quiet NaN
+//ints are tagged in bits 48-49 with the int in the low 32 bits, objects also set the sign bit and keep their pointer in the low 48 bits
+typedef uint64_t Value;
+
+#define QNAN ((uint64_t)0x7ffc000000000000)
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define TAG_INT ((uint64_t)0x0001000000000000)
+#define TAG_MASK ((uint64_t)0x0003000000000000)
 
-	//marker for check-sweep garbage collection
-	unsigned char marked;
+//mark bits are not kept in the object but in a bitmap of its page, so marking and sweeping never write to live objects
+typedef struct sObject {
+	//set while an old object is in the remembered set
+	unsigned char remembered;
+	//the allocation site a sampled object was recorded under, 0 for the others, kept in what would be padding
+	unsigned short site;
 	
 	ObjectType type;
 	
 	union {
-		//OBJ_INT
-		int value;
-
-		//OBJ_FLOAT
-		float fvalue;
+		//OBJ_FREE: the next free cell of the same size class
+		struct sObject* nextFree;
+		
+		//OBJ_FORWARD: where the object lives now, and during a compaction the next forwarded object whose copy is still to be scanned
+		struct {
+			struct sObject* forward;
+			struct sObject* nextForwarded;
+		};
 		
-		//OBJ_STRING
-		const char* text;
+		//OBJ_STRING: the characters follow the header, NUL terminated, and are owned by the object
+		struct {
+			int length;
+			uint32_t hash;
+			char chars[];
+		};
 		
 		//OBJ_PAIR
 		struct {
-			struct sObject* head;
-			struct sObject* tail;
+			Value head;
+			Value tail;
+		};
+		
+		//OBJ_ARRAY: the elements are an object of their own, so the array stays put while they grow, NULL until the first append
+		struct {
+			struct sObject* elements;
+		};
+		
+		//OBJ_ELEMENTS: the values follow the header, those past count are unused
+		struct {
+			int capacity;
+			int count;
+			Value values[];
 		};
 	};
 } Object;
 
+Value numberValue(double number) {
+	//any NaN that could be mistaken for a boxed value becomes the canonical one
+	if (number != number) {
+		return (uint64_t)0x7ff8000000000000;
+	}
+	Value value;
+	memcpy(&value, &number, sizeof(value));
+	return value;
+}
+
+Value intValue(int number) {
+	return QNAN | TAG_INT | (uint32_t)number;
+}
+
+Value objectValue(Object* object) {
+	return SIGN_BIT | QNAN | (uint64_t)(uintptr_t)object;
+}
+
+int isNumber(Value value) {
+	return (value & QNAN) != QNAN;
+}
+
+int isInt(Value value) {
+	return (value & (SIGN_BIT | QNAN | TAG_MASK)) == (QNAN | TAG_INT);
+}
+
+int isObject(Value value) {
+	return (value & (SIGN_BIT | QNAN)) == (SIGN_BIT | QNAN);
+}
+
+double asNumber(Value value) {
+	double number;
+	memcpy(&number, &value, sizeof(number));
+	return number;
+}
+
+int asInt(Value value) {
+	return (int)(uint32_t)value;
+}
+
+Object* asObject(Value value) {
+	return (Object*)(uintptr_t)(value & ~(SIGN_BIT | QNAN));
+}
+
+//every object lives in a cell of a page, so sweeping walks the pages instead of a list of objects
+//each page keeps its own free list, and the pages with free cells are chained up for allocation
+typedef struct sPage {
+	struct sPage* next;
+	struct sPage* nextAvailable;
+	struct sPage* prevAvailable;
+	int available;
+	int sizeClass;
+	int numCells;
+	//cells still in use after the last sweep
+	int liveCells;
+	Object* freeList;
+	//the mark epoch the page was last swept in, a page behind the VM's still has to be swept
+	int sweptEpoch;
+	//a large page holds a single object, and during a compaction links the large pages reached but not scanned yet
+	struct sPage* nextGrey;
+	//pages of a loaded heap image are mapped from its file, and unmapped instead of freed
+	int mapped;
+	//one mark bit per 16 bytes, all clear again once the page has been swept
+	uint64_t marks[PAGE_SIZE / 16 / 64];
+} Page;
+
+//cells start after the header, 16 byte aligned
+#define PAGE_HEADER ((sizeof(Page) + 15) & ~(size_t)15)
+
+typedef enum {
+	//a stop-the-world collection of the whole heap
+	GC_EVENT_FULL,
+	GC_EVENT_MINOR,
+	//the marking of an incremental cycle is over and its sweep begins
+	GC_EVENT_CYCLE
+} GCEventKind;
+
+//what one collection did, handed to the collection callback
+typedef struct {
+	GCEventKind kind;
+	//seconds the mutator was stopped, or for an incremental cycle how long its marking took while the mutator ran
+	double pause;
+	//freed since the previous event, and what the heap holds now
+	long objectsFreed;
+	long bytesFreed;
+	int objectsSurviving;
+	size_t bytesSurviving;
+	size_t heapBytes;
+} GCEvent;
+
+//called after every collection, it must not touch the heap
+typedef void (*GCCallback)(const GCEvent* event, void* data);
+
+typedef struct {
+	//bytes of nursery for young objects, rounded down to a multiple of 8, 0 allocates everything straight into the old generation
+	//objects that could never fit in the nursery are allocated old
+	size_t nurserySize;
+	
+	//collect the old generation a slice at a time instead of stopping the world
+	int incremental;
+	//the pause budget: objects marked or cells swept per slice, one slice per allocation
+	int sliceWork;
+	
+	//threads marking in parallel during a full collection
+	int markThreads;
+	
+	//automatic collections only mark, and each page is swept when allocation next needs it
+	int lazySweep;
+	
+	//full collections copy what is live into new pages instead of sweeping, packing it together breadth first
+	int compacting;
+	
+	//heap sizing: after a collection the live bytes may grow by this factor before the next one
+	double growthFactor;
+	//bytes of pages and nursery the heap never grows past, collecting first, 0 for no limit
+	size_t heapLimit;
+	//the share of time to spend collecting, adapting the growth factor to it, 0 keeps the growth factor fixed
+	double targetGCShare;
+	
+	//telemetry: an optional callback for every collection, and where freeVM writes the stats as JSON, if anywhere
+	GCCallback onCollection;
+	void* callbackData;
+	FILE* statsFile;
+	
+	//the allocation profiler records the stack of one allocation in this many, 0 turns it off
+	int allocationSampleRate;
+} GCConfig;
+
+//the stack an allocation was sampled at, and what was sampled there
+typedef struct {
+	void* frames[MAX_SITE_FRAMES];
+	int numFrames;
+	uint32_t hash;
+	long samples;
+	long bytes;
+} AllocationSite;
+
+typedef enum {
+	GC_IDLE,
+	GC_MARKING,
+	GC_SWEEPING
+} GCState;
+
+//pause times bucketed by powers of two of nanoseconds
+#define PAUSE_BUCKETS 40
+
+typedef struct {
+	long counts[PAUSE_BUCKETS];
+	long total;
+	double max;
+} PauseHistogram;
+
+//the heap size over time is sampled at collections, every other sample is dropped when the history fills up
+#define HEAP_HISTORY 256
+
+typedef struct {
+	//seconds since the VM was made
+	double time;
+	size_t heapBytes;
+	size_t liveBytes;
+} HeapSample;
+
+//everything the telemetry knows, as returned by gcStats
+typedef struct {
+	int collections;
+	int minorCollections;
+	int cycles;
+	long objectsAllocated;
+	long bytesAllocated;
+	long objectsFreed;
+	long bytesFreed;
+	int objectsSurviving;
+	size_t bytesSurviving;
+	size_t heapBytes;
+	size_t peakHeapBytes;
+	//of the heap bytes, those on large pages
+	size_t largeBytes;
+	//the heap sizing policy as it stands
+	size_t maxBytes;
+	double growthFactor;
+	double gcShare;
+	//full collections and incremental slices, minor collections, and pages swept by allocation
+	double totalPause;
+	double maxPause;
+	double totalMinorPause;
+	double maxMinorPause;
+	double totalLazySweep;
+	PauseHistogram pauses;
+	//oldest first, owned by the VM
+	const HeapSample* history;
+	int historySize;
+} GCStats;
+
 typedef struct {
-	//keep track of how many objects we've allocated so far
+	//keep track of how many objects we've allocated so far, and their bytes
 	int numObjects;
+	size_t numBytes;
 	
-	//number of objects required to trigger a GC 
-	int maxObjects;
+	//bytes of objects required to trigger a GC 
+	size_t maxBytes;
+	
+	//heap sizing, see GCConfig
+	double growthFactor;
+	size_t heapLimit;
+	double targetGCShare;
+	//the share of time spent collecting, smoothed over collections, and where the last measure of it ended
+	double gcShare;
+	double lastResize;
+	double lastGCTime;
+
+	//pages of each size class, and those of them with free cells
+	Page* pages[NUM_SIZE_CLASSES];
+	Page* available[NUM_SIZE_CLASSES];
+	int numPages;
+	
+	//the large object space: an object too big for any size class gets a run of pages to itself, which is never copied and is swept as a unit
+	Page* largePages;
+	int numLargePages;
+	size_t largeBytes;
+
+	//grey objects: marked, but with children still to be scanned
+	Object** markStack;
+	int markStackSize;
+	int markStackCapacity;
+	int markStackLimit;
+	//set when a grey object could not be pushed, so the heap has to be rescanned for it
+	int markStackOverflowed;
+	//objects marked so far, which is what survives once marking is over
+	int markedObjects;
+	size_t markedBytes;
+	
+	//with more than one thread, full collections mark in parallel
+	int markThreads;
+	int markDequeSize;
+
+	//young objects are bump allocated in the nursery, and survivors of a minor collection are promoted into the pages
+	char* nursery;
+	char* nurseryTop;
+	char* nurseryEnd;
+	int nurseryObjects;
+	size_t nurseryBytes;
+
+	//promoted objects whose fields still have to be evacuated, at most one per nursery object
+	Object** promoted;
+	int promotedSize;
+	size_t promotedBytes;
+
+	//old objects that may point into the nursery, kept up to date by the write barrier
+	Object** remembered;
+	int rememberedSize;
+	int rememberedCapacity;
 
-	//maintain reference to first object in list of all objects 
-	Object* firstObject;
+	//pause times in seconds, for full and minor collections
+	int numCollections;
+	double totalPause;
+	double maxPause;
+	int numMinorCollections;
+	double totalMinorPause;
+	double maxMinorPause;
+	//pages swept by allocation while a sweep is pending
+	int numLazySweeps;
+	double totalLazySweep;
+	double maxLazySweep;
 
-	Object* stack[STACK_MAX];
+	//incremental collection: where the current cycle is
+	int incremental;
+	int sliceWork;
+	GCState gcState;
+	int numCycles;
+	
+	//the sweep: pages still to sweep since marking last ended, and how far it has got in each size class
+	//slices go through the size classes in order, while allocation sweeps the class it needs
+	int lazySweep;
+	int markEpoch;
+	int pagesToSweep;
+	Page** sweepCursor[NUM_SIZE_CLASSES];
+	int sweepClass;
+	
+	//the intern table: one string per distinct text, open addressing with linear probing
+	//it is weak, collections drop the strings nothing else reaches
+	Object** strings;
+	int stringsSize;
+	int stringsCapacity;
+	
+	//compacting collection: the forwarded objects whose copies are still to be scanned
+	int compacting;
+	Object* scanQueue;
+	Object* scanQueueEnd;
+	Page* largeToScan;
+	//every pause, whether a full or minor collection or an incremental slice
+	PauseHistogram pauses;
+	
+	//telemetry: what has been freed so far and up to the last event, allocations are what is left plus what was freed
+	long objectsFreed;
+	long bytesFreed;
+	long reportedObjectsFreed;
+	long reportedBytesFreed;
+	size_t peakHeapBytes;
+	double startTime;
+	double cycleStart;
+	HeapSample history[HEAP_HISTORY];
+	int historySize;
+	//collections between two samples
+	int historyStride;
+	int historySkipped;
+	GCCallback onCollection;
+	void* callbackData;
+	FILE* statsFile;
+	
+	//the allocation profiler: allocations left before the next sample, and the sites sampled so far
+	//site 0 is never used, and a table of site indices finds a stack again
+	int sampleRate;
+	int sampleCountdown;
+	unsigned int sampleSeed;
+	AllocationSite* sites;
+	int numSites;
+	int sitesCapacity;
+	int* siteTable;
+	int siteTableCapacity;
+	
+	//mutator threads sharing the heap, the lock guards the pages and the counts
+	//a thread that needs to collect raises gcRequested and waits until every other mutator is parked at a safepoint
+	struct sMutator* mutators;
+	int numMutators;
+	int numParked;
+	int gcRequested;
+	pthread_mutex_t lock;
+	pthread_cond_t parked;
+	pthread_cond_t resumed;
+
+	Value stack[STACK_MAX];
 	int stackSize;
 } VM;
 
+//a thread allocating from a shared VM, with a stack of roots of its own
+//each size class allocates from the free cells of a page the mutator has taken for itself, so only taking a new page needs the lock
+typedef struct sMutator {
+	VM* vm;
+	struct sMutator* next;
+	Page* tlab[NUM_SIZE_CLASSES];
+	Object* freeCells[NUM_SIZE_CLASSES];
+	//allocations not yet added to the counts of the VM
+	int numObjects;
+	size_t numBytes;
+	
+	Value stack[STACK_MAX];
+	int stackSize;
+} Mutator;
+
 void assert(int condition, const char* message) {
 	if (!condition) {
 		printf("%s\n", message);
@@ -60,240 +484,4418 @@ void assert(int condition, const char* message) {
 	}
 }
 
-VM* newVM() {
+double now() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+GCConfig defaultGCConfig() {
+	GCConfig config;
+	config.nurserySize = 0;
+	config.incremental = 0;
+	config.sliceWork = 200;
+	config.markThreads = 1;
+	config.lazySweep = 1;
+	config.compacting = 0;
+	config.onCollection = NULL;
+	config.callbackData = NULL;
+	config.statsFile = NULL;
+	config.growthFactor = 2;
+	config.heapLimit = 0;
+	config.targetGCShare = 0;
+	config.allocationSampleRate = 0;
+	return config;
+}
+
+VM* newVMWith(GCConfig config) {
+	assert(!(config.compacting && config.incremental), "A compacting collector cannot be incremental! UNSWAG");
 	VM* vm = malloc(sizeof(VM));
 	vm->stackSize = 0;
-	vm->firstObject = NULL;
+	for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+		vm->pages[i] = NULL;
+		vm->available[i] = NULL;
+		vm->sweepCursor[i] = NULL;
+	}
+	vm->numPages = 0;
+	vm->largePages = NULL;
+	vm->numLargePages = 0;
+	vm->largeBytes = 0;
+	vm->markStack = NULL;
+	vm->markStackSize = 0;
+	vm->markStackCapacity = 0;
+	vm->markStackLimit = MARK_STACK_LIMIT;
+	vm->markStackOverflowed = 0;
+	vm->markedObjects = 0;
+	vm->markedBytes = 0;
+	vm->markThreads = config.markThreads > 0 ? config.markThreads : 1;
+	vm->markDequeSize = MARK_DEQUE_SIZE;
+	vm->nursery = NULL;
+	vm->nurseryTop = NULL;
+	vm->nurseryEnd = NULL;
+	vm->nurseryObjects = 0;
+	vm->nurseryBytes = 0;
+	vm->promoted = NULL;
+	vm->promotedSize = 0;
+	vm->promotedBytes = 0;
+	//objects are bumped 8 bytes at a time, so the end of the nursery has to be on that boundary too
+	config.nurserySize &= ~(size_t)7;
+	if (config.nurserySize > 0) {
+		vm->nursery = malloc(config.nurserySize);
+		vm->promoted = malloc(config.nurserySize / sizeof(Object) * sizeof(Object*));
+		assert(vm->nursery != NULL && vm->promoted != NULL, "Out of memory! UNSWAG");
+		vm->nurseryTop = vm->nursery;
+		vm->nurseryEnd = vm->nursery + config.nurserySize;
+	}
+	vm->remembered = NULL;
+	vm->rememberedSize = 0;
+	vm->rememberedCapacity = 0;
+	vm->numCollections = 0;
+	vm->totalPause = 0;
+	vm->maxPause = 0;
+	vm->numMinorCollections = 0;
+	vm->totalMinorPause = 0;
+	vm->maxMinorPause = 0;
+	vm->numLazySweeps = 0;
+	vm->totalLazySweep = 0;
+	vm->maxLazySweep = 0;
+	vm->incremental = config.incremental;
+	vm->sliceWork = config.sliceWork > 0 ? config.sliceWork : 1;
+	vm->gcState = GC_IDLE;
+	vm->numCycles = 0;
+	vm->lazySweep = config.lazySweep;
+	vm->markEpoch = 0;
+	vm->pagesToSweep = 0;
+	vm->sweepClass = 0;
+	vm->strings = NULL;
+	vm->stringsSize = 0;
+	vm->stringsCapacity = 0;
+	vm->compacting = config.compacting;
+	vm->scanQueue = NULL;
+	vm->scanQueueEnd = NULL;
+	vm->largeToScan = NULL;
+	memset(&vm->pauses, 0, sizeof(vm->pauses));
+	vm->objectsFreed = 0;
+	vm->bytesFreed = 0;
+	vm->reportedObjectsFreed = 0;
+	vm->reportedBytesFreed = 0;
+	vm->peakHeapBytes = 0;
+	vm->startTime = now();
+	vm->cycleStart = 0;
+	vm->historySize = 0;
+	vm->historyStride = 1;
+	vm->historySkipped = 0;
+	vm->onCollection = config.onCollection;
+	vm->callbackData = config.callbackData;
+	vm->statsFile = config.statsFile;
+	vm->sampleRate = config.allocationSampleRate > 0 ? config.allocationSampleRate : 0;
+	vm->sampleCountdown = vm->sampleRate;
+	vm->sampleSeed = 1;
+	vm->sites = NULL;
+	vm->numSites = 0;
+	vm->sitesCapacity = 0;
+	vm->siteTable = NULL;
+	vm->siteTableCapacity = 0;
+	vm->mutators = NULL;
+	vm->numMutators = 0;
+	vm->numParked = 0;
+	vm->gcRequested = 0;
+	pthread_mutex_init(&vm->lock, NULL);
+	pthread_cond_init(&vm->parked, NULL);
+	pthread_cond_init(&vm->resumed, NULL);
 	vm->numObjects = 0;
-	vm->maxObjects = INITIAL_GC_THRESHOLD;
+	vm->numBytes = 0;
+	vm->maxBytes = INITIAL_GC_THRESHOLD;
+	vm->growthFactor = config.growthFactor > 1 ? config.growthFactor : 2;
+	vm->heapLimit = config.heapLimit;
+	vm->targetGCShare = config.targetGCShare;
+	vm->gcShare = 0;
+	vm->lastResize = vm->startTime;
+	vm->lastGCTime = 0;
 	return vm;
 }
 
-void push(VM* vm, Object* value) {
+VM* newVM() {
+	return newVMWith(defaultGCConfig());
+}
+
+void push(VM* vm, Value value) {
 	assert(vm->stackSize < STACK_MAX, "Stack overflow! UNSWAG");
 	vm->stack[vm->stackSize++] = value;
 }
 
-Object* pop(VM* vm) {
+Value pop(VM* vm) {
 	assert(vm->stackSize > 0, "Stack underflow! UNSWAG");
 	return vm->stack[--vm->stackSize];
 }
 
-void gc(VM* vm) {
-	int numObjects = vm->numObjects;
-	
-	markAll(vm);
-	sweep(vm);
+void markAll(VM* vm);
+void sweep(VM* vm);
+void evacuateNursery(VM* vm);
 
-	//double threshold for garbage collection 
-	vm->maxObjects = numObjects * 2;
-	
-	printf("Collected %d objects, %d remaining.\n", numObjects - vm->numObjects, vm->numObjects);
+void recordHistogram(PauseHistogram* histogram, double pause) {
+	int bucket = 0;
+	for (double nanoseconds = pause * 1e9; nanoseconds >= 2 && bucket < PAUSE_BUCKETS - 1; nanoseconds /= 2) {
+		bucket++;
+	}
+	histogram->counts[bucket]++;
+	histogram->total++;
+	if (pause > histogram->max) {
+		histogram->max = pause;
+	}
 }
 
-Object* newObject(VM* vm, ObjectType type) {
-	//check if GC is needed before attempting to allocate any more
-	if (vm->numObjects == vm->maxObjects) {
-		gc(vm);
+//an upper bound on the given percentile, in seconds
+double pausePercentile(PauseHistogram* histogram, double percentile) {
+	long seen = 0;
+	for (int bucket = 0; bucket < PAUSE_BUCKETS; bucket++) {
+		seen += histogram->counts[bucket];
+		if (seen > 0 && seen >= percentile / 100 * histogram->total) {
+			double bound = (double)(2L << bucket) / 1e9;
+			return bound < histogram->max ? bound : histogram->max;
+		}
 	}
+	return histogram->max;
+}
 
-	Object* object = malloc(sizeof(Object));
-	object->marked = 0;
-	object->type = type;
-	
-	//insert object into list of allocated objects 
-	object->next = vm->firstObject;
-	vm->firstObject = object;
-	
-	//increment number of objects the VM has allocated 
-	vm->numObjects++;
-	
-	return object;
+double recordPause(VM* vm, double start, double* total, double* max) {
+	double pause = now() - start;
+	*total += pause;
+	if (pause > *max) {
+		*max = pause;
+	}
+	recordHistogram(&vm->pauses, pause);
+	return pause;
 }
 
-void pushInt(VM* vm, int intValue) {
-	Object* object = newObject(vm, OBJ_INT);
-	object->value = intValue;
-	push(vm, object);
+size_t heapBytes(VM* vm) {
+	return (size_t)vm->numPages * PAGE_SIZE + vm->largeBytes + (vm->nurseryEnd - vm->nursery);
 }
 
-void pushFloat(VM* vm, float floatValue) {
-	Object* object = newObject(vm, OBJ_FLOAT);
-	object->fvalue = floatValue;
-	push(vm, object);
+void updatePeak(VM* vm) {
+	if (heapBytes(vm) > vm->peakHeapBytes) {
+		vm->peakHeapBytes = heapBytes(vm);
+	}
 }
 
-void pushString(VM* vm, const char* text) {
-	Object* object = newObject(vm, OBJ_STRING);
-	object->text = text;
-	push(vm, object);
+//what survives a collection, anything that was counted before and is not any more was freed
+void setSurviving(VM* vm, int numObjects, size_t numBytes) {
+	vm->objectsFreed += vm->numObjects - numObjects;
+	vm->bytesFreed += (long)vm->numBytes - (long)numBytes;
+	vm->numObjects = numObjects;
+	vm->numBytes = numBytes;
 }
 
-Object* pushPair(VM* vm) {
-	Object* object = newObject(vm, OBJ_PAIR);
-	object->tail = pop(vm);
-	object->head = pop(vm);
+//samples the heap size and hands the collection to the callback
+void reportCollection(VM* vm, GCEventKind kind, double pause) {
+	if (++vm->historySkipped == vm->historyStride) {
+		vm->historySkipped = 0;
+		if (vm->historySize == HEAP_HISTORY) {
+			for (int i = 0; i < HEAP_HISTORY / 2; i++) {
+				vm->history[i] = vm->history[i * 2 + 1];
+			}
+			vm->historySize = HEAP_HISTORY / 2;
+			vm->historyStride *= 2;
+		}
+		HeapSample* sample = &vm->history[vm->historySize++];
+		sample->time = now() - vm->startTime;
+		sample->heapBytes = heapBytes(vm);
+		sample->liveBytes = vm->numBytes;
+	}
 	
-	push(vm, object);
-	return object;
+	if (vm->onCollection) {
+		GCEvent event;
+		event.kind = kind;
+		event.pause = pause;
+		event.objectsFreed = vm->objectsFreed - vm->reportedObjectsFreed;
+		event.bytesFreed = vm->bytesFreed - vm->reportedBytesFreed;
+		event.objectsSurviving = vm->numObjects;
+		event.bytesSurviving = vm->numBytes;
+		event.heapBytes = heapBytes(vm);
+		vm->onCollection(&event, vm->callbackData);
+	}
+	vm->reportedObjectsFreed = vm->objectsFreed;
+	vm->reportedBytesFreed = vm->bytesFreed;
 }
 
-void mark(Object* object) {
-	//if already marked, we're done. Check this first to prevent recursing on cycles of pairs that reference each other in the object graph
-	if (object->marked) {
-		return;
+GCStats gcStats(VM* vm) {
+	GCStats stats;
+	stats.collections = vm->numCollections;
+	stats.minorCollections = vm->numMinorCollections;
+	stats.cycles = vm->numCycles;
+	stats.objectsAllocated = vm->numObjects + vm->objectsFreed;
+	stats.bytesAllocated = vm->numBytes + vm->bytesFreed;
+	stats.objectsFreed = vm->objectsFreed;
+	stats.bytesFreed = vm->bytesFreed;
+	stats.objectsSurviving = vm->numObjects;
+	stats.bytesSurviving = vm->numBytes;
+	stats.heapBytes = heapBytes(vm);
+	stats.peakHeapBytes = vm->peakHeapBytes > stats.heapBytes ? vm->peakHeapBytes : stats.heapBytes;
+	stats.largeBytes = vm->largeBytes;
+	stats.maxBytes = vm->maxBytes;
+	stats.growthFactor = vm->growthFactor;
+	stats.gcShare = vm->gcShare;
+	stats.totalPause = vm->totalPause;
+	stats.maxPause = vm->maxPause;
+	stats.totalMinorPause = vm->totalMinorPause;
+	stats.maxMinorPause = vm->maxMinorPause;
+	stats.totalLazySweep = vm->totalLazySweep;
+	stats.pauses = vm->pauses;
+	stats.history = vm->history;
+	stats.historySize = vm->historySize;
+	return stats;
+}
+
+//the stats as a single JSON object
+void dumpGCStats(VM* vm, FILE* file) {
+	GCStats stats = gcStats(vm);
+	fprintf(file, "{\"collections\": %d, \"minorCollections\": %d, \"cycles\": %d, ", stats.collections, stats.minorCollections, stats.cycles);
+	fprintf(file, "\"objectsAllocated\": %ld, \"bytesAllocated\": %ld, \"objectsFreed\": %ld, \"bytesFreed\": %ld, ",
+		stats.objectsAllocated, stats.bytesAllocated, stats.objectsFreed, stats.bytesFreed);
+	fprintf(file, "\"objectsSurviving\": %d, \"bytesSurviving\": %zu, \"heapBytes\": %zu, \"peakHeapBytes\": %zu, \"largeBytes\": %zu, ",
+		stats.objectsSurviving, stats.bytesSurviving, stats.heapBytes, stats.peakHeapBytes, stats.largeBytes);
+	fprintf(file, "\"maxBytes\": %zu, \"growthFactor\": %g, \"gcShare\": %g, ", stats.maxBytes, stats.growthFactor, stats.gcShare);
+	fprintf(file, "\"totalPause\": %g, \"maxPause\": %g, \"totalMinorPause\": %g, \"maxMinorPause\": %g, \"totalLazySweep\": %g, ",
+		stats.totalPause, stats.maxPause, stats.totalMinorPause, stats.maxMinorPause, stats.totalLazySweep);
+	fprintf(file, "\"pauses\": {\"count\": %ld, \"p50\": %g, \"p99\": %g, \"p999\": %g, \"max\": %g, \"buckets\": [",
+		stats.pauses.total, pausePercentile(&stats.pauses, 50), pausePercentile(&stats.pauses, 99), pausePercentile(&stats.pauses, 99.9), stats.pauses.max);
+	for (int i = 0; i < PAUSE_BUCKETS; i++) {
+		fprintf(file, i ? ", %ld" : "%ld", stats.pauses.counts[i]);
+	}
+	fprintf(file, "]}, \"history\": [");
+	for (int i = 0; i < stats.historySize; i++) {
+		fprintf(file, "%s{\"time\": %g, \"heapBytes\": %zu, \"liveBytes\": %zu}", i ? ", " : "",
+			stats.history[i].time, stats.history[i].heapBytes, stats.history[i].liveBytes);
+	}
+	fprintf(file, "]}\n");
+}
+
+void finishCycle(VM* vm);
+void startSweep(VM* vm);
+void compact(VM* vm);
+
+//sets how many bytes may be allocated before the next collection, from the bytes that survived this one
+//an adaptive heap first grows its factor while collecting takes more than its share of the time, and shrinks it while collecting takes well under
+void resizeHeap(VM* vm) {
+	double time = now();
+	double gcTime = vm->totalPause + vm->totalMinorPause + vm->totalLazySweep;
+	if (time > vm->lastResize) {
+		double share = (gcTime - vm->lastGCTime) / (time - vm->lastResize);
+		vm->gcShare = vm->numCollections + vm->numCycles > 1 ? (vm->gcShare + share) / 2 : share;
 	}
+	vm->lastResize = time;
+	vm->lastGCTime = gcTime;
 	
-	object->marked = 1;
+	if (vm->targetGCShare > 0) {
+		if (vm->gcShare > vm->targetGCShare) {
+			vm->growthFactor = vm->growthFactor * 1.5 < MAX_GROWTH_FACTOR ? vm->growthFactor * 1.5 : MAX_GROWTH_FACTOR;
+		}
+		else if (vm->gcShare < vm->targetGCShare / 2) {
+			vm->growthFactor = vm->growthFactor / 1.25 > MIN_GROWTH_FACTOR ? vm->growthFactor / 1.25 : MIN_GROWTH_FACTOR;
+		}
+	}
 	
-	if (object->type == OBJ_PAIR) {
-		mark(object->head);
-		mark(object->tail);
+	size_t maxBytes = (size_t)(vm->numBytes * vm->growthFactor);
+	if (maxBytes < INITIAL_GC_THRESHOLD) {
+		maxBytes = INITIAL_GC_THRESHOLD;
+	}
+	//objects can never take more than the pages under the limit, and a compaction needs room for their copies as well
+	size_t nurserySize = vm->nurseryEnd - vm->nursery;
+	size_t ceiling = vm->compacting ? (vm->heapLimit - nurserySize) / 2 : vm->heapLimit - nurserySize;
+	if (vm->heapLimit && maxBytes > ceiling) {
+		maxBytes = ceiling;
 	}
+	vm->maxBytes = maxBytes;
 }
 
-void markAll(VM* vm) {
-	for (int i = 0; i < vm->stackSize; i++) {
-		mark(vm->stack[i]);
+//in the worst case everything counted survives, and each copy takes a cell at most half as big again as the object,
+//with a partly filled page per size class, but never more pages than there are now
+int compactionFits(VM* vm) {
+	if (!vm->heapLimit) {
+		return 1;
 	}
+	size_t pages = vm->numBytes * 3 / 2 / (PAGE_SIZE - PAGE_HEADER);
+	for (int sizeClass = 0; sizeClass < NUM_SIZE_CLASSES; sizeClass++) {
+		pages += vm->pages[sizeClass] != NULL;
+	}
+	if (pages > (size_t)vm->numPages) {
+		pages = vm->numPages;
+	}
+	return heapBytes(vm) + pages * PAGE_SIZE <= vm->heapLimit;
 }
 
-void sweep(VM* vm) {
-	Object** object = &vm->firstObject;
-	while (*object) {
-		if (!(*object)->marked) {
-			//this object was not reached, so remove it from the list and deallocate
-			Object* unreached = *object;
-			
-			*object = unreached->next;
-			free(unreached);
-			
-			//decrememnt number of objects the VM has allocated 
-			vm->numObjects--;
-		}
-		else {
-			//this object was succesfully reached, so unmark it for the next GC and move on to the next object
-			(*object)->marked = 0;
-			object = &(*object)->next;
+//a full collection empties the nursery first, so marking and sweeping only ever see the old generation
+//called directly it sweeps every page before returning
+void gc(VM* vm) {
+	//an incremental cycle in progress is run to completion first, so this one starts from a clean heap
+	finishCycle(vm);
+	double start = now();
+	
+	evacuateNursery(vm);
+	//under a heap limit with no room for the copies, this collection marks and sweeps in place instead
+	if (vm->compacting && compactionFits(vm)) {
+		compact(vm);
+	}
+	else {
+		markAll(vm);
+		sweep(vm);
+	}
+	
+	vm->numCollections++;
+	double pause = recordPause(vm, start, &vm->totalPause, &vm->maxPause);
+	resizeHeap(vm);
+	reportCollection(vm, GC_EVENT_FULL, pause);
+}
+
+//the world only stops to mark, and each page is swept the next time allocation needs a cell of its size class
+void gcLazy(VM* vm) {
+	finishCycle(vm);
+	double start = now();
+	
+	evacuateNursery(vm);
+	markAll(vm);
+	startSweep(vm);
+	
+	vm->numCollections++;
+	double pause = recordPause(vm, start, &vm->totalPause, &vm->maxPause);
+	resizeHeap(vm);
+	reportCollection(vm, GC_EVENT_FULL, pause);
+}
+
+//a minor collection only evacuates the nursery
+void minorGC(VM* vm) {
+	double start = now();
+	evacuateNursery(vm);
+	vm->numMinorCollections++;
+	reportCollection(vm, GC_EVENT_MINOR, recordPause(vm, start, &vm->totalMinorPause, &vm->maxMinorPause));
+}
+
+int sizeClassOf(size_t size) {
+	for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+		if (size <= sizeClasses[i]) {
+			return i;
 		}
 	}
+	assert(0, "Object too large! UNSWAG");
+	return -1;
 }
 
-void objectPrint(Object* object) {
-	switch (object->type) {
-		case OBJ_INT:
-			printf("%d", object->value);
-			break;
-		case OBJ_FLOAT:
-			printf("%f", object->fvalue);
-			break;
-		case OBJ_STRING:
-			printf("%s", object->text);
-			break;
-		case OBJ_PAIR:
-			printf("(");
-			objectPrint(object->head);
-			printf(", ");
-			objectPrint(object->tail);
-			printf(")");
-			break;
+Page* pageOf(Object* object) {
+	return (Page*)((uintptr_t)object & ~(uintptr_t)(PAGE_SIZE - 1));
+}
+
+Object* cellAt(Page* page, int index) {
+	return (Object*)((char*)page + PAGE_HEADER + (size_t)index * sizeClasses[page->sizeClass]);
+}
+
+void addAvailable(VM* vm, Page* page) {
+	page->available = 1;
+	page->prevAvailable = NULL;
+	page->nextAvailable = vm->available[page->sizeClass];
+	if (page->nextAvailable) {
+		page->nextAvailable->prevAvailable = page;
 	}
+	vm->available[page->sizeClass] = page;
 }
 
-void freeVM(VM* vm) {
-	vm->stackSize = 0;
-	gc(vm);
-	free(vm);
+void removeAvailable(VM* vm, Page* page) {
+	if (page->prevAvailable) {
+		page->prevAvailable->nextAvailable = page->nextAvailable;
+	}
+	else {
+		vm->available[page->sizeClass] = page->nextAvailable;
+	}
+	if (page->nextAvailable) {
+		page->nextAvailable->prevAvailable = page->prevAvailable;
+	}
+	page->available = 0;
 }
 
-void test1() {
-	printf("Test 1: Objects on stack are preserved.\n");
-	VM* vm = newVM();
-	pushInt(vm, 1);
-	pushInt(vm, 2);
+Page* newPage(VM* vm, int sizeClass) {
+	assert(!vm->heapLimit || heapBytes(vm) + PAGE_SIZE <= vm->heapLimit, "Heap limit exceeded! UNSWAG");
+	Page* page = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+	assert(page != NULL, "Out of memory! UNSWAG");
+	page->sizeClass = sizeClass;
+	page->numCells = (PAGE_SIZE - PAGE_HEADER) / sizeClasses[sizeClass];
+	page->liveCells = 0;
+	page->sweptEpoch = vm->markEpoch;
+	page->mapped = 0;
+	memset(page->marks, 0, sizeof(page->marks));
+	page->next = vm->pages[sizeClass];
+	vm->pages[sizeClass] = page;
+	vm->numPages++;
+	updatePeak(vm);
 	
-	gc(vm);
-	assert(vm->numObjects == 2, "Should have preserved objects.");
-	freeVM(vm);
+	//thread every cell onto the free list, lowest address first
+	page->freeList = NULL;
+	for (int i = page->numCells - 1; i >= 0; i--) {
+		Object* cell = cellAt(page, i);
+		cell->type = OBJ_FREE;
+		cell->nextFree = page->freeList;
+		page->freeList = cell;
+	}
+	addAvailable(vm, page);
+	return page;
 }
 
-void test2() {
-	printf("Test 2: Unreached objects are collected.\n");
-	VM* vm = newVM();
-	pushInt(vm, 1);
-	pushInt(vm, 2);
-	pop(vm);
-	pop(vm);
-	
-	gc(vm);
-	assert(vm->numObjects == 0, "Should have collected unreached objects.");
-	freeVM(vm);
+void releasePage(VM* vm, Page* page) {
+	if (page->available) {
+		removeAvailable(vm, page);
+	}
+	if (page->mapped) {
+		munmap(page, PAGE_SIZE);
+	}
+	else {
+		free(page);
+	}
+	vm->numPages--;
 }
 
-void test3() {
-	printf("Test 3: Reach nested objects.\n");
-	VM* vm = newVM();
-	pushInt(vm, 1);
-	pushInt(vm, 2);
-	pushPair(vm);
-	pushInt(vm, 3);
-	pushInt(vm, 4);
-	pushPair(vm);
-	pushPair(vm);
-	
-	gc(vm);
-	assert(vm->numObjects == 7, "Should have reached objects.");
-	freeVM(vm);
+//a large object starts right after the header of its pages, so it has a mark bit like any other object
+size_t largePageSize(size_t size) {
+	return (PAGE_HEADER + size + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
 }
 
-void test4() {
-	printf("Test 4: Handle cycles.\n");
-	VM* vm = newVM();
-	pushInt(vm, 1);
-	pushInt(vm, 2);
-	Object* a = pushPair(vm);
-	pushInt(vm, 3);
-	pushInt(vm, 4);
-	Object* b = pushPair(vm);
-	
-	//set up cycle, as well as make 2 and 4 unreachable.
-	a->tail = b;
-	b->tail = a;
-	
-	gc(vm);
-	assert(vm->numObjects == 4, "Should have collected objects.");
-	freeVM(vm);
+Object* largeObject(Page* page) {
+	return (Object*)((char*)page + PAGE_HEADER);
 }
 
-void perfTest() {
-	printf("Performace test.\n");
-	VM* vm = newVM();
-	
-	for (int i = 0; i < 1000; i++) {
-		for (int j = 0; j < 20; j++) {
-			pushInt(vm, i);
-		}
-		
-		for (int k = 0; k < 20; k++) {
-			pop(vm);
-		}
+int isLarge(Object* object) {
+	return pageOf(object)->sizeClass == LARGE_SIZE_CLASS;
+}
+
+Object* allocateLarge(VM* vm, size_t size) {
+	size_t bytes = largePageSize(size);
+	assert(!vm->heapLimit || heapBytes(vm) + bytes <= vm->heapLimit, "Heap limit exceeded! UNSWAG");
+	Page* page = aligned_alloc(PAGE_SIZE, bytes);
+	assert(page != NULL, "Out of memory! UNSWAG");
+	page->sizeClass = LARGE_SIZE_CLASS;
+	page->numCells = 1;
+	page->liveCells = 1;
+	page->available = 0;
+	page->freeList = NULL;
+	page->sweptEpoch = vm->markEpoch;
+	page->mapped = 0;
+	memset(page->marks, 0, sizeof(page->marks));
+	page->next = vm->largePages;
+	vm->largePages = page;
+	vm->numLargePages++;
+	vm->largeBytes += bytes;
+	updatePeak(vm);
+	return largeObject(page);
+}
+
+size_t objectSize(Object* object);
+
+void releaseLarge(VM* vm, Page* page) {
+	size_t bytes = largePageSize(objectSize(largeObject(page)));
+	vm->numLargePages--;
+	vm->largeBytes -= bytes;
+	if (page->mapped) {
+		munmap(page, bytes);
+	}
+	else {
+		free(page);
 	}
-	
-	free(vm);
 }
 
-int main(int argc, const char * argv[]) {
-	test1();
-	test2();
-	test3();
-	test4();
-	perfTest();
-	
-	VM* vm = newVM();
-	pushString(vm, "This is a test");
+int isMarked(Object* object) {
+	Page* page = pageOf(object);
+	size_t bit = ((char*)object - (char*)page) >> 4;
+	return (page->marks[bit >> 6] >> (bit & 63)) & 1;
+}
+
+void setMark(Object* object) {
+	Page* page = pageOf(object);
+	size_t bit = ((char*)object - (char*)page) >> 4;
+	page->marks[bit >> 6] |= (uint64_t)1 << (bit & 63);
+}
+
+int sweepNext(VM* vm, int sizeClass);
+
+//pops a cell off the first page of the size class with one free, only falling back to the system for a whole new page
+//while a sweep is pending, a few pages of the size class that have not been swept yet are tried before that
+Object* allocate(VM* vm, size_t size) {
+	int sizeClass = sizeClassOf(size);
+	Page* page = vm->available[sizeClass];
+	if (!page && vm->gcState == GC_SWEEPING && *vm->sweepCursor[sizeClass]) {
+		double start = now();
+		for (int swept = 0; !page && swept < LAZY_SWEEP_PAGES && vm->gcState == GC_SWEEPING && *vm->sweepCursor[sizeClass]; swept++) {
+			sweepNext(vm, sizeClass);
+			page = vm->available[sizeClass];
+		}
+		vm->numLazySweeps++;
+		recordPause(vm, start, &vm->totalLazySweep, &vm->maxLazySweep);
+	}
+	if (!page) {
+		page = newPage(vm, sizeClass);
+	}
+	Object* cell = page->freeList;
+	page->freeList = cell->nextFree;
+	if (!page->freeList) {
+		removeAvailable(vm, page);
+	}
+	return cell;
+}
+
+//while a cycle is marking, new objects are black so it keeps them, and while it is sweeping, so are those in pages not swept yet
+void allocationMark(VM* vm, Object* object, size_t size) {
+	if (vm->gcState == GC_MARKING) {
+		setMark(object);
+		vm->markedObjects++;
+		vm->markedBytes += size;
+	}
+	else if (vm->gcState == GC_SWEEPING && pageOf(object)->sweptEpoch != vm->markEpoch) {
+		setMark(object);
+	}
+}
+
+int isYoung(VM* vm, Object* object) {
+	return (char*)object >= vm->nursery && (char*)object < vm->nurseryEnd;
+}
+
+//small strings still take a whole object, so any object can be turned into a free cell or a forwarding pointer
+size_t stringSize(int length) {
+	size_t size = offsetof(Object, chars) + length + 1;
+	return size > sizeof(Object) ? size : sizeof(Object);
+}
+
+size_t elementsSize(int capacity) {
+	size_t size = offsetof(Object, values) + (size_t)capacity * sizeof(Value);
+	return size > sizeof(Object) ? size : sizeof(Object);
+}
+
+size_t objectSize(Object* object) {
+	if (object->type == OBJ_STRING) {
+		return stringSize(object->length);
+	}
+	if (object->type == OBJ_ELEMENTS) {
+		return elementsSize(object->capacity);
+	}
+	return sizeof(Object);
+}
+
+void startCycle(VM* vm);
+void incrementalStep(VM* vm);
+
+//once the old generation is big enough, either collect it or start an incremental cycle
+void collectOld(VM* vm) {
+	if (!vm->incremental) {
+		if (vm->lazySweep && !vm->compacting) {
+			gcLazy(vm);
+		}
+		else {
+			gc(vm);
+		}
+	}
+	else if (vm->gcState == GC_IDLE) {
+		startCycle(vm);
+	}
+}
+
+//whether allocating in a size class would need a new page that takes the heap over its limit
+//pages still to be swept may have room, so they count as room
+int atHeapLimit(VM* vm, size_t size) {
+	if (size > MAX_CELL_SIZE) {
+		return vm->heapLimit && heapBytes(vm) + largePageSize(size) > vm->heapLimit;
+	}
+	if (!vm->heapLimit || heapBytes(vm) + PAGE_SIZE <= vm->heapLimit) {
+		return 0;
+	}
+	int sizeClass = sizeClassOf(size);
+	return !vm->available[sizeClass] && !(vm->gcState == GC_SWEEPING && *vm->sweepCursor[sizeClass]);
+}
+
+uint32_t hashFrames(void** frames, int numFrames) {
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < numFrames; i++) {
+		hash ^= (uint32_t)((uintptr_t)frames[i] >> 4);
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+//the site of a stack, added if it is new, or 0 once there are as many sites as objects can tell apart
+int findSite(VM* vm, void** frames, int numFrames) {
+	uint32_t hash = hashFrames(frames, numFrames);
+	if (vm->siteTableCapacity > 0) {
+		int mask = vm->siteTableCapacity - 1;
+		for (int i = hash & mask; vm->siteTable[i]; i = (i + 1) & mask) {
+			AllocationSite* site = &vm->sites[vm->siteTable[i]];
+			if (site->hash == hash && site->numFrames == numFrames && memcmp(site->frames, frames, numFrames * sizeof(void*)) == 0) {
+				return vm->siteTable[i];
+			}
+		}
+	}
+	if (vm->numSites == MAX_SITES) {
+		return 0;
+	}
+	
+	if (vm->numSites == 0) {
+		vm->numSites = 1;
+	}
+	if (vm->numSites >= vm->sitesCapacity) {
+		vm->sitesCapacity = vm->sitesCapacity ? vm->sitesCapacity * 2 : 64;
+		vm->sites = realloc(vm->sites, vm->sitesCapacity * sizeof(AllocationSite));
+		assert(vm->sites != NULL, "Out of memory! UNSWAG");
+	}
+	if (vm->numSites * 2 >= vm->siteTableCapacity) {
+		free(vm->siteTable);
+		vm->siteTableCapacity = vm->siteTableCapacity ? vm->siteTableCapacity * 2 : 128;
+		vm->siteTable = calloc(vm->siteTableCapacity, sizeof(int));
+		assert(vm->siteTable != NULL, "Out of memory! UNSWAG");
+		for (int index = 1; index < vm->numSites; index++) {
+			int i = vm->sites[index].hash & (vm->siteTableCapacity - 1);
+			while (vm->siteTable[i]) {
+				i = (i + 1) & (vm->siteTableCapacity - 1);
+			}
+			vm->siteTable[i] = index;
+		}
+	}
+	
+	int index = vm->numSites++;
+	AllocationSite* site = &vm->sites[index];
+	memcpy(site->frames, frames, numFrames * sizeof(void*));
+	site->numFrames = numFrames;
+	site->hash = hash;
+	site->samples = 0;
+	site->bytes = 0;
+	int i = hash & (vm->siteTableCapacity - 1);
+	while (vm->siteTable[i]) {
+		i = (i + 1) & (vm->siteTableCapacity - 1);
+	}
+	vm->siteTable[i] = index;
+	return index;
+}
+
+//records the stack of an allocation, leaving out this frame, and tags the object with its site
+//the gap to the next sample is drawn between 1 and twice the rate, so allocations that repeat with a period cannot alias with it
+__attribute__((noinline)) void sampleAllocation(VM* vm, Object* object, size_t size) {
+	vm->sampleSeed = vm->sampleSeed * 1103515245 + 12345;
+	vm->sampleCountdown = vm->sampleRate > 1 ? 1 + (vm->sampleSeed >> 8) % (2 * vm->sampleRate - 1) : 1;
+	void* frames[MAX_SITE_FRAMES + 1];
+	int numFrames = backtrace(frames, MAX_SITE_FRAMES + 1) - 1;
+	int index = findSite(vm, frames + 1, numFrames);
+	if (index) {
+		vm->sites[index].samples++;
+		vm->sites[index].bytes += size;
+	}
+	object->site = index;
+}
+
+//bump allocates in the nursery, collecting it when full and the old generation once enough has been promoted
+//close to the heap limit, promoting the whole nursery might not fit, so a full collection makes room first
+Object* allocateYoung(VM* vm, size_t size) {
+	if (vm->nurseryTop + size > vm->nurseryEnd) {
+		if (vm->heapLimit && heapBytes(vm) + vm->nurseryBytes > vm->heapLimit) {
+			gc(vm);
+		}
+		else {
+			minorGC(vm);
+		}
+		if (vm->numBytes >= vm->maxBytes) {
+			collectOld(vm);
+		}
+	}
+	Object* object = (Object*)vm->nurseryTop;
+	vm->nurseryTop += (size + 7) & ~(size_t)7;
+	vm->nurseryObjects++;
+	vm->nurseryBytes += size;
+	return object;
+}
+
+//allocates straight into the old generation, skipping the nursery for objects expected to live long
+Object* newTenuredObject(VM* vm, ObjectType type, size_t size) {
+	//an incremental cycle advances by one slice per allocation
+	if (vm->incremental && vm->gcState != GC_IDLE) {
+		incrementalStep(vm);
+	}
+	
+	//check if GC is needed before attempting to allocate any more
+	if (vm->numBytes >= vm->maxBytes) {
+		collectOld(vm);
+	}
+	//the limit is hard, so whatever mode the collector is in the whole heap is collected before growing past it
+	if (atHeapLimit(vm, size)) {
+		gc(vm);
+		assert(!atHeapLimit(vm, size), "Heap limit exceeded! UNSWAG");
+	}
+	Object* object = size > MAX_CELL_SIZE ? allocateLarge(vm, size) : allocate(vm, size);
+	object->remembered = 0;
+	object->site = 0;
+	object->type = type;
+	allocationMark(vm, object, size);
+	if (vm->sampleRate && --vm->sampleCountdown == 0) {
+		sampleAllocation(vm, object, size);
+	}
+	
+	//increment number of objects the VM has allocated 
+	vm->numObjects++;
+	vm->numBytes += size;
+	
+	return object;
+}
+
+//large objects are never young, as they are never copied, and neither are those bigger than the whole nursery
+Object* newObject(VM* vm, ObjectType type, size_t size) {
+	if (!vm->nursery || size > MAX_CELL_SIZE || ((size + 7) & ~(size_t)7) > (size_t)(vm->nurseryEnd - vm->nursery)) {
+		return newTenuredObject(vm, type, size);
+	}
+	if (vm->incremental && vm->gcState != GC_IDLE) {
+		incrementalStep(vm);
+	}
+	
+	Object* object = allocateYoung(vm, size);
+	object->remembered = 0;
+	object->site = 0;
+	object->type = type;
+	if (vm->sampleRate && --vm->sampleCountdown == 0) {
+		sampleAllocation(vm, object, size);
+	}
+	vm->numObjects++;
+	vm->numBytes += size;
+	
+	return object;
+}
+
+//numbers never touch the heap
+void pushInt(VM* vm, int value) {
+	push(vm, intValue(value));
+}
+
+void pushFloat(VM* vm, float value) {
+	push(vm, numberValue(value));
+}
+
+//FNV-1a
+uint32_t hashString(const char* chars, int length) {
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < length; i++) {
+		hash ^= (unsigned char)chars[i];
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+void initString(Object* string, const char* chars, int length, uint32_t hash) {
+	string->length = length;
+	string->hash = hash;
+	memcpy(string->chars, chars, length);
+	string->chars[length] = '\0';
+}
+
+//the text is copied, so the caller keeps its own
+void pushString(VM* vm, const char* text) {
+	int length = strlen(text);
+	Object* object = newObject(vm, OBJ_STRING, stringSize(length));
+	initString(object, text, length, hashString(text, length));
+	push(vm, objectValue(object));
+}
+
+//interned strings with the same text are the same object, so comparing them never looks at the characters
+int stringsEqual(Object* a, Object* b) {
+	if (a == b) {
+		return 1;
+	}
+	return a->length == b->length && a->hash == b->hash && memcmp(a->chars, b->chars, a->length) == 0;
+}
+
+Object* findString(VM* vm, const char* chars, int length, uint32_t hash) {
+	if (vm->stringsCapacity == 0) {
+		return NULL;
+	}
+	int mask = vm->stringsCapacity - 1;
+	for (int i = hash & mask; vm->strings[i]; i = (i + 1) & mask) {
+		Object* string = vm->strings[i];
+		if (string->hash == hash && string->length == length && memcmp(string->chars, chars, length) == 0) {
+			return string;
+		}
+	}
+	return NULL;
+}
+
+void insertString(VM* vm, Object* string) {
+	int mask = vm->stringsCapacity - 1;
+	int i = string->hash & mask;
+	while (vm->strings[i]) {
+		i = (i + 1) & mask;
+	}
+	vm->strings[i] = string;
+	vm->stringsSize++;
+}
+
+Object* keepString(VM* vm, Object* string) {
+	return string;
+}
+
+//rehashes the table into the given capacity, keeping what survivor returns for each string, which is NULL for those that died
+void rebuildStrings(VM* vm, int capacity, Object* (*survivor)(VM* vm, Object* string)) {
+	Object** strings = vm->strings;
+	int oldCapacity = vm->stringsCapacity;
+	vm->strings = calloc(capacity, sizeof(Object*));
+	assert(vm->strings != NULL, "Out of memory! UNSWAG");
+	vm->stringsCapacity = capacity;
+	vm->stringsSize = 0;
+	for (int i = 0; i < oldCapacity; i++) {
+		Object* string = strings[i] ? survivor(vm, strings[i]) : NULL;
+		if (string) {
+			insertString(vm, string);
+		}
+	}
+	free(strings);
+}
+
+void shade(VM* vm, Value value);
+
+//pushes the one string with this text, making it if there is none yet
+//interned strings are shared and tend to live long, so they skip the nursery, and minor collections never have to look at the table
+//like the rest of the single threaded API, this is not for mutator threads
+void pushInternedString(VM* vm, const char* text) {
+	int length = strlen(text);
+	uint32_t hash = hashString(text, length);
+	Object* string = findString(vm, text, length, hash);
+	if (string) {
+		//finding a string reads a weak reference, so a cycle that is marking must keep it
+		shade(vm, objectValue(string));
+	}
+	else {
+		string = newTenuredObject(vm, OBJ_STRING, stringSize(length));
+		initString(string, text, length, hash);
+		if ((vm->stringsSize + 1) * 4 > vm->stringsCapacity * 3) {
+			rebuildStrings(vm, vm->stringsCapacity ? vm->stringsCapacity * 2 : 64, keepString);
+		}
+		insertString(vm, string);
+	}
+	push(vm, objectValue(string));
+}
+
+Object* pushPair(VM* vm) {
+	Object* object = newObject(vm, OBJ_PAIR, sizeof(Object));
+	object->tail = pop(vm);
+	object->head = pop(vm);
+	
+	//the new pair may already be black, and the stack is no longer holding its fields
+	shade(vm, object->head);
+	shade(vm, object->tail);
+	
+	push(vm, objectValue(object));
+	return object;
+}
+
+//mutator threads: each one allocates from its own free cells, and stops at a safepoint whenever another one has to collect
+//while they run, the VM is only used through its mutators, and collections stop the world and sweep eagerly
+//the nursery and incremental collection need barriers on the fast path, so they are not supported with mutators, and neither is the allocation profiler
+
+//hands the free cells of a mutator back to their pages and adds its allocations to the counts of the VM, with the lock held
+void releaseBuffers(Mutator* mutator) {
+	VM* vm = mutator->vm;
+	for (int sizeClass = 0; sizeClass < NUM_SIZE_CLASSES; sizeClass++) {
+		Page* page = mutator->tlab[sizeClass];
+		if (!page) {
+			continue;
+		}
+		page->freeList = mutator->freeCells[sizeClass];
+		if (page->freeList && !page->available) {
+			addAvailable(vm, page);
+		}
+		mutator->tlab[sizeClass] = NULL;
+		mutator->freeCells[sizeClass] = NULL;
+	}
+	vm->numObjects += mutator->numObjects;
+	vm->numBytes += mutator->numBytes;
+	mutator->numObjects = 0;
+	mutator->numBytes = 0;
+}
+
+//waits, with the lock held, until the collecting thread lets the world go again
+void park(Mutator* mutator) {
+	VM* vm = mutator->vm;
+	releaseBuffers(mutator);
+	vm->numParked++;
+	pthread_cond_signal(&vm->parked);
+	while (vm->gcRequested) {
+		pthread_cond_wait(&vm->resumed, &vm->lock);
+	}
+	vm->numParked--;
+}
+
+//called by mutators at every allocation, and by any that run for a while without allocating
+void safepoint(Mutator* mutator) {
+	VM* vm = mutator->vm;
+	if (__atomic_load_n(&vm->gcRequested, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&vm->lock);
+		if (vm->gcRequested) {
+			park(mutator);
+		}
+		pthread_mutex_unlock(&vm->lock);
+	}
+}
+
+//stops every other mutator and collects, with the lock held
+//if another thread got there first, this one parks for its collection instead
+void stopTheWorld(Mutator* mutator) {
+	VM* vm = mutator->vm;
+	if (vm->gcRequested) {
+		park(mutator);
+		return;
+	}
+	__atomic_store_n(&vm->gcRequested, 1, __ATOMIC_RELEASE);
+	releaseBuffers(mutator);
+	while (vm->numParked < vm->numMutators - 1) {
+		pthread_cond_wait(&vm->parked, &vm->lock);
+	}
+	gc(vm);
+	__atomic_store_n(&vm->gcRequested, 0, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&vm->resumed);
+}
+
+//takes the free cells of a whole page for a mutator, collecting first once the budget is spent
+Object* refill(Mutator* mutator, int sizeClass) {
+	VM* vm = mutator->vm;
+	pthread_mutex_lock(&vm->lock);
+	while (vm->gcRequested) {
+		park(mutator);
+	}
+	releaseBuffers(mutator);
+	if (vm->numBytes >= vm->maxBytes) {
+		stopTheWorld(mutator);
+	}
+	if (atHeapLimit(vm, sizeClasses[sizeClass])) {
+		stopTheWorld(mutator);
+		assert(!atHeapLimit(vm, sizeClasses[sizeClass]), "Heap limit exceeded! UNSWAG");
+	}
+	Page* page = vm->available[sizeClass];
+	if (!page) {
+		page = newPage(vm, sizeClass);
+	}
+	removeAvailable(vm, page);
+	mutator->tlab[sizeClass] = page;
+	mutator->freeCells[sizeClass] = page->freeList;
+	page->freeList = NULL;
+	pthread_mutex_unlock(&vm->lock);
+	return mutator->freeCells[sizeClass];
+}
+
+Mutator* newMutator(VM* vm) {
+	assert(!vm->nursery && !vm->incremental, "Mutator threads need a VM without a nursery or incremental collection! UNSWAG");
+	Mutator* mutator = calloc(1, sizeof(Mutator));
+	assert(mutator != NULL, "Out of memory! UNSWAG");
+	mutator->vm = vm;
+	pthread_mutex_lock(&vm->lock);
+	mutator->next = vm->mutators;
+	vm->mutators = mutator;
+	vm->numMutators++;
+	//a collection may be waiting on this mutator already
+	while (vm->gcRequested) {
+		park(mutator);
+	}
+	pthread_mutex_unlock(&vm->lock);
+	return mutator;
+}
+
+//the roots of the mutator go away with it
+void freeMutator(Mutator* mutator) {
+	VM* vm = mutator->vm;
+	pthread_mutex_lock(&vm->lock);
+	releaseBuffers(mutator);
+	Mutator** link = &vm->mutators;
+	while (*link != mutator) {
+		link = &(*link)->next;
+	}
+	*link = mutator->next;
+	vm->numMutators--;
+	pthread_cond_signal(&vm->parked);
+	pthread_mutex_unlock(&vm->lock);
+	free(mutator);
+}
+
+void mutatorPush(Mutator* mutator, Value value) {
+	assert(mutator->stackSize < STACK_MAX, "Stack overflow! UNSWAG");
+	mutator->stack[mutator->stackSize++] = value;
+}
+
+Value mutatorPop(Mutator* mutator) {
+	assert(mutator->stackSize > 0, "Stack underflow! UNSWAG");
+	return mutator->stack[--mutator->stackSize];
+}
+
+//large objects have no free cells to buffer, each one is allocated with the lock held and counted straight away
+Object* mutatorNewLarge(Mutator* mutator, size_t size) {
+	VM* vm = mutator->vm;
+	pthread_mutex_lock(&vm->lock);
+	while (vm->gcRequested) {
+		park(mutator);
+	}
+	releaseBuffers(mutator);
+	if (vm->numBytes >= vm->maxBytes) {
+		stopTheWorld(mutator);
+	}
+	if (atHeapLimit(vm, size)) {
+		stopTheWorld(mutator);
+		assert(!atHeapLimit(vm, size), "Heap limit exceeded! UNSWAG");
+	}
+	Object* object = allocateLarge(vm, size);
+	vm->numObjects++;
+	vm->numBytes += size;
+	pthread_mutex_unlock(&vm->lock);
+	return object;
+}
+
+Object* mutatorNewObject(Mutator* mutator, ObjectType type, size_t size) {
+	safepoint(mutator);
+	if (size > MAX_CELL_SIZE) {
+		Object* object = mutatorNewLarge(mutator, size);
+		object->remembered = 0;
+		object->site = 0;
+		object->type = type;
+		return object;
+	}
+	int sizeClass = sizeClassOf(size);
+	Object* object = mutator->freeCells[sizeClass];
+	if (!object) {
+		object = refill(mutator, sizeClass);
+	}
+	mutator->freeCells[sizeClass] = object->nextFree;
+	object->remembered = 0;
+	object->site = 0;
+	object->type = type;
+	mutator->numObjects++;
+	mutator->numBytes += size;
+	return object;
+}
+
+void mutatorPushString(Mutator* mutator, const char* text) {
+	int length = strlen(text);
+	Object* object = mutatorNewObject(mutator, OBJ_STRING, stringSize(length));
+	initString(object, text, length, hashString(text, length));
+	mutatorPush(mutator, objectValue(object));
+}
+
+Object* mutatorPushPair(Mutator* mutator) {
+	Object* object = mutatorNewObject(mutator, OBJ_PAIR, sizeof(Object));
+	object->tail = mutatorPop(mutator);
+	object->head = mutatorPop(mutator);
+	mutatorPush(mutator, objectValue(object));
+	return object;
+}
+
+//the write barrier: while an incremental cycle is marking, whatever gets stored is shaded grey so a black object never points to a white one
+//and an old pair that comes to point into the nursery is remembered, so minor collections treat it as a root
+void writeBarrier(VM* vm, Object* object, Value value) {
+	shade(vm, value);
+	if (!isObject(value) || !isYoung(vm, asObject(value)) || isYoung(vm, object) || object->remembered) {
+		return;
+	}
+	if (vm->rememberedSize == vm->rememberedCapacity) {
+		vm->rememberedCapacity = vm->rememberedCapacity ? vm->rememberedCapacity * 2 : 256;
+		vm->remembered = realloc(vm->remembered, vm->rememberedCapacity * sizeof(Object*));
+		assert(vm->remembered != NULL, "Out of memory! UNSWAG");
+	}
+	object->remembered = 1;
+	vm->remembered[vm->rememberedSize++] = object;
+}
+
+//pair fields must be stored through these once the pair has been allocated
+void setHead(VM* vm, Object* pair, Value value) {
+	writeBarrier(vm, pair, value);
+	pair->head = value;
+}
+
+void setTail(VM* vm, Object* pair, Value value) {
+	writeBarrier(vm, pair, value);
+	pair->tail = value;
+}
+
+//arrays: an array is a small object pointing at its elements, which hold the values contiguously and are replaced by bigger ones as it grows
+//elements past the largest size class are large objects, so the values of a big array are never copied by a collection
+//like the rest of the single threaded API, this is not for mutator threads
+Object* pushArray(VM* vm) {
+	Object* array = newObject(vm, OBJ_ARRAY, sizeof(Object));
+	array->elements = NULL;
+	push(vm, objectValue(array));
+	return array;
+}
+
+int arrayLength(Object* array) {
+	return array->elements ? array->elements->count : 0;
+}
+
+Value arrayGet(Object* array, int index) {
+	assert(index >= 0 && index < arrayLength(array), "Array index out of bounds! UNSWAG");
+	return array->elements->values[index];
+}
+
+void arraySet(VM* vm, Object* array, int index, Value value) {
+	assert(index >= 0 && index < arrayLength(array), "Array index out of bounds! UNSWAG");
+	writeBarrier(vm, array->elements, value);
+	array->elements->values[index] = value;
+}
+
+//pops a value and appends it to the array below it on the stack, doubling the capacity of the elements when they are full
+void arrayAppend(VM* vm) {
+	Object* array = asObject(vm->stack[vm->stackSize - 2]);
+	Object* elements = array->elements;
+	if (!elements || elements->count == elements->capacity) {
+		int capacity = elements ? elements->capacity * 2 : ARRAY_INITIAL_CAPACITY;
+		Object* grown = newObject(vm, OBJ_ELEMENTS, elementsSize(capacity));
+		//the allocation may have collected, moving the array and its elements
+		array = asObject(vm->stack[vm->stackSize - 2]);
+		elements = array->elements;
+		grown->capacity = capacity;
+		grown->count = elements ? elements->count : 0;
+		if (elements) {
+			memcpy(grown->values, elements->values, elements->count * sizeof(Value));
+		}
+		//old or black elements take the copied values without the barrier having seen them
+		if (vm->gcState == GC_MARKING || (vm->nursery && !isYoung(vm, grown))) {
+			for (int i = 0; i < grown->count; i++) {
+				writeBarrier(vm, grown, grown->values[i]);
+			}
+		}
+		writeBarrier(vm, array, objectValue(grown));
+		array->elements = grown;
+		elements = grown;
+	}
+	Value value = pop(vm);
+	writeBarrier(vm, elements, value);
+	elements->values[elements->count++] = value;
+}
+
+void pushGrey(VM* vm, Object* object) {
+	if (vm->markStackSize == vm->markStackCapacity) {
+		int capacity = vm->markStackCapacity ? vm->markStackCapacity * 2 : MARK_STACK_INITIAL;
+		if (capacity > vm->markStackLimit) {
+			capacity = vm->markStackLimit;
+		}
+		Object** markStack = capacity > vm->markStackCapacity ? realloc(vm->markStack, capacity * sizeof(Object*)) : NULL;
+		if (!markStack) {
+			//the object stays marked, the rescan will find it
+			vm->markStackOverflowed = 1;
+			return;
+		}
+		vm->markStack = markStack;
+		vm->markStackCapacity = capacity;
+	}
+	vm->markStack[vm->markStackSize++] = object;
+}
+
+void mark(VM* vm, Value value) {
+	//immediate values have nothing to mark, and young objects are left to minor collections
+	if (!isObject(value) || isYoung(vm, asObject(value))) {
+		return;
+	}
+	Object* object = asObject(value);
+
+	//if already marked, we're done. Check this first so cycles of pairs that reference each other are only scanned once
+	if (isMarked(object)) {
+		return;
+	}
+	
+	setMark(object);
+	vm->markedObjects++;
+	vm->markedBytes += objectSize(object);
+	pushGrey(vm, object);
+}
+
+void shade(VM* vm, Value value) {
+	if (vm->gcState == GC_MARKING) {
+		mark(vm, value);
+	}
+}
+
+void scan(VM* vm, Object* object) {
+	switch (object->type) {
+		case OBJ_PAIR:
+			mark(vm, object->head);
+			mark(vm, object->tail);
+			break;
+		case OBJ_ARRAY:
+			if (object->elements) {
+				mark(vm, objectValue(object->elements));
+			}
+			break;
+		case OBJ_ELEMENTS:
+			for (int i = 0; i < object->count; i++) {
+				mark(vm, object->values[i]);
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+void drainMarkStack(VM* vm) {
+	while (vm->markStackSize > 0) {
+		scan(vm, vm->markStack[--vm->markStackSize]);
+	}
+}
+
+//after an overflow some marked objects were never scanned, so scan every marked object again until nothing more overflows
+void rescanHeap(VM* vm) {
+	while (vm->markStackOverflowed) {
+		vm->markStackOverflowed = 0;
+		for (int sizeClass = 0; sizeClass < NUM_SIZE_CLASSES; sizeClass++) {
+			for (Page* page = vm->pages[sizeClass]; page; page = page->next) {
+				for (int i = 0; i < page->numCells; i++) {
+					Object* object = cellAt(page, i);
+					if (object->type != OBJ_FREE && isMarked(object)) {
+						scan(vm, object);
+						drainMarkStack(vm);
+					}
+				}
+			}
+		}
+		for (Page* page = vm->largePages; page; page = page->next) {
+			if (isMarked(largeObject(page))) {
+				scan(vm, largeObject(page));
+				drainMarkStack(vm);
+			}
+		}
+	}
+}
+
+//marking is driven by the mark stack rather than recursion, so deep structures cannot overflow the C stack
+void markParallel(VM* vm);
+
+void markAll(VM* vm) {
+	vm->markedObjects = 0;
+	vm->markedBytes = 0;
+	if (vm->markThreads > 1) {
+		markParallel(vm);
+		return;
+	}
+	for (int i = 0; i < vm->stackSize; i++) {
+		mark(vm, vm->stack[i]);
+	}
+	for (Mutator* mutator = vm->mutators; mutator; mutator = mutator->next) {
+		for (int i = 0; i < mutator->stackSize; i++) {
+			mark(vm, mutator->stack[i]);
+		}
+	}
+	drainMarkStack(vm);
+	rescanHeap(vm);
+}
+
+//parallel marking: the stack is split between the workers, and each one shares grey objects through a Chase-Lev deque
+//the owner pushes and pops at the bottom, and idle workers steal from the top
+//most grey objects never reach the deque: a worker works off a private stack, and only hands objects over when its deque runs dry
+//a mark bit is set with an atomic or, and the worker that sets it is the one that scans the object
+typedef struct sMarkWorker {
+	VM* vm;
+	struct sMarkWorker* workers;
+	int numWorkers;
+	//workers that found no work anywhere, marking is over once all of them are
+	int* idle;
+	
+	Object** deque;
+	long top;
+	long bottom;
+	
+	//a ring, so the oldest objects can be handed over from the far end
+	Object* local[MARK_LOCAL_SIZE];
+	int localStart;
+	int localSize;
+	
+	int firstRoot;
+	int lastRoot;
+	unsigned int seed;
+	long scanned;
+	int marked;
+	size_t markedBytes;
+} MarkWorker;
+
+void dequePush(MarkWorker* worker, Object* object) {
+	long bottom = worker->bottom;
+	long top = __atomic_load_n(&worker->top, __ATOMIC_ACQUIRE);
+	if (bottom - top >= worker->vm->markDequeSize) {
+		//the object stays marked, the rescan will find it
+		__atomic_store_n(&worker->vm->markStackOverflowed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	worker->deque[bottom & (worker->vm->markDequeSize - 1)] = object;
+	__atomic_store_n(&worker->bottom, bottom + 1, __ATOMIC_RELEASE);
+}
+
+Object* dequePop(MarkWorker* worker) {
+	long bottom = worker->bottom - 1;
+	__atomic_store_n(&worker->bottom, bottom, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	long top = __atomic_load_n(&worker->top, __ATOMIC_RELAXED);
+	if (top > bottom) {
+		__atomic_store_n(&worker->bottom, bottom + 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	Object* object = worker->deque[bottom & (worker->vm->markDequeSize - 1)];
+	if (top == bottom) {
+		//the last object, which a thief may be after too
+		if (!__atomic_compare_exchange_n(&worker->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+			object = NULL;
+		}
+		__atomic_store_n(&worker->bottom, bottom + 1, __ATOMIC_RELAXED);
+	}
+	return object;
+}
+
+Object* dequeSteal(MarkWorker* victim) {
+	long top = __atomic_load_n(&victim->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	long bottom = __atomic_load_n(&victim->bottom, __ATOMIC_ACQUIRE);
+	if (top >= bottom) {
+		return NULL;
+	}
+	Object* object = victim->deque[top & (victim->vm->markDequeSize - 1)];
+	if (!__atomic_compare_exchange_n(&victim->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+		return NULL;
+	}
+	return object;
+}
+
+void shareOldest(MarkWorker* worker) {
+	dequePush(worker, worker->local[worker->localStart]);
+	worker->localStart = (worker->localStart + 1) & (MARK_LOCAL_SIZE - 1);
+	worker->localSize--;
+}
+
+void markShared(MarkWorker* worker, Value value) {
+	if (!isObject(value) || isYoung(worker->vm, asObject(value))) {
+		return;
+	}
+	Object* object = asObject(value);
+	Page* page = pageOf(object);
+	size_t bit = ((char*)object - (char*)page) >> 4;
+	uint64_t* word = &page->marks[bit >> 6];
+	uint64_t mask = (uint64_t)1 << (bit & 63);
+	//the plain load keeps objects that are already marked from paying for the atomic
+	if ((__atomic_load_n(word, __ATOMIC_RELAXED) & mask) || (__atomic_fetch_or(word, mask, __ATOMIC_RELAXED) & mask)) {
+		return;
+	}
+	worker->marked++;
+	worker->markedBytes += objectSize(object);
+	
+	if (worker->localSize == MARK_LOCAL_SIZE) {
+		//make room by sharing the oldest half
+		for (int i = 0; i < MARK_LOCAL_SIZE / 2; i++) {
+			shareOldest(worker);
+		}
+	}
+	worker->local[(worker->localStart + worker->localSize++) & (MARK_LOCAL_SIZE - 1)] = object;
+	
+	//keep something where idle workers can steal it
+	if (worker->localSize > 1 && worker->bottom == __atomic_load_n(&worker->top, __ATOMIC_RELAXED)) {
+		shareOldest(worker);
+	}
+}
+
+void scanShared(MarkWorker* worker, Object* object) {
+	worker->scanned++;
+	switch (object->type) {
+		case OBJ_PAIR:
+			markShared(worker, object->head);
+			markShared(worker, object->tail);
+			break;
+		case OBJ_ARRAY:
+			if (object->elements) {
+				markShared(worker, objectValue(object->elements));
+			}
+			break;
+		case OBJ_ELEMENTS:
+			for (int i = 0; i < object->count; i++) {
+				markShared(worker, object->values[i]);
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+//tries every other worker once, starting from a random one
+Object* stealWork(MarkWorker* worker) {
+	worker->seed = worker->seed * 1103515245 + 12345;
+	int start = (worker->seed >> 8) % worker->numWorkers;
+	for (int i = 0; i < worker->numWorkers; i++) {
+		MarkWorker* victim = &worker->workers[(start + i) % worker->numWorkers];
+		if (victim == worker) {
+			continue;
+		}
+		Object* object = dequeSteal(victim);
+		if (object) {
+			return object;
+		}
+	}
+	return NULL;
+}
+
+int anyWork(MarkWorker* worker) {
+	for (int i = 0; i < worker->numWorkers; i++) {
+		MarkWorker* other = &worker->workers[i];
+		if (__atomic_load_n(&other->top, __ATOMIC_ACQUIRE) < __atomic_load_n(&other->bottom, __ATOMIC_ACQUIRE)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void* markWorker(void* argument) {
+	MarkWorker* worker = argument;
+	for (int i = worker->firstRoot; i < worker->lastRoot; i++) {
+		markShared(worker, worker->vm->stack[i]);
+	}
+	
+	for (;;) {
+		Object* object;
+		while (worker->localSize > 0 || (object = dequePop(worker))) {
+			if (worker->localSize > 0) {
+				object = worker->local[(worker->localStart + --worker->localSize) & (MARK_LOCAL_SIZE - 1)];
+			}
+			scanShared(worker, object);
+		}
+		if ((object = stealWork(worker))) {
+			scanShared(worker, object);
+			continue;
+		}
+		
+		//an idle worker's deque is empty, so once every worker is idle there is nothing left anywhere
+		__atomic_add_fetch(worker->idle, 1, __ATOMIC_SEQ_CST);
+		for (;;) {
+			if (__atomic_load_n(worker->idle, __ATOMIC_SEQ_CST) == worker->numWorkers) {
+				return NULL;
+			}
+			if (anyWork(worker)) {
+				__atomic_sub_fetch(worker->idle, 1, __ATOMIC_SEQ_CST);
+				break;
+			}
+			sched_yield();
+		}
+	}
+}
+
+void markParallel(VM* vm) {
+	int numWorkers = vm->markThreads;
+	MarkWorker* workers = calloc(numWorkers, sizeof(MarkWorker));
+	pthread_t* threads = malloc(numWorkers * sizeof(pthread_t));
+	assert(workers != NULL && threads != NULL, "Out of memory! UNSWAG");
+	int idle = 0;
+	
+	for (int i = 0; i < numWorkers; i++) {
+		MarkWorker* worker = &workers[i];
+		worker->vm = vm;
+		worker->workers = workers;
+		worker->numWorkers = numWorkers;
+		worker->idle = &idle;
+		worker->deque = malloc(vm->markDequeSize * sizeof(Object*));
+		assert(worker->deque != NULL, "Out of memory! UNSWAG");
+		worker->firstRoot = vm->stackSize * i / numWorkers;
+		worker->lastRoot = vm->stackSize * (i + 1) / numWorkers;
+		worker->seed = i + 1;
+	}
+	//the stacks of mutator threads go to worker 0, stealing spreads them out
+	for (Mutator* mutator = vm->mutators; mutator; mutator = mutator->next) {
+		for (int i = 0; i < mutator->stackSize; i++) {
+			markShared(&workers[0], mutator->stack[i]);
+		}
+	}
+	//the calling thread is worker 0
+	for (int i = 1; i < numWorkers; i++) {
+		assert(pthread_create(&threads[i], NULL, markWorker, &workers[i]) == 0, "Could not start a mark thread! UNSWAG");
+	}
+	markWorker(&workers[0]);
+	for (int i = 1; i < numWorkers; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	
+	for (int i = 0; i < numWorkers; i++) {
+		vm->markedObjects += workers[i].marked;
+		vm->markedBytes += workers[i].markedBytes;
+		free(workers[i].deque);
+	}
+	free(workers);
+	free(threads);
+	
+	//objects dropped by a full deque are marked but were never scanned
+	rescanHeap(vm);
+}
+
+//rebuilds the free list of a page and returns how many of its cells are still in use
+//the objects that died were already left out of numObjects when marking ended
+int sweepPage(VM* vm, Page* page) {
+	page->freeList = NULL;
+	int liveCells = 0;
+	
+	//walk backwards so the free list comes out lowest address first
+	for (int i = page->numCells - 1; i >= 0; i--) {
+		Object* object = cellAt(page, i);
+		if (object->type != OBJ_FREE && isMarked(object)) {
+			//this object was succesfully reached, so leave it be
+			liveCells++;
+			continue;
+		}
+		//this object was not reached, so its cell goes back on the free list
+		object->type = OBJ_FREE;
+		object->nextFree = page->freeList;
+		page->freeList = object;
+	}
+	
+	//unmark the whole page for the next GC at once
+	memset(page->marks, 0, sizeof(page->marks));
+	page->liveCells = liveCells;
+	page->sweptEpoch = vm->markEpoch;
+	if (page->freeList && !page->available) {
+		addAvailable(vm, page);
+	}
+	return liveCells;
+}
+
+void endCycle(VM* vm);
+
+//marking is over, so what is marked is all that is left, and every page there is now has to be swept before the next marking
+//interned strings are all old, so once marking is over the unmarked ones are dead
+Object* markedString(VM* vm, Object* string) {
+	return isMarked(string) ? string : NULL;
+}
+
+//large objects are swept whole as soon as marking is over, one left unmarked hands its pages straight back
+void sweepLarge(VM* vm) {
+	Page** link = &vm->largePages;
+	while (*link) {
+		Page* page = *link;
+		if (isMarked(largeObject(page))) {
+			memset(page->marks, 0, sizeof(page->marks));
+			page->sweptEpoch = vm->markEpoch;
+			link = &page->next;
+		}
+		else {
+			*link = page->next;
+			releaseLarge(vm, page);
+		}
+	}
+}
+
+void startSweep(VM* vm) {
+	setSurviving(vm, vm->markedObjects + vm->nurseryObjects, vm->markedBytes + vm->nurseryBytes);
+	if (vm->stringsSize > 0) {
+		rebuildStrings(vm, vm->stringsCapacity, markedString);
+	}
+	vm->markEpoch++;
+	sweepLarge(vm);
+	vm->pagesToSweep = vm->numPages;
+	for (int sizeClass = 0; sizeClass < NUM_SIZE_CLASSES; sizeClass++) {
+		vm->sweepCursor[sizeClass] = &vm->pages[sizeClass];
+	}
+	vm->sweepClass = 0;
+	vm->gcState = GC_SWEEPING;
+	if (vm->pagesToSweep == 0) {
+		endCycle(vm);
+	}
+}
+
+//sweeps the page under the cursor of a size class and moves past it, handing it back to the system if it was left empty
+//returns the cells swept
+int sweepNext(VM* vm, int sizeClass) {
+	Page** link = vm->sweepCursor[sizeClass];
+	Page* page = *link;
+	
+	//pages made since the sweep started have nothing to sweep
+	if (page->sweptEpoch == vm->markEpoch) {
+		vm->sweepCursor[sizeClass] = &page->next;
+		return 0;
+	}
+	int numCells = page->numCells;
+	if (sweepPage(vm, page) == 0) {
+		*link = page->next;
+		releasePage(vm, page);
+	}
+	else {
+		vm->sweepCursor[sizeClass] = &page->next;
+	}
+	if (--vm->pagesToSweep == 0) {
+		endCycle(vm);
+	}
+	return numCells;
+}
+
+//sweeps at least one page, and more while the work stays under the budget
+//returns once the sweep is through
+int sweepSlice(VM* vm, int work) {
+	while (vm->gcState == GC_SWEEPING) {
+		if (!*vm->sweepCursor[vm->sweepClass]) {
+			vm->sweepClass++;
+			continue;
+		}
+		if (work <= 0) {
+			return 0;
+		}
+		work -= sweepNext(vm, vm->sweepClass);
+	}
+	return 1;
+}
+
+//sweeps every page, handing pages left empty back to the system
+void sweep(VM* vm) {
+	startSweep(vm);
+	sweepSlice(vm, INT32_MAX);
+}
+
+//copies a young object into the old generation the first time it is reached, and follows the forwarding pointer after that
+Value evacuate(VM* vm, Value value) {
+	if (!isObject(value) || !isYoung(vm, asObject(value))) {
+		return value;
+	}
+	Object* object = asObject(value);
+	if (object->type != OBJ_FORWARD) {
+		size_t size = objectSize(object);
+		Object* copy = allocate(vm, size);
+		memcpy(copy, object, size);
+		object->type = OBJ_FORWARD;
+		object->forward = copy;
+		vm->promoted[vm->promotedSize++] = copy;
+		vm->promotedBytes += size;
+		
+		//promoted while a cycle is marking, the copy is grey: it may point at old objects not marked yet
+		if (vm->gcState == GC_MARKING) {
+			mark(vm, objectValue(copy));
+		}
+		else {
+			allocationMark(vm, copy, size);
+		}
+	}
+	return objectValue(object->forward);
+}
+
+void evacuateFields(VM* vm, Object* object) {
+	switch (object->type) {
+		case OBJ_PAIR:
+			object->head = evacuate(vm, object->head);
+			object->tail = evacuate(vm, object->tail);
+			break;
+		case OBJ_ARRAY:
+			if (object->elements) {
+				object->elements = asObject(evacuate(vm, objectValue(object->elements)));
+			}
+			break;
+		case OBJ_ELEMENTS:
+			for (int i = 0; i < object->count; i++) {
+				object->values[i] = evacuate(vm, object->values[i]);
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+//the stack and the remembered set are the roots, everything they reach in the nursery is promoted and the nursery starts over
+void evacuateNursery(VM* vm) {
+	if (!vm->nursery) {
+		return;
+	}
+	for (int i = 0; i < vm->stackSize; i++) {
+		vm->stack[i] = evacuate(vm, vm->stack[i]);
+	}
+	for (int i = 0; i < vm->rememberedSize; i++) {
+		evacuateFields(vm, vm->remembered[i]);
+		vm->remembered[i]->remembered = 0;
+	}
+	vm->rememberedSize = 0;
+	
+	//promoted objects are scanned in the order they were copied, like the scan pointer of a Cheney collector
+	for (int i = 0; i < vm->promotedSize; i++) {
+		evacuateFields(vm, vm->promoted[i]);
+	}
+	
+	//promoted objects now count as old, everything else in the nursery was garbage
+	setSurviving(vm, vm->numObjects + vm->promotedSize - vm->nurseryObjects, vm->numBytes + vm->promotedBytes - vm->nurseryBytes);
+	vm->promotedSize = 0;
+	vm->promotedBytes = 0;
+	vm->nurseryObjects = 0;
+	vm->nurseryBytes = 0;
+	vm->nurseryTop = vm->nursery;
+}
+
+//copies an old object into the new pages the first time it is reached, and follows the forwarding pointer after that
+//the forwarded object joins the back of the scan queue
+//a large object stays where it is, it is marked instead and its pages join a queue of their own
+Value copyObject(VM* vm, Value value) {
+	if (!isObject(value)) {
+		return value;
+	}
+	Object* object = asObject(value);
+	if (isLarge(object)) {
+		if (!isMarked(object)) {
+			setMark(object);
+			pageOf(object)->nextGrey = vm->largeToScan;
+			vm->largeToScan = pageOf(object);
+		}
+		return value;
+	}
+	if (object->type != OBJ_FORWARD) {
+		size_t size = objectSize(object);
+		Object* copy = allocate(vm, size);
+		memcpy(copy, object, size);
+		object->type = OBJ_FORWARD;
+		object->forward = copy;
+		object->nextForwarded = NULL;
+		if (vm->scanQueueEnd) {
+			vm->scanQueueEnd->nextForwarded = object;
+		}
+		else {
+			vm->scanQueue = object;
+		}
+		vm->scanQueueEnd = object;
+	}
+	return objectValue(object->forward);
+}
+
+void copyFields(VM* vm, Object* object) {
+	switch (object->type) {
+		case OBJ_PAIR:
+			object->head = copyObject(vm, object->head);
+			object->tail = copyObject(vm, object->tail);
+			break;
+		case OBJ_ARRAY:
+			if (object->elements) {
+				object->elements = asObject(copyObject(vm, objectValue(object->elements)));
+			}
+			break;
+		case OBJ_ELEMENTS:
+			for (int i = 0; i < object->count; i++) {
+				object->values[i] = copyObject(vm, object->values[i]);
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+//after a compaction the strings that were reached have moved, or are large and marked, and the rest are dead
+Object* copiedString(VM* vm, Object* string) {
+	if (isLarge(string)) {
+		return isMarked(string) ? string : NULL;
+	}
+	return string->type == OBJ_FORWARD ? string->forward : NULL;
+}
+
+//copies everything reachable from the stack into new pages and hands every old page back, the nursery must be empty
+//copies are scanned in the order they were made, so what is live ends up packed together breadth first, like a Cheney collector
+//the forwarded cells left behind in the old pages are the queue, so copying needs no memory beyond the new pages
+//large objects are not copied, those that were reached are scanned where they are and the rest are freed
+void compact(VM* vm) {
+	Page* oldPages[NUM_SIZE_CLASSES];
+	for (int sizeClass = 0; sizeClass < NUM_SIZE_CLASSES; sizeClass++) {
+		oldPages[sizeClass] = vm->pages[sizeClass];
+		vm->pages[sizeClass] = NULL;
+		vm->available[sizeClass] = NULL;
+	}
+	
+	for (int i = 0; i < vm->stackSize; i++) {
+		vm->stack[i] = copyObject(vm, vm->stack[i]);
+	}
+	for (Mutator* mutator = vm->mutators; mutator; mutator = mutator->next) {
+		for (int i = 0; i < mutator->stackSize; i++) {
+			mutator->stack[i] = copyObject(vm, mutator->stack[i]);
+		}
+	}
+	int numObjects = 0;
+	size_t numBytes = 0;
+	Object* scanned = NULL;
+	for (;;) {
+		Object* next = scanned ? scanned->nextForwarded : vm->scanQueue;
+		Object* object;
+		if (next) {
+			object = next->forward;
+			scanned = next;
+		}
+		else if (vm->largeToScan) {
+			object = largeObject(vm->largeToScan);
+			vm->largeToScan = vm->largeToScan->nextGrey;
+		}
+		else {
+			break;
+		}
+		copyFields(vm, object);
+		numObjects++;
+		numBytes += objectSize(object);
+	}
+	vm->scanQueue = NULL;
+	vm->scanQueueEnd = NULL;
+	if (vm->stringsSize > 0) {
+		rebuildStrings(vm, vm->stringsCapacity, copiedString);
+	}
+	sweepLarge(vm);
+	
+	for (int sizeClass = 0; sizeClass < NUM_SIZE_CLASSES; sizeClass++) {
+		Page* page = oldPages[sizeClass];
+		while (page) {
+			Page* next = page->next;
+			//the available list it was on is gone already
+			page->available = 0;
+			releasePage(vm, page);
+			page = next;
+		}
+	}
+	setSurviving(vm, numObjects, numBytes);
+}
+
+//an incremental cycle marks from the stack a slice at a time, with the write barrier keeping it sound while the mutator runs
+void startCycle(VM* vm) {
+	double start = now();
+	evacuateNursery(vm);
+	vm->gcState = GC_MARKING;
+	vm->markedObjects = 0;
+	vm->markedBytes = 0;
+	vm->cycleStart = start;
+	for (int i = 0; i < vm->stackSize; i++) {
+		mark(vm, vm->stack[i]);
+	}
+	recordPause(vm, start, &vm->totalPause, &vm->maxPause);
+}
+
+//the stack has no barrier, so marking ends by going over it again, then the sweep starts
+//emptying the nursery first also empties the remembered set, which could otherwise be left pointing at swept objects
+void finishMarking(VM* vm) {
+	evacuateNursery(vm);
+	for (int i = 0; i < vm->stackSize; i++) {
+		mark(vm, vm->stack[i]);
+	}
+	drainMarkStack(vm);
+	rescanHeap(vm);
+	startSweep(vm);
+	vm->numCycles++;
+	resizeHeap(vm);
+	reportCollection(vm, GC_EVENT_CYCLE, now() - vm->cycleStart);
+}
+
+void endCycle(VM* vm) {
+	vm->gcState = GC_IDLE;
+}
+
+void incrementalStep(VM* vm) {
+	double start = now();
+	if (vm->gcState == GC_MARKING) {
+		for (int work = 0; work < vm->sliceWork && vm->markStackSize > 0; work++) {
+			scan(vm, vm->markStack[--vm->markStackSize]);
+		}
+		if (vm->markStackSize == 0) {
+			finishMarking(vm);
+		}
+	}
+	else if (vm->gcState == GC_SWEEPING) {
+		sweepSlice(vm, vm->sliceWork);
+	}
+	recordPause(vm, start, &vm->totalPause, &vm->maxPause);
+}
+
+void finishCycle(VM* vm) {
+	if (vm->gcState == GC_MARKING) {
+		drainMarkStack(vm);
+		finishMarking(vm);
+	}
+	if (vm->gcState == GC_SWEEPING) {
+		sweepSlice(vm, INT32_MAX);
+	}
+}
+
+void valuePrint(Value value);
+
+void objectPrint(Object* object) {
+	switch (object->type) {
+		case OBJ_STRING:
+			printf("%s", object->chars);
+			break;
+		case OBJ_PAIR:
+			printf("(");
+			valuePrint(object->head);
+			printf(", ");
+			valuePrint(object->tail);
+			printf(")");
+			break;
+		case OBJ_ARRAY:
+			printf("[");
+			for (int i = 0; i < arrayLength(object); i++) {
+				if (i > 0) {
+					printf(", ");
+				}
+				valuePrint(arrayGet(object, i));
+			}
+			printf("]");
+			break;
+		default:
+			break;
+	}
+}
+
+void valuePrint(Value value) {
+	if (isObject(value)) {
+		objectPrint(asObject(value));
+	}
+	else if (isInt(value)) {
+		printf("%d", asInt(value));
+	}
+	else {
+		printf("%f", asNumber(value));
+	}
+}
+
+void freeVM(VM* vm) {
+	vm->stackSize = 0;
+	gc(vm);
+	if (vm->statsFile) {
+		dumpGCStats(vm, vm->statsFile);
+	}
+	free(vm->markStack);
+	free(vm->nursery);
+	free(vm->promoted);
+	free(vm->remembered);
+	free(vm->strings);
+	free(vm->sites);
+	free(vm->siteTable);
+	pthread_mutex_destroy(&vm->lock);
+	pthread_cond_destroy(&vm->parked);
+	pthread_cond_destroy(&vm->resumed);
+	free(vm);
+}
+
+//heap images: saveImage writes what the stack reaches to a file, and loadImage maps it back in as the heap of a new VM
+//an image is the pages themselves after a full collection, with every pointer turned into an offset from the first page
+//loading maps the pages aligned on their size and adds where they landed to every pointer, nothing is allocated object by object
+//the file is mapped privately, so the heap of a loaded VM never writes back to it
+#define IMAGE_MAGIC "GCIMAGE1"
+
+typedef struct {
+	char magic[8];
+	//the heap layout the image was written with, which has to be the one of the VM loading it
+	int pageSize;
+	int pageHeader;
+	int objectSize;
+	int numObjects;
+	size_t numBytes;
+	//the stack and the interned strings follow the header
+	int stackSize;
+	int stringsSize;
+	//where the pages start in the file, aligned on the page size, and the bytes they take
+	size_t dataOffset;
+	size_t dataSize;
+} ImageHeader;
+
+//the pages being saved sorted by address, with their offsets in the image
+typedef struct {
+	Page* page;
+	size_t offset;
+} ImagePage;
+
+typedef struct {
+	ImagePage* pages;
+	int numPages;
+} ImageIndex;
+
+int compareImagePages(const void* a, const void* b) {
+	uintptr_t x = (uintptr_t)((const ImagePage*)a)->page;
+	uintptr_t y = (uintptr_t)((const ImagePage*)b)->page;
+	return x < y ? -1 : x > y;
+}
+
+//the offset in the image of a pointer into one of the pages being saved
+Object* imageOffset(void* context, Object* pointer) {
+	ImageIndex* index = context;
+	Page* page = pageOf(pointer);
+	int low = 0;
+	int high = index->numPages - 1;
+	while (low < high) {
+		int middle = (low + high) / 2;
+		if ((uintptr_t)index->pages[middle].page < (uintptr_t)page) {
+			low = middle + 1;
+		}
+		else {
+			high = middle;
+		}
+	}
+	assert(index->numPages > 0 && index->pages[low].page == page, "Pointer outside the heap! UNSWAG");
+	return (Object*)(uintptr_t)(index->pages[low].offset + ((char*)pointer - (char*)page));
+}
+
+//where an offset of a loaded image points, given where its pages were mapped
+Object* imagePointer(void* context, Object* offset) {
+	return (Object*)((char*)context + (uintptr_t)offset);
+}
+
+Value translateValue(Value value, Object* (*translate)(void* context, Object* pointer), void* context) {
+	return isObject(value) ? objectValue(translate(context, asObject(value))) : value;
+}
+
+//rewrites every pointer a cell holds, free or not
+void translateFields(Object* object, Object* (*translate)(void* context, Object* pointer), void* context) {
+	switch (object->type) {
+		case OBJ_FREE:
+			if (object->nextFree) {
+				object->nextFree = translate(context, object->nextFree);
+			}
+			break;
+		case OBJ_PAIR:
+			object->head = translateValue(object->head, translate, context);
+			object->tail = translateValue(object->tail, translate, context);
+			break;
+		case OBJ_ARRAY:
+			if (object->elements) {
+				object->elements = translate(context, object->elements);
+			}
+			break;
+		case OBJ_ELEMENTS:
+			for (int i = 0; i < object->count; i++) {
+				object->values[i] = translateValue(object->values[i], translate, context);
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+void translatePage(Page* page, Object* (*translate)(void* context, Object* pointer), void* context) {
+	if (page->freeList) {
+		page->freeList = translate(context, page->freeList);
+	}
+	//sites belong to the profile of the VM that made the objects
+	if (page->sizeClass == LARGE_SIZE_CLASS) {
+		translateFields(largeObject(page), translate, context);
+		largeObject(page)->site = 0;
+		return;
+	}
+	for (int i = 0; i < page->numCells; i++) {
+		translateFields(cellAt(page, i), translate, context);
+		cellAt(page, i)->site = 0;
+	}
+}
+
+size_t imagePageSize(Page* page) {
+	return page->sizeClass == LARGE_SIZE_CLASS ? largePageSize(objectSize(largeObject(page))) : PAGE_SIZE;
+}
+
+//writes a copy of the page with its pointers turned into offsets, leaving the page itself alone
+void writeImagePage(FILE* file, Page* page, ImageIndex* index) {
+	size_t size = imagePageSize(page);
+	Page* copy = malloc(size);
+	assert(copy != NULL, "Out of memory! UNSWAG");
+	memcpy(copy, page, size);
+	copy->next = NULL;
+	copy->nextAvailable = NULL;
+	copy->prevAvailable = NULL;
+	copy->available = 0;
+	copy->nextGrey = NULL;
+	copy->mapped = 0;
+	copy->sweptEpoch = 0;
+	translatePage(copy, imageOffset, index);
+	fwrite(copy, size, 1, file);
+	free(copy);
+}
+
+//collects first, so the image only holds what the stack reaches, and writes it to the file
+//returns 0 if the file could not be written
+int saveImage(VM* vm, const char* path) {
+	assert(vm->numMutators == 0, "Cannot save the heap of a VM with mutator threads! UNSWAG");
+	gc(vm);
+	
+	//pages are laid out in the order of the lists, small ones first
+	ImageIndex index;
+	index.numPages = 0;
+	index.pages = malloc((vm->numPages + vm->numLargePages + 1) * sizeof(ImagePage));
+	assert(index.pages != NULL, "Out of memory! UNSWAG");
+	size_t dataSize = 0;
+	for (int sizeClass = 0; sizeClass < NUM_SIZE_CLASSES; sizeClass++) {
+		for (Page* page = vm->pages[sizeClass]; page; page = page->next) {
+			index.pages[index.numPages].page = page;
+			index.pages[index.numPages++].offset = dataSize;
+			dataSize += PAGE_SIZE;
+		}
+	}
+	for (Page* page = vm->largePages; page; page = page->next) {
+		index.pages[index.numPages].page = page;
+		index.pages[index.numPages++].offset = dataSize;
+		dataSize += imagePageSize(page);
+	}
+	qsort(index.pages, index.numPages, sizeof(ImagePage), compareImagePages);
+	
+	ImageHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+	header.pageSize = PAGE_SIZE;
+	header.pageHeader = PAGE_HEADER;
+	header.objectSize = sizeof(Object);
+	header.numObjects = vm->numObjects;
+	header.numBytes = vm->numBytes;
+	header.stackSize = vm->stackSize;
+	header.stringsSize = vm->stringsSize;
+	header.dataOffset = (sizeof(header) + (vm->stackSize + vm->stringsSize) * sizeof(uint64_t) + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+	header.dataSize = dataSize;
+	
+	//written next to the target and renamed over it, as the target may be the image this heap was loaded from, still mapped
+	char* tmp = malloc(strlen(path) + sizeof(".XXXXXX"));
+	assert(tmp != NULL, "Out of memory! UNSWAG");
+	sprintf(tmp, "%s.XXXXXX", path);
+	int fd = mkstemp(tmp);
+	FILE* file = fd >= 0 ? fdopen(fd, "wb") : NULL;
+	if (!file) {
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp);
+		}
+		free(tmp);
+		free(index.pages);
+		return 0;
+	}
+	//the permissions fopen would have given it
+	mode_t mask = umask(0);
+	umask(mask);
+	fchmod(fd, 0666 & ~mask);
+	fwrite(&header, sizeof(header), 1, file);
+	for (int i = 0; i < vm->stackSize; i++) {
+		Value value = translateValue(vm->stack[i], imageOffset, &index);
+		fwrite(&value, sizeof(value), 1, file);
+	}
+	for (int i = 0; i < vm->stringsCapacity; i++) {
+		if (vm->strings[i]) {
+			uint64_t offset = (uintptr_t)imageOffset(&index, vm->strings[i]);
+			fwrite(&offset, sizeof(offset), 1, file);
+		}
+	}
+	fseek(file, header.dataOffset, SEEK_SET);
+	for (int sizeClass = 0; sizeClass < NUM_SIZE_CLASSES; sizeClass++) {
+		for (Page* page = vm->pages[sizeClass]; page; page = page->next) {
+			writeImagePage(file, page, &index);
+		}
+	}
+	for (Page* page = vm->largePages; page; page = page->next) {
+		writeImagePage(file, page, &index);
+	}
+	free(index.pages);
+	int failed = ferror(file);
+	failed |= fclose(file) != 0;
+	if (failed || rename(tmp, path) != 0) {
+		unlink(tmp);
+		failed = 1;
+	}
+	free(tmp);
+	return !failed;
+}
+
+//makes a VM with the given config whose heap and stack are those of the image
+//returns NULL if the file cannot be read, or was written by a build with another heap layout
+VM* loadImage(const char* path, GCConfig config) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	ImageHeader header;
+	if (read(fd, &header, sizeof(header)) != sizeof(header) || memcmp(header.magic, IMAGE_MAGIC, sizeof(header.magic)) != 0 ||
+		header.pageSize != PAGE_SIZE || header.pageHeader != PAGE_HEADER || header.objectSize != sizeof(Object) ||
+		header.stackSize < 0 || header.stackSize > STACK_MAX || header.stringsSize < 0) {
+		close(fd);
+		return NULL;
+	}
+	//pages mapped past the end of the file would fault on first touch
+	struct stat info;
+	if (fstat(fd, &info) != 0 || header.dataOffset > (size_t)info.st_size || header.dataSize > (size_t)info.st_size - header.dataOffset) {
+		close(fd);
+		return NULL;
+	}
+	Value stack[STACK_MAX];
+	uint64_t* strings = malloc((header.stringsSize + 1) * sizeof(uint64_t));
+	assert(strings != NULL, "Out of memory! UNSWAG");
+	size_t rootsSize = (header.stackSize + header.stringsSize) * sizeof(uint64_t);
+	if (read(fd, stack, header.stackSize * sizeof(Value)) != header.stackSize * sizeof(Value) ||
+		read(fd, strings, header.stringsSize * sizeof(uint64_t)) != header.stringsSize * sizeof(uint64_t) ||
+		header.dataOffset < sizeof(header) + rootsSize) {
+		free(strings);
+		close(fd);
+		return NULL;
+	}
+	
+	//map a page more than needed, so the pages can be put aligned on their size inside it
+	char* base = NULL;
+	if (header.dataSize > 0) {
+		char* reserved = mmap(NULL, header.dataSize + PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		assert(reserved != MAP_FAILED, "Out of memory! UNSWAG");
+		base = (char*)(((uintptr_t)reserved + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1));
+		if (mmap(base, header.dataSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, header.dataOffset) == MAP_FAILED) {
+			munmap(reserved, header.dataSize + PAGE_SIZE);
+			free(strings);
+			close(fd);
+			return NULL;
+		}
+		if (base > reserved) {
+			munmap(reserved, base - reserved);
+		}
+		if (reserved + PAGE_SIZE > base) {
+			munmap(base + header.dataSize, reserved + PAGE_SIZE - base);
+		}
+	}
+	close(fd);
+	
+	VM* vm = newVMWith(config);
+	size_t size;
+	for (size_t offset = 0; offset < header.dataSize; offset += size) {
+		Page* page = (Page*)(base + offset);
+		size = imagePageSize(page);
+		translatePage(page, imagePointer, base);
+		page->mapped = 1;
+		page->sweptEpoch = vm->markEpoch;
+		if (page->sizeClass == LARGE_SIZE_CLASS) {
+			page->next = vm->largePages;
+			vm->largePages = page;
+			vm->numLargePages++;
+			vm->largeBytes += size;
+			continue;
+		}
+		page->next = vm->pages[page->sizeClass];
+		vm->pages[page->sizeClass] = page;
+		vm->numPages++;
+		if (page->freeList) {
+			addAvailable(vm, page);
+		}
+	}
+	for (int i = 0; i < header.stackSize; i++) {
+		push(vm, translateValue(stack[i], imagePointer, base));
+	}
+	if (header.stringsSize > 0) {
+		int capacity = 64;
+		while ((header.stringsSize + 1) * 4 > capacity * 3) {
+			capacity *= 2;
+		}
+		vm->strings = calloc(capacity, sizeof(Object*));
+		assert(vm->strings != NULL, "Out of memory! UNSWAG");
+		vm->stringsCapacity = capacity;
+		for (int i = 0; i < header.stringsSize; i++) {
+			insertString(vm, imagePointer(base, (Object*)(uintptr_t)strings[i]));
+		}
+	}
+	free(strings);
+	
+	vm->numObjects = header.numObjects;
+	vm->numBytes = header.numBytes;
+	assert(!vm->heapLimit || heapBytes(vm) <= vm->heapLimit, "Heap limit exceeded! UNSWAG");
+	updatePeak(vm);
+	resizeHeap(vm);
+	return vm;
+}
+
+//heap dumps: what the stack reaches, by type, and how much of it each object keeps alive
+//what an object retains is what would be freed if it went, its subtree in the dominator tree of the object graph
+//the dominators come from the iterative algorithm of Cooper, Harvey and Kennedy, over the objects numbered in postorder
+//the stack is one more node above every object it holds, and numbered last
+typedef struct {
+	ObjectType type;
+	size_t shallowBytes;
+	size_t retainedBytes;
+} HeapRetainer;
+
+typedef struct {
+	int numObjects;
+	size_t numBytes;
+	long typeCounts[NUM_OBJECT_TYPES];
+	size_t typeBytes[NUM_OBJECT_TYPES];
+	//what the object in each slot of the stack retains, 0 for slots without one
+	int stackSize;
+	size_t rootRetained[STACK_MAX];
+	//the objects retaining the most, biggest first
+	HeapRetainer top[DUMP_TOP_RETAINERS];
+	int numTop;
+	//sampled objects still live, indexed like the sites of the VM, owned by the dump
+	int numSites;
+	long* siteLiveSamples;
+	size_t* siteLiveBytes;
+} HeapDump;
+
+//the values an object points through
+int numChildren(Object* object) {
+	switch (object->type) {
+		case OBJ_PAIR:
+			return 2;
+		case OBJ_ARRAY:
+			return object->elements ? 1 : 0;
+		case OBJ_ELEMENTS:
+			return object->count;
+		default:
+			return 0;
+	}
+}
+
+Value childOf(Object* object, int index) {
+	switch (object->type) {
+		case OBJ_PAIR:
+			return index == 0 ? object->head : object->tail;
+		case OBJ_ARRAY:
+			return objectValue(object->elements);
+		default:
+			return object->values[index];
+	}
+}
+
+//the number of each object, open addressing on its address
+typedef struct {
+	Object** keys;
+	int* numbers;
+	int mask;
+} ObjectNumbers;
+
+int numberSlot(ObjectNumbers* numbers, Object* object) {
+	int i = (int)(((uintptr_t)object >> 3) * 2654435761u) & numbers->mask;
+	while (numbers->keys[i] && numbers->keys[i] != object) {
+		i = (i + 1) & numbers->mask;
+	}
+	return i;
+}
+
+int numberOf(ObjectNumbers* numbers, Object* object) {
+	return numbers->numbers[numberSlot(numbers, object)];
+}
+
+int intersectDominators(int* dominators, int a, int b) {
+	while (a != b) {
+		while (a < b) {
+			a = dominators[a];
+		}
+		while (b < a) {
+			b = dominators[b];
+		}
+	}
+	return a;
+}
+
+typedef struct {
+	Object* object;
+	int child;
+} DumpFrame;
+
+//walks the heap without changing it, so it can be taken at any point, even while a cycle is running
+HeapDump heapDump(VM* vm) {
+	assert(vm->numMutators == 0, "Cannot dump the heap of a VM with mutator threads! UNSWAG");
+	HeapDump dump;
+	memset(&dump, 0, sizeof(dump));
+	
+	//every object reached is counted in numObjects, so it bounds the table
+	ObjectNumbers numbers;
+	int capacity = 64;
+	while (capacity < vm->numObjects * 2) {
+		capacity *= 2;
+	}
+	numbers.keys = calloc(capacity, sizeof(Object*));
+	numbers.numbers = malloc(capacity * sizeof(int));
+	numbers.mask = capacity - 1;
+	Object** order = malloc((vm->numObjects + 1) * sizeof(Object*));
+	int framesCapacity = 256;
+	DumpFrame* frames = malloc(framesCapacity * sizeof(DumpFrame));
+	assert(numbers.keys != NULL && numbers.numbers != NULL && order != NULL && frames != NULL, "Out of memory! UNSWAG");
+	
+	//number the objects in postorder, depth first from the stack
+	int count = 0;
+	int seen = 0;
+	for (int root = 0; root < vm->stackSize; root++) {
+		Value value = vm->stack[root];
+		int numFrames = 0;
+		for (;;) {
+			if (isObject(value)) {
+				int slot = numberSlot(&numbers, asObject(value));
+				if (!numbers.keys[slot]) {
+					assert(++seen <= vm->numObjects, "Reached more objects than there are! UNSWAG");
+					numbers.keys[slot] = asObject(value);
+					numbers.numbers[slot] = -1;
+					if (numFrames == framesCapacity) {
+						framesCapacity *= 2;
+						frames = realloc(frames, framesCapacity * sizeof(DumpFrame));
+						assert(frames != NULL, "Out of memory! UNSWAG");
+					}
+					frames[numFrames].object = asObject(value);
+					frames[numFrames++].child = 0;
+				}
+			}
+			if (numFrames == 0) {
+				break;
+			}
+			DumpFrame* frame = &frames[numFrames - 1];
+			if (frame->child < numChildren(frame->object)) {
+				value = childOf(frame->object, frame->child++);
+				continue;
+			}
+			numbers.numbers[numberSlot(&numbers, frame->object)] = count;
+			order[count++] = frame->object;
+			numFrames--;
+			value = 0;
+		}
+	}
+	free(frames);
+	int root = count;
+	
+	//the predecessors of every object, the stack among them
+	int* predecessorStart = calloc(count + 2, sizeof(int));
+	assert(predecessorStart != NULL, "Out of memory! UNSWAG");
+	for (int n = 0; n < count; n++) {
+		for (int i = 0; i < numChildren(order[n]); i++) {
+			Value child = childOf(order[n], i);
+			if (isObject(child)) {
+				predecessorStart[numberOf(&numbers, asObject(child)) + 1]++;
+			}
+		}
+	}
+	for (int i = 0; i < vm->stackSize; i++) {
+		if (isObject(vm->stack[i])) {
+			predecessorStart[numberOf(&numbers, asObject(vm->stack[i])) + 1]++;
+		}
+	}
+	for (int n = 0; n <= count; n++) {
+		predecessorStart[n + 1] += predecessorStart[n];
+	}
+	int* predecessors = malloc((predecessorStart[count + 1] + 1) * sizeof(int));
+	int* filled = malloc((count + 1) * sizeof(int));
+	assert(predecessors != NULL && filled != NULL, "Out of memory! UNSWAG");
+	memcpy(filled, predecessorStart, (count + 1) * sizeof(int));
+	for (int n = 0; n < count; n++) {
+		for (int i = 0; i < numChildren(order[n]); i++) {
+			Value child = childOf(order[n], i);
+			if (isObject(child)) {
+				predecessors[filled[numberOf(&numbers, asObject(child))]++] = n;
+			}
+		}
+	}
+	for (int i = 0; i < vm->stackSize; i++) {
+		if (isObject(vm->stack[i])) {
+			predecessors[filled[numberOf(&numbers, asObject(vm->stack[i]))]++] = root;
+		}
+	}
+	free(filled);
+	
+	//an object's immediate dominator comes from intersecting those of its predecessors, in reverse postorder until nothing changes
+	int* dominators = malloc((count + 1) * sizeof(int));
+	assert(dominators != NULL, "Out of memory! UNSWAG");
+	for (int n = 0; n < count; n++) {
+		dominators[n] = -1;
+	}
+	dominators[root] = root;
+	for (int changed = 1; changed;) {
+		changed = 0;
+		for (int n = count - 1; n >= 0; n--) {
+			int dominator = -1;
+			for (int i = predecessorStart[n]; i < predecessorStart[n + 1]; i++) {
+				int predecessor = predecessors[i];
+				if (dominators[predecessor] != -1) {
+					dominator = dominator == -1 ? predecessor : intersectDominators(dominators, predecessor, dominator);
+				}
+			}
+			if (dominators[n] != dominator) {
+				dominators[n] = dominator;
+				changed = 1;
+			}
+		}
+	}
+	free(predecessors);
+	free(predecessorStart);
+	
+	//a dominator comes after everything it dominates in postorder, so one pass adds up the subtrees
+	size_t* retained = malloc((count + 1) * sizeof(size_t));
+	assert(retained != NULL, "Out of memory! UNSWAG");
+	for (int n = 0; n < count; n++) {
+		retained[n] = objectSize(order[n]);
+	}
+	retained[root] = 0;
+	for (int n = 0; n < count; n++) {
+		retained[dominators[n]] += retained[n];
+	}
+	
+	dump.numSites = vm->numSites;
+	dump.siteLiveSamples = calloc(vm->numSites + 1, sizeof(long));
+	dump.siteLiveBytes = calloc(vm->numSites + 1, sizeof(size_t));
+	assert(dump.siteLiveSamples != NULL && dump.siteLiveBytes != NULL, "Out of memory! UNSWAG");
+	for (int n = 0; n < count; n++) {
+		Object* object = order[n];
+		size_t size = objectSize(object);
+		dump.numObjects++;
+		dump.numBytes += size;
+		dump.typeCounts[object->type]++;
+		dump.typeBytes[object->type] += size;
+		if (object->site) {
+			dump.siteLiveSamples[object->site]++;
+			dump.siteLiveBytes[object->site] += size;
+		}
+		
+		//keep the biggest retainers sorted
+		if (dump.numTop == DUMP_TOP_RETAINERS && retained[n] <= dump.top[DUMP_TOP_RETAINERS - 1].retainedBytes) {
+			continue;
+		}
+		int i = dump.numTop < DUMP_TOP_RETAINERS ? dump.numTop++ : DUMP_TOP_RETAINERS - 1;
+		for (; i > 0 && dump.top[i - 1].retainedBytes < retained[n]; i--) {
+			dump.top[i] = dump.top[i - 1];
+		}
+		dump.top[i].type = object->type;
+		dump.top[i].shallowBytes = size;
+		dump.top[i].retainedBytes = retained[n];
+	}
+	dump.stackSize = vm->stackSize;
+	for (int i = 0; i < vm->stackSize; i++) {
+		dump.rootRetained[i] = isObject(vm->stack[i]) ? retained[numberOf(&numbers, asObject(vm->stack[i]))] : 0;
+	}
+	
+	free(retained);
+	free(dominators);
+	free(order);
+	free(numbers.keys);
+	free(numbers.numbers);
+	return dump;
+}
+
+void freeHeapDump(HeapDump* dump) {
+	free(dump->siteLiveSamples);
+	free(dump->siteLiveBytes);
+}
+
+//names a frame by its symbol when the binary exports one, and by its offset into the binary otherwise, so names match between runs
+void writeFrame(FILE* file, void* frame) {
+	Dl_info info;
+	if (!dladdr(frame, &info)) {
+		fprintf(file, "\"%p\"", frame);
+	}
+	else if (info.dli_sname) {
+		fprintf(file, "\"%s+0x%lx\"", info.dli_sname, (unsigned long)((char*)frame - (char*)info.dli_saddr));
+	}
+	else {
+		const char* name = strrchr(info.dli_fname, '/');
+		fprintf(file, "\"%s+0x%lx\"", name ? name + 1 : info.dli_fname, (unsigned long)((char*)frame - (char*)info.dli_fbase));
+	}
+}
+
+//the dump as a single JSON object, types keyed by name and sites by their frames, so two dumps can be diffed
+void writeHeapDump(VM* vm, HeapDump* dump, FILE* file) {
+	fprintf(file, "{\"objects\": %d, \"bytes\": %zu, \"types\": {", dump->numObjects, dump->numBytes);
+	for (int type = OBJ_STRING; type < NUM_OBJECT_TYPES; type++) {
+		fprintf(file, "%s\"%s\": {\"count\": %ld, \"bytes\": %zu}", type > OBJ_STRING ? ", " : "",
+			typeNames[type], dump->typeCounts[type], dump->typeBytes[type]);
+	}
+	fprintf(file, "}, \"roots\": [");
+	for (int i = 0; i < dump->stackSize; i++) {
+		fprintf(file, i ? ", %zu" : "%zu", dump->rootRetained[i]);
+	}
+	fprintf(file, "], \"retainers\": [");
+	for (int i = 0; i < dump->numTop; i++) {
+		fprintf(file, "%s{\"type\": \"%s\", \"shallowBytes\": %zu, \"retainedBytes\": %zu}", i ? ", " : "",
+			typeNames[dump->top[i].type], dump->top[i].shallowBytes, dump->top[i].retainedBytes);
+	}
+	fprintf(file, "], \"sampleRate\": %d, \"sites\": [", vm->sampleRate);
+	for (int index = 1; index < dump->numSites; index++) {
+		AllocationSite* site = &vm->sites[index];
+		fprintf(file, "%s{\"frames\": [", index > 1 ? ", " : "");
+		for (int i = 0; i < site->numFrames; i++) {
+			if (i > 0) {
+				fprintf(file, ", ");
+			}
+			writeFrame(file, site->frames[i]);
+		}
+		fprintf(file, "], \"samples\": %ld, \"bytes\": %ld, \"liveSamples\": %ld, \"liveBytes\": %zu}",
+			site->samples, site->bytes, dump->siteLiveSamples[index], dump->siteLiveBytes[index]);
+	}
+	fprintf(file, "]}\n");
+}
+
+void dumpHeap(VM* vm, FILE* file) {
+	HeapDump dump = heapDump(vm);
+	writeHeapDump(vm, &dump, file);
+	freeHeapDump(&dump);
+}
+
+void test1() {
+	printf("Test 1: Objects on stack are preserved.\n");
+	VM* vm = newVM();
+	pushString(vm, "1");
+	pushString(vm, "2");
+	
+	gc(vm);
+	assert(vm->numObjects == 2, "Should have preserved objects.");
+	assert(vm->numPages == 1, "Should have kept the page holding them.");
+	freeVM(vm);
+}
+
+void test2() {
+	printf("Test 2: Unreached objects are collected.\n");
+	VM* vm = newVM();
+	pushString(vm, "1");
+	pushString(vm, "2");
+	pop(vm);
+	pop(vm);
+	
+	gc(vm);
+	assert(vm->numObjects == 0, "Should have collected unreached objects.");
+	freeVM(vm);
+}
+
+void test3() {
+	printf("Test 3: Reach nested objects.\n");
+	VM* vm = newVM();
+	pushString(vm, "1");
+	pushString(vm, "2");
+	pushPair(vm);
+	pushString(vm, "3");
+	pushString(vm, "4");
+	pushPair(vm);
+	pushPair(vm);
+	
+	gc(vm);
+	assert(vm->numObjects == 7, "Should have reached objects.");
+	freeVM(vm);
+}
+
+void test4() {
+	printf("Test 4: Handle cycles.\n");
+	VM* vm = newVM();
+	pushString(vm, "1");
+	pushString(vm, "2");
+	Object* a = pushPair(vm);
+	pushString(vm, "3");
+	pushString(vm, "4");
+	Object* b = pushPair(vm);
+	
+	//set up cycle, as well as make 2 and 4 unreachable.
+	setTail(vm, a, objectValue(b));
+	setTail(vm, b, objectValue(a));
+	
+	gc(vm);
+	assert(vm->numObjects == 4, "Should have collected objects.");
+	freeVM(vm);
+}
+
+void test5() {
+	printf("Test 5: Numbers are stored inline.\n");
+	VM* vm = newVM();
+	pushInt(vm, -7);
+	pushFloat(vm, 2.5);
+	Object* pair = pushPair(vm);
+	
+	assert(vm->numObjects == 1, "Should only have allocated the pair.");
+	assert(isInt(pair->head) && asInt(pair->head) == -7, "Should have kept the int.");
+	assert(isNumber(pair->tail) && asNumber(pair->tail) == 2.5, "Should have kept the float.");
+	assert(isNumber(numberValue(0.0 / 0.0)), "NaN should still be a number.");
+	
+	gc(vm);
+	assert(vm->numObjects == 1, "Should have preserved the pair.");
+	freeVM(vm);
+}
+
+void test6() {
+	printf("Test 6: Empty pages are released and free cells reused.\n");
+	VM* vm = newVM();
+	vm->maxBytes = 100000 * sizeof(Object);
+	for (int i = 0; i < 10000; i++) {
+		pushString(vm, "garbage");
+		pop(vm);
+	}
+	pushString(vm, "kept");
+	Object* kept = asObject(vm->stack[0]);
+	assert(vm->numPages > 1, "Should have needed several pages.");
+	
+	gc(vm);
+	assert(vm->numObjects == 1 && vm->numPages == 1, "Should only have kept the page holding the live object.");
+	pushString(vm, "reused");
+	assert(pageOf(asObject(vm->stack[1])) == pageOf(kept), "Should have reused a cell next to the live object.");
+	freeVM(vm);
+}
+
+void test7() {
+	printf("Test 7: Mark a 10M pair chain.\n");
+	VM* vm = newVM();
+	pushInt(vm, 0);
+	for (int i = 1; i <= 10000000; i++) {
+		pushInt(vm, i);
+		pushPair(vm);
+	}
+	
+	gc(vm);
+	assert(vm->numObjects == 10000000, "Should have marked the whole chain.");
+	freeVM(vm);
+}
+
+//builds a complete binary tree of pairs with the given depth on the stack
+void pushTree(VM* vm, int depth) {
+	if (depth == 0) {
+		pushString(vm, "leaf");
+		return;
+	}
+	pushTree(vm, depth - 1);
+	pushTree(vm, depth - 1);
+	pushPair(vm);
+}
+
+void test8() {
+	printf("Test 8: Marking survives a mark stack overflow.\n");
+	VM* vm = newVM();
+	vm->maxBytes = 100000 * sizeof(Object);
+	vm->markStackLimit = 4;
+	pushTree(vm, 12);
+	pushTree(vm, 12);
+	pop(vm);
+	
+	gc(vm);
+	assert(vm->numObjects == 8191, "Should have marked the whole tree.");
+	assert(vm->markStackCapacity == 4, "Should have stayed within the mark stack limit.");
+	freeVM(vm);
+}
+
+VM* newGenerationalVM() {
+	GCConfig config = defaultGCConfig();
+	config.nurserySize = 64 * 1024;
+	return newVMWith(config);
+}
+
+void test9() {
+	printf("Test 9: Minor collections promote survivors.\n");
+	VM* vm = newGenerationalVM();
+	pushString(vm, "survivor");
+	assert(isYoung(vm, asObject(vm->stack[0])), "Should have allocated in the nursery.");
+	for (int i = 0; i < 100000; i++) {
+		pushString(vm, "garbage");
+		pop(vm);
+	}
+	
+	Object* survivor = asObject(vm->stack[0]);
+	assert(vm->numMinorCollections > 0 && vm->numCollections == 0, "Should only have needed minor collections.");
+	assert(!isYoung(vm, survivor) && strcmp(survivor->chars, "survivor") == 0, "Should have promoted the survivor.");
+	assert(vm->numObjects == 1 + vm->nurseryObjects, "Should have counted the survivor and the nursery.");
+	
+	gc(vm);
+	assert(vm->numObjects == 1, "Should have preserved the survivor.");
+	freeVM(vm);
+	
+	//a nursery smaller than some cells, and not a multiple of 8, still only takes what fits
+	GCConfig config = defaultGCConfig();
+	config.nurserySize = 1001;
+	vm = newVMWith(config);
+	assert(vm->nurseryEnd - vm->nursery == 1000, "Should have rounded the nursery down.");
+	char text[1500];
+	memset(text, 'x', sizeof(text) - 1);
+	text[sizeof(text) - 1] = '\0';
+	for (int i = 0; i < 100; i++) {
+		pushString(vm, "small");
+		pushString(vm, text);
+		assert(!isYoung(vm, asObject(vm->stack[1])), "Should have allocated what cannot fit old.");
+		pop(vm);
+		pop(vm);
+	}
+	assert(vm->nurseryTop <= vm->nurseryEnd, "Should have stayed inside the nursery.");
+	freeVM(vm);
+}
+
+void test10() {
+	printf("Test 10: The write barrier keeps young objects alive.\n");
+	VM* vm = newGenerationalVM();
+	pushString(vm, "old");
+	pushString(vm, "old");
+	pushPair(vm);
+	minorGC(vm);
+	
+	pushString(vm, "young");
+	Object* pair = asObject(vm->stack[0]);
+	setTail(vm, pair, pop(vm));
+	assert(vm->rememberedSize == 1, "Should have remembered the old pair.");
+	minorGC(vm);
+	
+	assert(vm->rememberedSize == 0 && !pair->remembered, "Should have emptied the remembered set.");
+	assert(isObject(pair->tail) && !isYoung(vm, asObject(pair->tail)), "Should have promoted the young string.");
+	assert(strcmp(asObject(pair->tail)->chars, "young") == 0, "Should have kept the young string.");
+	gc(vm);
+	assert(vm->numObjects == 3, "Should have collected the replaced tail only.");
+	freeVM(vm);
+}
+
+//long-lived tree, plus pairs that mostly die young and sometimes get linked into an old list
+void generationalWorkload(VM* vm) {
+	pushTree(vm, 16);
+	pushString(vm, "list");
+	pushInt(vm, 0);
+	pushPair(vm);
+	for (int i = 0; i < 5000000; i++) {
+		pushString(vm, "temp");
+		pushInt(vm, i);
+		pushPair(vm);
+		if (i % 1000 == 0) {
+			//prepend the new pair to the list held by the old pair at the bottom of the list
+			Object* holder = asObject(vm->stack[1]);
+			Object* young = asObject(vm->stack[2]);
+			setTail(vm, young, holder->tail);
+			setTail(vm, holder, vm->stack[2]);
+		}
+		pop(vm);
+	}
+}
+
+void generationalPerfTest() {
+	printf("Generational performance test.\n");
+	VM* vms[2] = {newVM(), newGenerationalVM()};
+	const char* names[2] = {"full heap", "generational"};
+	for (int i = 0; i < 2; i++) {
+		VM* vm = vms[i];
+		double start = now();
+		generationalWorkload(vm);
+		double seconds = now() - start;
+		printf("%s: %.1f M allocations/s, %d full collections (mean %.3f ms, max %.3f ms), %d minor collections (mean %.3f ms, max %.3f ms).\n",
+			names[i], 10 / seconds,
+			vm->numCollections, vm->numCollections ? vm->totalPause * 1000 / vm->numCollections : 0, vm->maxPause * 1000,
+			vm->numMinorCollections, vm->numMinorCollections ? vm->totalMinorPause * 1000 / vm->numMinorCollections : 0, vm->maxMinorPause * 1000);
+		freeVM(vm);
+	}
+}
+
+void test11() {
+	printf("Test 11: Incremental marking keeps objects stored into black pairs.\n");
+	GCConfig config = defaultGCConfig();
+	config.incremental = 1;
+	config.sliceWork = 1;
+	VM* vm = newVMWith(config);
+	pushString(vm, "white");
+	pushInt(vm, 0);
+	pushPair(vm);
+	pushInt(vm, 1);
+	pushInt(vm, 2);
+	pushPair(vm);
+	
+	//the second pair is the last root marked, so the first slice scans it
+	startCycle(vm);
+	Object* holder = asObject(vm->stack[0]);
+	Object* black = asObject(vm->stack[1]);
+	incrementalStep(vm);
+	assert(isMarked(black) && !isMarked(asObject(holder->head)), "Should have scanned the second pair only.");
+	
+	//move the only reference to the white string into the black pair
+	setTail(vm, black, holder->head);
+	setHead(vm, holder, intValue(0));
+	finishCycle(vm);
+	
+	assert(vm->numObjects == 3, "Should have kept the string.");
+	assert(strcmp(asObject(black->tail)->chars, "white") == 0, "Should have kept the string intact.");
+	freeVM(vm);
+}
+
+const char* words[] = {"alpha", "beta", "gamma", "delta", "epsilon", "zeta", "eta", "theta"};
+
+//keeps rewriting the heads of a long list while collections run, then checks every head
+void mutateList(VM* vm) {
+	int length = 2000;
+	int* expected = malloc(length * sizeof(int));
+	pushInt(vm, 0);
+	for (int i = length - 1; i >= 0; i--) {
+		expected[i] = i % 8;
+		pushString(vm, words[expected[i]]);
+		Value next = vm->stack[vm->stackSize - 2];
+		vm->stack[vm->stackSize - 2] = vm->stack[vm->stackSize - 1];
+		vm->stack[vm->stackSize - 1] = next;
+		pushPair(vm);
+	}
+	
+	unsigned int seed = 1;
+	for (int round = 0; round < 200000; round++) {
+		seed = seed * 1103515245 + 12345;
+		int index = (seed >> 8) % 64;
+		int word = (seed >> 4) % 8;
+		pushString(vm, words[word]);
+		
+		Object* node = asObject(vm->stack[0]);
+		for (int i = 0; i < index; i++) {
+			node = asObject(node->tail);
+		}
+		setHead(vm, node, pop(vm));
+		expected[index] = word;
+		
+		//garbage to keep the collector busy
+		pushString(vm, "garbage");
+		pushString(vm, "garbage");
+		pushPair(vm);
+		pop(vm);
+	}
+	
+	Object* node = asObject(vm->stack[0]);
+	for (int i = 0; i < length; i++) {
+		assert(node->type == OBJ_PAIR && isObject(node->head), "Should have kept the list.");
+		assert(strcmp(asObject(node->head)->chars, words[expected[i]]) == 0, "Should have kept every head.");
+		node = i < length - 1 ? asObject(node->tail) : NULL;
+	}
+	free(expected);
+}
+
+void test12() {
+	printf("Test 12: Incremental collection under mutation.\n");
+	GCConfig config = defaultGCConfig();
+	config.incremental = 1;
+	config.sliceWork = 10;
+	VM* vm = newVMWith(config);
+	mutateList(vm);
+	assert(vm->numCycles > 0, "Should have run incremental cycles.");
+	freeVM(vm);
+	
+	config.nurserySize = 64 * 1024;
+	vm = newVMWith(config);
+	mutateList(vm);
+	assert(vm->numCycles > 0 && vm->numMinorCollections > 0, "Should have run incremental cycles and minor collections.");
+	freeVM(vm);
+}
+
+void incrementalPerfTest() {
+	printf("Incremental performance test.\n");
+	GCConfig config = defaultGCConfig();
+	const char* names[2] = {"stop the world", "incremental"};
+	for (int i = 0; i < 2; i++) {
+		config.incremental = i;
+		VM* vm = newVMWith(config);
+		double start = now();
+		pushTree(vm, 18);
+		for (int j = 0; j < 3000000; j++) {
+			pushString(vm, "temp");
+			pushInt(vm, j);
+			pushPair(vm);
+			pop(vm);
+		}
+		double seconds = now() - start;
+		//the tree is half a million objects, and the loop allocates two per iteration
+		printf("%s: %.1f M allocations/s, %ld pauses, p50 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, max %.3f ms.\n",
+			names[i], 6.5 / seconds, vm->pauses.total,
+			pausePercentile(&vm->pauses, 50) * 1000, pausePercentile(&vm->pauses, 99) * 1000,
+			pausePercentile(&vm->pauses, 99.9) * 1000, vm->pauses.max * 1000);
+		freeVM(vm);
+	}
+}
+
+void test13() {
+	printf("Test 13: Parallel marking.\n");
+	GCConfig config = defaultGCConfig();
+	config.markThreads = 4;
+	VM* vm = newVMWith(config);
+	vm->maxBytes = 1000000 * sizeof(Object);
+	for (int i = 0; i < 8; i++) {
+		pushTree(vm, 12);
+	}
+	pushTree(vm, 12);
+	pop(vm);
+	
+	//a cycle reachable from the stack, and one that is not
+	pushString(vm, "1");
+	pushString(vm, "2");
+	Object* a = pushPair(vm);
+	pushString(vm, "3");
+	pushString(vm, "4");
+	Object* b = pushPair(vm);
+	setTail(vm, a, objectValue(b));
+	setTail(vm, b, objectValue(a));
+	pop(vm);
+	pushString(vm, "5");
+	pushString(vm, "6");
+	Object* c = pushPair(vm);
+	setTail(vm, c, objectValue(c));
+	pop(vm);
+	
+	gc(vm);
+	assert(vm->numObjects == 8 * 8191 + 4, "Should have marked every reachable object once.");
+	
+	//deques of 2 entries overflow all the time
+	vm->markDequeSize = 2;
+	gc(vm);
+	assert(vm->numObjects == 8 * 8191 + 4, "Should have recovered from overflowing deques.");
+	freeVM(vm);
+}
+
+void test14() {
+	printf("Test 14: Automatic collections leave the sweep to allocation.\n");
+	VM* vm = newVM();
+	pushString(vm, "kept");
+	Object* kept = asObject(vm->stack[0]);
+	Object before = *kept;
+	while (vm->numCollections == 0) {
+		pushString(vm, "garbage");
+		pop(vm);
+	}
+	
+	assert(vm->gcState == GC_SWEEPING && vm->pagesToSweep == vm->numPages, "Should only have marked.");
+	assert(vm->numObjects == 2, "Should have counted the survivor and the object allocated since.");
+	assert(memcmp(kept, &before, sizeof(Object)) == 0, "Should not have written to the live object.");
+	
+	//allocation sweeps the page once its free cells run out instead of making a new one
+	vm->maxBytes = 100000 * sizeof(Object);
+	for (int i = 0; i < 10000 && vm->gcState == GC_SWEEPING; i++) {
+		pushString(vm, "garbage");
+		pop(vm);
+	}
+	assert(vm->gcState == GC_IDLE && vm->numLazySweeps == 1, "Should have swept on the allocation path.");
+	assert(vm->numPages == 1 && strcmp(kept->chars, "kept") == 0, "Should have reused the page of the live object.");
+	
+	gc(vm);
+	assert(vm->numObjects == 1, "Should have preserved the survivor.");
+	freeVM(vm);
+	
+	//the next threshold comes from what survived, not from what was allocated before the collection
+	vm = newVM();
+	pushTree(vm, 12);
+	gc(vm);
+	size_t live = vm->numBytes;
+	int collections = vm->numCollections;
+	while (vm->numCollections == collections) {
+		pushString(vm, "garbage");
+		pop(vm);
+	}
+	assert(vm->gcState == GC_SWEEPING, "Should have collected lazily.");
+	assert(vm->maxBytes == (size_t)(live * vm->growthFactor), "Should have sized the heap by the survivors.");
+	freeVM(vm);
+}
+
+void lazySweepPerfTest() {
+	printf("Lazy sweep performance test.\n");
+	GCConfig config = defaultGCConfig();
+	const char* names[2] = {"eager sweep", "lazy sweep"};
+	for (int i = 0; i < 2; i++) {
+		config.lazySweep = i;
+		VM* vm = newVMWith(config);
+		double start = now();
+		pushTree(vm, 18);
+		for (int j = 0; j < 3000000; j++) {
+			pushString(vm, "temp");
+			pushInt(vm, j);
+			pushPair(vm);
+			pop(vm);
+		}
+		double seconds = now() - start;
+		printf("%s: %.1f M allocations/s, %d collections (mean %.3f ms, max %.3f ms), %d lazy sweeps (max %.3f ms), %.1f ms collecting.\n",
+			names[i], 6.5 / seconds,
+			vm->numCollections, vm->numCollections ? vm->totalPause * 1000 / vm->numCollections : 0, vm->maxPause * 1000,
+			vm->numLazySweeps, vm->maxLazySweep * 1000, (vm->totalPause + vm->totalLazySweep) * 1000);
+		freeVM(vm);
+	}
+}
+
+VM* newCompactingVM() {
+	GCConfig config = defaultGCConfig();
+	config.compacting = 1;
+	return newVMWith(config);
+}
+
+void test15() {
+	printf("Test 15: Compaction packs live objects together breadth first.\n");
+	VM* vm = newCompactingVM();
+	vm->maxBytes = 100000 * sizeof(Object);
+	
+	//a cycle, with garbage between all of its objects
+	pushString(vm, "1");
+	for (int i = 0; i < 10000; i++) {
+		pushString(vm, "garbage");
+		pop(vm);
+	}
+	pushInt(vm, 0);
+	Object* a = pushPair(vm);
+	pushString(vm, "2");
+	for (int i = 0; i < 10000; i++) {
+		pushString(vm, "garbage");
+		pop(vm);
+	}
+	pushInt(vm, 0);
+	Object* b = pushPair(vm);
+	setTail(vm, a, objectValue(b));
+	setTail(vm, b, objectValue(a));
+	pop(vm);
+	assert(vm->numPages > 1, "Should have needed several pages.");
+	
+	gc(vm);
+	assert(vm->numObjects == 4 && vm->numPages == 1, "Should have copied the live objects into a single page.");
+	Object* first = asObject(vm->stack[0]);
+	Object* second = asObject(first->tail);
+	assert(first != a && second != b, "Should have moved the pairs.");
+	assert(asObject(second->tail) == first, "Should have kept the cycle.");
+	assert(strcmp(asObject(first->head)->chars, "1") == 0 && strcmp(asObject(second->head)->chars, "2") == 0, "Should have kept the strings.");
+	
+	//the first pair, its head and tail, then the head of the second pair
+	int cellSize = sizeClasses[sizeClassOf(sizeof(Object))];
+	assert((char*)asObject(first->head) == (char*)first + cellSize && (char*)second == (char*)first + 2 * cellSize, "Should have copied breadth first.");
+	freeVM(vm);
+	
+	//objects keep moving under the mutator, with and without a nursery
+	vm = newCompactingVM();
+	mutateList(vm);
+	assert(vm->numCollections > 0, "Should have compacted.");
+	freeVM(vm);
+	GCConfig config = defaultGCConfig();
+	config.compacting = 1;
+	config.nurserySize = 64 * 1024;
+	vm = newVMWith(config);
+	mutateList(vm);
+	freeVM(vm);
+}
+
+//keeps the events of a test
+typedef struct {
+	int numEvents;
+	GCEvent last;
+	long objectsFreed;
+} EventLog;
+
+void logEvent(const GCEvent* event, void* data) {
+	EventLog* log = data;
+	log->numEvents++;
+	log->last = *event;
+	log->objectsFreed += event->objectsFreed;
+}
+
+void test16() {
+	printf("Test 16: Telemetry.\n");
+	EventLog log = {0};
+	GCConfig config = defaultGCConfig();
+	config.onCollection = logEvent;
+	config.callbackData = &log;
+	VM* vm = newVMWith(config);
+	for (int i = 0; i < 10; i++) {
+		pushString(vm, "1");
+	}
+	for (int i = 0; i < 5; i++) {
+		pop(vm);
+	}
+	
+	gc(vm);
+	assert(log.numEvents == 1 && log.last.kind == GC_EVENT_FULL, "Should have reported the collection.");
+	assert(log.last.objectsFreed == 5 && log.last.bytesFreed == 5 * sizeof(Object), "Should have reported what was freed.");
+	assert(log.last.objectsSurviving == 5 && log.last.bytesSurviving == 5 * sizeof(Object), "Should have reported what survived.");
+	GCStats stats = gcStats(vm);
+	assert(stats.objectsAllocated == 10 && stats.bytesAllocated == 10 * sizeof(Object), "Should have counted the allocations.");
+	assert(stats.collections == 1 && stats.historySize == 1 && stats.history[0].heapBytes == PAGE_SIZE, "Should have sampled the heap.");
+	freeVM(vm);
+	
+	//the counts add up while incremental cycles and minor collections run under the mutator
+	memset(&log, 0, sizeof(log));
+	config.incremental = 1;
+	config.nurserySize = 64 * 1024;
+	vm = newVMWith(config);
+	mutateList(vm);
+	stats = gcStats(vm);
+	assert(stats.cycles > 0 && stats.minorCollections > 0, "Should have run cycles and minor collections.");
+	assert(log.numEvents == stats.cycles + stats.minorCollections && log.objectsFreed == stats.objectsFreed, "Should have reported every collection.");
+	assert(stats.objectsAllocated == stats.objectsFreed + stats.objectsSurviving, "Should have accounted for every object.");
+	assert(stats.historySize <= HEAP_HISTORY && stats.peakHeapBytes >= stats.heapBytes, "Should have kept the history bounded.");
+	freeVM(vm);
+}
+
+//a tree that stays live, and pairs that die young
+void churn(VM* vm, int depth, int allocations) {
+	pushTree(vm, depth);
+	for (int i = 0; i < allocations; i++) {
+		pushString(vm, "temp");
+		pushInt(vm, i);
+		pushPair(vm);
+		pop(vm);
+	}
+}
+
+void test17() {
+	printf("Test 17: Heap sizing.\n");
+	GCConfig config = defaultGCConfig();
+	config.growthFactor = 4;
+	VM* vm = newVMWith(config);
+	pushTree(vm, 12);
+	gc(vm);
+	assert(vm->maxBytes == 4 * 8191 * sizeof(Object), "Should have let the live bytes grow by the growth factor.");
+	freeVM(vm);
+	
+	//the ceiling holds whether collections sweep lazily, run incrementally, go through a nursery or compact
+	for (int mode = 0; mode < 4; mode++) {
+		config = defaultGCConfig();
+		config.heapLimit = 16 * PAGE_SIZE;
+		config.incremental = mode == 1;
+		config.nurserySize = mode == 2 ? 64 * 1024 : 0;
+		config.compacting = mode == 3;
+		config.growthFactor = 8;
+		vm = newVMWith(config);
+		churn(vm, 13, 1000000);
+		GCStats stats = gcStats(vm);
+		assert(stats.peakHeapBytes <= config.heapLimit, "Should have stayed under the heap limit.");
+		assert(stats.collections + stats.cycles < 1000, "Should not have thrashed.");
+		freeVM(vm);
+	}
+	
+	//when collecting takes too long the heap grows, and when it takes next to no time it shrinks
+	config = defaultGCConfig();
+	config.targetGCShare = 0.0001;
+	vm = newVMWith(config);
+	churn(vm, 14, 1000000);
+	assert(vm->growthFactor > 2, "Should have grown the heap.");
+	freeVM(vm);
+	config.targetGCShare = 0.9;
+	vm = newVMWith(config);
+	churn(vm, 14, 1000000);
+	assert(vm->growthFactor < 2, "Should have shrunk the heap.");
+	freeVM(vm);
+}
+
+void heapSizingPerfTest() {
+	printf("Heap sizing performance test.\n");
+	const char* names[5] = {"growth 2", "growth 4", "limit 24 MB", "adaptive 5%", "adaptive 5%, limit 24 MB"};
+	for (int i = 0; i < 5; i++) {
+		GCConfig config = defaultGCConfig();
+		config.growthFactor = i == 1 ? 4 : 2;
+		config.heapLimit = i == 2 || i == 4 ? 24 * 1024 * 1024 : 0;
+		config.targetGCShare = i >= 3 ? 0.05 : 0;
+		VM* vm = newVMWith(config);
+		double start = now();
+		churn(vm, 18, 3000000);
+		double seconds = now() - start;
+		GCStats stats = gcStats(vm);
+		printf("%s: %.1f M allocations/s, %d collections, %.1f%% of the time collecting, peak heap %.1f MB.\n",
+			names[i], 6.5 / seconds, stats.collections,
+			(stats.totalPause + stats.totalLazySweep) / seconds * 100, stats.peakHeapBytes / 1048576.0);
+		freeVM(vm);
+	}
+}
+
+typedef struct {
+	VM* vm;
+	int id;
+	int iterations;
+	int ok;
+} MutatorTask;
+
+//a mutator thread that keeps a list of its own alive while it makes garbage, then checks the list
+void* listWorker(void* argument) {
+	MutatorTask* task = argument;
+	Mutator* mutator = newMutator(task->vm);
+	mutatorPush(mutator, intValue(0));
+	long expected = 0;
+	int length = 0;
+	for (int i = 0; i < task->iterations; i++) {
+		if (i % 100 == 0) {
+			mutatorPush(mutator, intValue(task->id * 1000 + length));
+			mutatorPush(mutator, mutator->stack[0]);
+			mutatorPushPair(mutator);
+			mutator->stack[0] = mutatorPop(mutator);
+			expected += task->id * 1000 + length++;
+		}
+		mutatorPushString(mutator, "garbage");
+		mutatorPush(mutator, intValue(i));
+		mutatorPushPair(mutator);
+		mutatorPop(mutator);
+	}
+	
+	long sum = 0;
+	int found = 0;
+	for (Value node = mutator->stack[0]; isObject(node); node = asObject(node)->tail) {
+		sum += asInt(asObject(node)->head);
+		found++;
+	}
+	task->ok = sum == expected && found == length;
+	freeMutator(mutator);
+	return NULL;
+}
+
+//runs the list worker on that many threads, returning the seconds it took
+double runMutators(VM* vm, int numThreads, int iterations, MutatorTask* tasks) {
+	pthread_t threads[64];
+	double start = now();
+	for (int i = 0; i < numThreads; i++) {
+		tasks[i].vm = vm;
+		tasks[i].id = i + 1;
+		tasks[i].iterations = iterations;
+		tasks[i].ok = 0;
+		assert(pthread_create(&threads[i], NULL, listWorker, &tasks[i]) == 0, "Could not start a mutator thread! UNSWAG");
+	}
+	for (int i = 0; i < numThreads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	return now() - start;
+}
+
+void test18() {
+	printf("Test 18: Mutator threads share the heap.\n");
+	MutatorTask tasks[4];
+	for (int compacting = 0; compacting < 2; compacting++) {
+		GCConfig config = defaultGCConfig();
+		config.compacting = compacting;
+		config.markThreads = compacting ? 1 : 2;
+		VM* vm = newVMWith(config);
+		runMutators(vm, 4, 200000, tasks);
+		for (int i = 0; i < 4; i++) {
+			assert(tasks[i].ok, "Should have kept every list intact.");
+		}
+		assert(vm->numCollections > 0 && vm->numMutators == 0, "Should have collected while the threads ran.");
+		
+		//the lists went with their mutators
+		gc(vm);
+		assert(vm->numObjects == 0, "Should have collected everything.");
+		freeVM(vm);
+	}
+	
+	//strings past the largest size class go to the large object space
+	VM* vm = newVM();
+	Mutator* mutator = newMutator(vm);
+	char text[4001];
+	memset(text, 'x', 4000);
+	text[4000] = '\0';
+	mutatorPushString(mutator, text);
+	for (int i = 0; i < 1000; i++) {
+		mutatorPushString(mutator, text);
+		mutatorPop(mutator);
+	}
+	Object* kept = asObject(mutator->stack[0]);
+	assert(isLarge(kept) && strcmp(kept->chars, text) == 0, "Should have kept the large string intact.");
+	assert(vm->numCollections > 0 && vm->numLargePages < 1000, "Should have collected the large garbage.");
+	freeMutator(mutator);
+	gc(vm);
+	assert(vm->numLargePages == 0 && vm->largeBytes == 0, "Should have freed every large page.");
+	freeVM(vm);
+}
+
+void mutatorPerfTest() {
+	printf("Mutator threads performance test.\n");
+	MutatorTask tasks[8];
+	double single = 0;
+	int counts[] = {1, 2, 4, 8};
+	for (int i = 0; i < 4; i++) {
+		VM* vm = newVM();
+		//the same work split between the threads, two allocations per iteration
+		double seconds = runMutators(vm, counts[i], 4000000 / counts[i], tasks);
+		if (i == 0) {
+			single = seconds;
+		}
+		printf("%d threads: %.1f M allocations/s, %.2fx, %d collections.\n", counts[i], 8 / seconds, single / seconds, vm->numCollections);
+		freeVM(vm);
+	}
+}
+
+void test19() {
+	printf("Test 19: Strings own their characters and can be interned.\n");
+	VM* vm = newVM();
+	char text[] = "mutable";
+	pushString(vm, text);
+	text[0] = 'M';
+	Object* string = asObject(vm->stack[0]);
+	assert(strcmp(string->chars, "mutable") == 0 && string->length == 7, "Should have copied the characters.");
+	assert(string->hash == hashString("mutable", 7), "Should have cached the hash.");
+	pop(vm);
+	gc(vm);
+	
+	pushInternedString(vm, "shared");
+	pushInternedString(vm, "shared");
+	pushString(vm, "shared");
+	assert(vm->stack[0] == vm->stack[1] && vm->numObjects == 2, "Should have made a single interned string.");
+	assert(stringsEqual(asObject(vm->stack[0]), asObject(vm->stack[2])), "Should have compared the copy by its characters.");
+	
+	//the table does not keep strings alive
+	pushInternedString(vm, "dropped");
+	pop(vm);
+	gc(vm);
+	assert(vm->numObjects == 2 && vm->stringsSize == 1, "Should have dropped the unreached interned string.");
+	pushInternedString(vm, "shared");
+	assert(vm->stack[3] == vm->stack[0] && vm->numObjects == 2, "Should have found the surviving string.");
+	freeVM(vm);
+	
+	//interned strings skip the nursery, and the table follows them when they move
+	GCConfig config = defaultGCConfig();
+	config.nurserySize = 64 * 1024;
+	config.compacting = 1;
+	vm = newVMWith(config);
+	pushInternedString(vm, "moved");
+	assert(!isYoung(vm, asObject(vm->stack[0])), "Should have made the interned string old.");
+	for (int i = 0; i < 1000; i++) {
+		pushInternedString(vm, words[i % 8]);
+		pop(vm);
+	}
+	gc(vm);
+	pushInternedString(vm, "moved");
+	assert(vm->stack[1] == vm->stack[0] && vm->numObjects == 1 && vm->stringsSize == 1, "Should have followed the moved string.");
+	freeVM(vm);
+	
+	//strings interned while an incremental cycle runs keep their words
+	config = defaultGCConfig();
+	config.incremental = 1;
+	config.sliceWork = 10;
+	vm = newVMWith(config);
+	pushInt(vm, 0);
+	for (int i = 0; i < 100000; i++) {
+		pushInternedString(vm, words[i % 8]);
+		Value next = vm->stack[vm->stackSize - 2];
+		vm->stack[vm->stackSize - 2] = vm->stack[vm->stackSize - 1];
+		vm->stack[vm->stackSize - 1] = next;
+		pushPair(vm);
+		if (i % 100 == 99) {
+			pop(vm);
+			pushInt(vm, 0);
+		}
+	}
+	assert(vm->numCycles > 0, "Should have run incremental cycles.");
+	for (int i = 0; i < 8; i++) {
+		pushInternedString(vm, words[i]);
+		Object* found = asObject(pop(vm));
+		assert(strcmp(found->chars, words[i]) == 0, "Should have kept the interned strings intact.");
+	}
+	freeVM(vm);
+}
+
+void stringPerfTest() {
+	printf("String performance test.\n");
+	char phrases[64][64];
+	for (int i = 0; i < 64; i++) {
+		snprintf(phrases[i], sizeof(phrases[i]), "a phrase that comes up again and again, number %d", i);
+	}
+	const char* names[2] = {"copied", "interned"};
+	for (int i = 0; i < 2; i++) {
+		VM* vm = newVM();
+		vm->maxBytes = 100000000;
+		double start = now();
+		pushInt(vm, 0);
+		for (int j = 0; j < 1000000; j++) {
+			if (i == 0) {
+				pushString(vm, phrases[j % 64]);
+			}
+			else {
+				pushInternedString(vm, phrases[j % 64]);
+			}
+			Value next = vm->stack[0];
+			vm->stack[0] = vm->stack[1];
+			vm->stack[1] = next;
+			pushPair(vm);
+		}
+		double build = now() - start;
+		
+		//count the nodes whose head equals the first phrase
+		pushString(vm, phrases[0]);
+		Object* probe = asObject(vm->stack[1]);
+		if (i == 1) {
+			pushInternedString(vm, phrases[0]);
+			probe = asObject(pop(vm));
+		}
+		start = now();
+		int matches = 0;
+		for (Value node = vm->stack[0]; isObject(node); node = asObject(node)->tail) {
+			matches += stringsEqual(asObject(asObject(node)->head), probe);
+		}
+		double compare = now() - start;
+		assert(matches == 1000000 / 64, "Should have found every copy of the phrase.");
+		GCStats stats = gcStats(vm);
+		printf("%s: %ld objects, %.1f MB allocated, build %.1f ms, compare %.1f ns/string.\n",
+			names[i], stats.objectsAllocated, stats.bytesAllocated / 1048576.0, build * 1000, compare * 1e9 / 1000000);
+		freeVM(vm);
+	}
+}
+
+//sums the heads of the list on top of the stack
+long traverseList(VM* vm) {
+	long sum = 0;
+	Value node = vm->stack[vm->stackSize - 1];
+	while (isObject(node)) {
+		sum += asInt(asObject(node)->head);
+		node = asObject(node)->tail;
+	}
+	return sum;
+}
+
+void compactionPerfTest() {
+	printf("Compaction performance test.\n");
+	VM* vm = newCompactingVM();
+	vm->maxBytes = 100000000 * sizeof(Object);
+	
+	//a list whose nodes are scattered among garbage and linked in random order, like a heap that has churned for a while
+	int length = 1000000;
+	Object** nodes = malloc(length * sizeof(Object*));
+	unsigned int seed = 1;
+	for (int i = 0; i < length; i++) {
+		pushInt(vm, i);
+		pushInt(vm, 0);
+		nodes[i] = pushPair(vm);
+		pop(vm);
+		seed = seed * 1103515245 + 12345;
+		for (int j = (seed >> 8) % 4; j > 0; j--) {
+			pushString(vm, "garbage");
+			pop(vm);
+		}
+	}
+	for (int i = length - 1; i > 0; i--) {
+		seed = seed * 1103515245 + 12345;
+		int j = (seed >> 8) % (i + 1);
+		Object* node = nodes[i];
+		nodes[i] = nodes[j];
+		nodes[j] = node;
+	}
+	for (int i = 0; i < length - 1; i++) {
+		setTail(vm, nodes[i], objectValue(nodes[i + 1]));
+	}
+	push(vm, objectValue(nodes[0]));
+	free(nodes);
+	
+	double seconds[2];
+	for (int i = 0; i < 2; i++) {
+		if (i == 1) {
+			double start = now();
+			gc(vm);
+			printf("compaction: %.3f ms.\n", (now() - start) * 1000);
+		}
+		double start = now();
+		for (int round = 0; round < 5; round++) {
+			assert(traverseList(vm) == (long)length * (length - 1) / 2, "Should have walked the whole list.");
+		}
+		seconds[i] = (now() - start) / 5;
+	}
+	printf("traversal: fragmented %.1f ns/node, compacted %.1f ns/node, %.2fx.\n",
+		seconds[0] * 1e9 / length, seconds[1] * 1e9 / length, seconds[0] / seconds[1]);
+	freeVM(vm);
+}
+
+//pushes an array of the ints up to length
+Object* pushIntArray(VM* vm, int length) {
+	pushArray(vm);
+	for (int i = 0; i < length; i++) {
+		pushInt(vm, i);
+		arrayAppend(vm);
+	}
+	return asObject(vm->stack[vm->stackSize - 1]);
+}
+
+void test20() {
+	printf("Test 20: Arrays grow in place and big ones live in the large object space.\n");
+	VM* vm = newVM();
+	Object* array = pushIntArray(vm, 100);
+	assert(arrayLength(array) == 100 && array->elements->capacity == 128, "Should have doubled the capacity as it grew.");
+	gc(vm);
+	assert(vm->numObjects == 2, "Should have kept only the array and its latest elements.");
+	for (int i = 0; i < 100; i++) {
+		assert(asInt(arrayGet(array, i)) == i, "Should have kept the values in order.");
+	}
+	
+	//elements past the largest size class are one large object, the smaller ones they grew from are garbage
+	pop(vm);
+	array = pushIntArray(vm, 1000);
+	assert(vm->numLargePages == 3, "Should have put the big elements on large pages.");
+	gc(vm);
+	assert(vm->numLargePages == 1 && vm->largeBytes == largePageSize(elementsSize(1024)), "Should have freed the outgrown elements whole.");
+	assert(asInt(arrayGet(array, 999)) == 999, "Should have kept the large elements.");
+	pop(vm);
+	gc(vm);
+	assert(vm->numObjects == 0 && vm->numLargePages == 0 && vm->largeBytes == 0, "Should have collected the unreached array.");
+	freeVM(vm);
+	
+	//a compaction moves the array but not its large elements, and still updates what they point to
+	vm = newCompactingVM();
+	pushArray(vm);
+	for (int i = 0; i < 1000; i++) {
+		pushString(vm, words[i % 8]);
+		pushString(vm, "garbage");
+		pop(vm);
+		arrayAppend(vm);
+	}
+	Object* elements = asObject(vm->stack[0])->elements;
+	gc(vm);
+	array = asObject(vm->stack[0]);
+	assert(array->elements == elements && vm->numObjects == 1002, "Should have left the large elements where they were.");
+	for (int i = 0; i < 1000; i++) {
+		assert(strcmp(asObject(arrayGet(array, i))->chars, words[i % 8]) == 0, "Should have updated the values of the large elements.");
+	}
+	freeVM(vm);
+	
+	//old large elements pointing into the nursery are remembered by the barrier
+	vm = newGenerationalVM();
+	pushIntArray(vm, 1000);
+	for (int i = 0; i < 1000; i++) {
+		pushString(vm, words[i % 8]);
+		arraySet(vm, asObject(vm->stack[0]), i, pop(vm));
+		churn(vm, 2, 2);
+		pop(vm);
+	}
+	assert(vm->numMinorCollections > 0, "Should have run minor collections.");
+	gc(vm);
+	array = asObject(vm->stack[0]);
+	for (int i = 0; i < 1000; i++) {
+		assert(strcmp(asObject(arrayGet(array, i))->chars, words[i % 8]) == 0, "Should have kept the young values of old elements.");
+	}
+	freeVM(vm);
+	
+	//an array growing while an incremental cycle runs keeps whatever it copied into new elements
+	GCConfig config = defaultGCConfig();
+	config.incremental = 1;
+	config.sliceWork = 10;
+	vm = newVMWith(config);
+	pushArray(vm);
+	for (int i = 0; i < 20000; i++) {
+		pushString(vm, words[i % 8]);
+		arrayAppend(vm);
+		pushString(vm, "garbage");
+		pop(vm);
+	}
+	assert(vm->numCycles > 0, "Should have run incremental cycles.");
+	finishCycle(vm);
+	gc(vm);
+	array = asObject(vm->stack[0]);
+	assert(vm->numObjects == 20002, "Should have kept every appended string.");
+	for (int i = 0; i < 20000; i++) {
+		assert(strcmp(asObject(arrayGet(array, i))->chars, words[i % 8]) == 0, "Should have kept the strings intact.");
+	}
+	
+	//parallel marking scans the elements too
+	vm->markThreads = 4;
+	gc(vm);
+	assert(vm->numObjects == 20002 && vm->numLargePages == 1, "Should have marked the array in parallel.");
+	freeVM(vm);
+}
+
+void arrayPerfTest() {
+	printf("Array performance test.\n");
+	int length = 1000000;
+	const char* names[2] = {"list", "array"};
+	for (int i = 0; i < 2; i++) {
+		VM* vm = newVM();
+		vm->maxBytes = 100000000;
+		double start = now();
+		if (i == 0) {
+			pushInt(vm, 0);
+			for (int j = length - 1; j >= 0; j--) {
+				pushInt(vm, j);
+				Value next = vm->stack[0];
+				vm->stack[0] = vm->stack[1];
+				vm->stack[1] = next;
+				pushPair(vm);
+			}
+		}
+		else {
+			pushIntArray(vm, length);
+		}
+		double build = now() - start;
+		gc(vm);
+		double mark = vm->totalPause;
+		
+		start = now();
+		long sum = 0;
+		for (int round = 0; round < 5; round++) {
+			if (i == 0) {
+				sum += traverseList(vm);
+			}
+			else {
+				Object* elements = asObject(vm->stack[0])->elements;
+				for (int j = 0; j < elements->count; j++) {
+					sum += asInt(elements->values[j]);
+				}
+			}
+		}
+		double iterate = (now() - start) / 5;
+		assert(sum == 5L * length * (length - 1) / 2, "Should have summed every element.");
+		printf("%s: %.1f MB live, %.1f MB heap, build %.1f ms, collect %.1f ms, iterate %.2f ns/element.\n", names[i],
+			vm->numBytes / 1048576.0, heapBytes(vm) / 1048576.0, build * 1000, mark * 1000, iterate * 1e9 / length);
+		freeVM(vm);
+	}
+}
+
+//a list of the words and garbage in between, on top of the stack
+void pushWordList(VM* vm, int length) {
+	pushInt(vm, 0);
+	for (int i = length - 1; i >= 0; i--) {
+		pushString(vm, words[i % 8]);
+		Value next = vm->stack[vm->stackSize - 2];
+		vm->stack[vm->stackSize - 2] = vm->stack[vm->stackSize - 1];
+		vm->stack[vm->stackSize - 1] = next;
+		pushPair(vm);
+		pushString(vm, "garbage");
+		pop(vm);
+	}
+}
+
+void checkWordList(Value list, int length) {
+	for (int i = 0; i < length; i++) {
+		assert(strcmp(asObject(asObject(list)->head)->chars, words[i % 8]) == 0, "Should have kept the words of the list.");
+		list = asObject(list)->tail;
+	}
+	assert(isInt(list), "Should have kept the end of the list.");
+}
+
+void test21() {
+	printf("Test 21: A heap image loads back as the same heap.\n");
+	char path[] = "/tmp/gc-image-XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd >= 0, "Could not make a temporary file! UNSWAG");
+	close(fd);
+	
+	VM* vm = newGenerationalVM();
+	pushInternedString(vm, "shared");
+	pushIntArray(vm, 1000);
+	pushWordList(vm, 1000);
+	pushFloat(vm, 2.5);
+	assert(saveImage(vm, path), "Should have written the image.");
+	int numObjects = vm->numObjects;
+	size_t numBytes = vm->numBytes;
+	freeVM(vm);
+	
+	vm = loadImage(path, defaultGCConfig());
+	assert(vm != NULL && vm->stackSize == 4, "Should have loaded the stack.");
+	assert(vm->numObjects == numObjects && vm->numBytes == numBytes, "Should have loaded every object.");
+	assert(pageOf(asObject(vm->stack[1]))->mapped && vm->numLargePages == 1, "Should have mapped the pages from the file.");
+	pushInternedString(vm, "shared");
+	assert(pop(vm) == vm->stack[0], "Should have loaded the intern table.");
+	Object* array = asObject(vm->stack[1]);
+	for (int i = 0; i < 1000; i++) {
+		assert(asInt(arrayGet(array, i)) == i, "Should have loaded the array.");
+	}
+	checkWordList(vm->stack[2], 1000);
+	assert(asNumber(vm->stack[3]) == 2.5, "Should have loaded the number.");
+	
+	//a loaded heap is collected like any other, mapped pages are handed back too
+	vm->stack[1] = intValue(0);
+	gc(vm);
+	assert(vm->numObjects == numObjects - 2 && vm->numLargePages == 0, "Should have collected the dropped array.");
+	for (int i = 0; i < 10; i++) {
+		churn(vm, 10, 10000);
+		pop(vm);
+	}
+	checkWordList(vm->stack[2], 1000);
+	freeVM(vm);
+	
+	//a compacting VM copies the image out of the mapped pages
+	GCConfig config = defaultGCConfig();
+	config.compacting = 1;
+	vm = loadImage(path, config);
+	gc(vm);
+	assert(vm->numObjects == numObjects && !pageOf(asObject(vm->stack[2]))->mapped, "Should have copied the loaded heap.");
+	checkWordList(vm->stack[2], 1000);
+	freeVM(vm);
+	
+	//saving over the image a heap was loaded from leaves the mapped pages alone
+	vm = loadImage(path, defaultGCConfig());
+	assert(saveImage(vm, path), "Should have written over the loaded image.");
+	checkWordList(vm->stack[2], 1000);
+	freeVM(vm);
+	vm = loadImage(path, defaultGCConfig());
+	assert(vm != NULL && vm->numObjects == numObjects, "Should have loaded the image written over the old one.");
+	checkWordList(vm->stack[2], 1000);
+	freeVM(vm);
+	
+	struct stat info;
+	assert(stat(path, &info) == 0 && truncate(path, info.st_size - PAGE_SIZE) == 0, "Could not truncate the image! UNSWAG");
+	assert(loadImage(path, defaultGCConfig()) == NULL, "Should have refused an image cut short.");
+	
+	assert(loadImage("/nonexistent/gc-image", defaultGCConfig()) == NULL, "Should have failed to load a missing image.");
+	FILE* file = fopen(path, "wb");
+	fprintf(file, "not a heap image, not even close to one");
+	fclose(file);
+	assert(loadImage(path, defaultGCConfig()) == NULL, "Should have refused a file that is not an image.");
+	unlink(path);
+}
+
+void imagePerfTest() {
+	printf("Image performance test.\n");
+	char path[] = "/tmp/gc-image-XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd >= 0, "Could not make a temporary file! UNSWAG");
+	close(fd);
+	
+	//a lookup table: an array of pairs of an interned key and a list of values
+	int entries = 200000;
+	double start = now();
+	VM* vm = newVM();
+	pushArray(vm);
+	char key[32];
+	for (int i = 0; i < entries; i++) {
+		snprintf(key, sizeof(key), "key %d", i);
+		pushInternedString(vm, key);
+		pushInt(vm, i);
+		pushInt(vm, 0);
+		pushPair(vm);
+		pushPair(vm);
+		arrayAppend(vm);
+	}
+	double build = now() - start;
+	start = now();
+	assert(saveImage(vm, path), "Should have written the image.");
+	double save = now() - start;
+	size_t numBytes = vm->numBytes;
+	freeVM(vm);
+	
+	start = now();
+	vm = loadImage(path, defaultGCConfig());
+	double load = now() - start;
+	assert(vm != NULL && arrayLength(asObject(vm->stack[0])) == entries, "Should have loaded the table.");
+	pushInternedString(vm, "key 1234");
+	Object* entry = asObject(arrayGet(asObject(vm->stack[0]), 1234));
+	assert(pop(vm) == entry->head, "Should have loaded the interned keys.");
+	printf("%.1f MB live: build %.1f ms, save %.1f ms, load %.1f ms, %.1fx faster than building.\n",
+		numBytes / 1048576.0, build * 1000, save * 1000, load * 1000, build / load);
+	freeVM(vm);
+	unlink(path);
+}
+
+//allocates a list of pairs that nothing else shares, in a frame of its own for the profiler to find
+__attribute__((noinline)) void pushIntList(VM* vm, int length) {
+	pushInt(vm, 0);
+	for (int i = 0; i < length; i++) {
+		pushInt(vm, i);
+		Value next = vm->stack[vm->stackSize - 2];
+		vm->stack[vm->stackSize - 2] = vm->stack[vm->stackSize - 1];
+		vm->stack[vm->stackSize - 1] = next;
+		pushPair(vm);
+	}
+}
+
+void test22() {
+	printf("Test 22: Heap dumps attribute what is live, and sampled allocations to their sites.\n");
+	GCConfig config = defaultGCConfig();
+	config.allocationSampleRate = 1;
+	VM* vm = newVMWith(config);
+	pushIntList(vm, 100);
+	pushString(vm, "shared");
+	Value shared = vm->stack[1];
+	push(vm, shared);
+	pushInt(vm, 0);
+	pushPair(vm);
+	pushIntArray(vm, 10);
+	pushString(vm, "garbage");
+	pop(vm);
+	pushInt(vm, 7);
+	
+	HeapDump dump = heapDump(vm);
+	assert(dump.numObjects == 104 && dump.typeCounts[OBJ_PAIR] == 101 && dump.typeCounts[OBJ_STRING] == 1, "Should have counted the live objects by type.");
+	assert(dump.typeCounts[OBJ_ARRAY] == 1 && dump.typeBytes[OBJ_ELEMENTS] == elementsSize(16), "Should have left out the outgrown elements.");
+	assert(dump.rootRetained[0] == 100 * sizeof(Object), "Should have given the whole list to its slot.");
+	//the string is held by two slots, so neither of them retains it
+	assert(dump.rootRetained[1] == stringSize(6) && dump.rootRetained[2] == sizeof(Object), "Should have left the shared string to the stack.");
+	assert(dump.rootRetained[3] == sizeof(Object) + elementsSize(16) && dump.rootRetained[4] == 0, "Should have given the elements to their array.");
+	assert(dump.top[0].type == OBJ_PAIR && dump.top[0].retainedBytes == 100 * sizeof(Object), "Should have put the head of the list first.");
+	
+	//every allocation was sampled, the pairs of the list from the same stack
+	long samples = 0;
+	long liveSamples = 0;
+	int listSite = 0;
+	for (int index = 1; index < vm->numSites; index++) {
+		samples += vm->sites[index].samples;
+		liveSamples += dump.siteLiveSamples[index];
+		if (vm->sites[index].samples == 100) {
+			listSite = index;
+		}
+	}
+	assert(samples == gcStats(vm).objectsAllocated && liveSamples == dump.numObjects, "Should have sampled every allocation.");
+	assert(listSite && dump.siteLiveBytes[listSite] == 100 * sizeof(Object), "Should have found the site of the list.");
+	freeHeapDump(&dump);
+	FILE* file = fopen("/dev/null", "w");
+	dumpHeap(vm, file);
+	fclose(file);
+	freeVM(vm);
+	
+	//about one allocation in every rate is sampled, and sites stay with objects as they are promoted
+	config.nurserySize = 64 * 1024;
+	config.allocationSampleRate = 10;
+	vm = newVMWith(config);
+	pushIntList(vm, 10000);
+	for (int i = 0; i < 10; i++) {
+		churn(vm, 8, 1000);
+		pop(vm);
+	}
+	assert(vm->numMinorCollections > 0, "Should have run minor collections.");
+	dump = heapDump(vm);
+	samples = 0;
+	liveSamples = 0;
+	for (int index = 1; index < vm->numSites; index++) {
+		samples += vm->sites[index].samples;
+		liveSamples += dump.siteLiveSamples[index];
+	}
+	long allocated = gcStats(vm).objectsAllocated;
+	assert(samples > allocated / 20 && samples < allocated / 5, "Should have sampled about one allocation in ten.");
+	//the first sample is in the list, which is all still live
+	assert(vm->sites[1].samples > 0 && dump.siteLiveSamples[1] == vm->sites[1].samples, "Should have kept the sites of promoted objects.");
+	assert(liveSamples > dump.numObjects / 20 && liveSamples < dump.numObjects / 5, "Should have sampled about one live object in ten.");
+	freeHeapDump(&dump);
+	freeVM(vm);
+}
+
+void profilerPerfTest() {
+	printf("Allocation profiler performance test.\n");
+	int rates[3] = {0, 4096, 64};
+	double baseline = 0;
+	for (int i = 0; i < 3; i++) {
+		GCConfig config = defaultGCConfig();
+		config.allocationSampleRate = rates[i];
+		VM* vm = newVMWith(config);
+		double start = now();
+		churn(vm, 10, 2000000);
+		double seconds = now() - start;
+		if (i == 0) {
+			baseline = seconds;
+		}
+		printf("sample rate %d: %.1f M allocations/s, %+.1f%%, %d sites.\n", rates[i], gcStats(vm).objectsAllocated / seconds / 1e6,
+			(seconds / baseline - 1) * 100, vm->numSites > 0 ? vm->numSites - 1 : 0);
+		freeVM(vm);
+	}
+	
+	VM* vm = newVM();
+	vm->maxBytes = 100000000;
+	pushTree(vm, 20);
+	double start = now();
+	HeapDump dump = heapDump(vm);
+	printf("heap dump: %d objects in %.1f ms.\n", dump.numObjects, (now() - start) * 1000);
+	freeHeapDump(&dump);
+	freeVM(vm);
+}
+
+void parallelMarkPerfTest() {
+	printf("Parallel mark performance test.\n");
+	VM* vm = newVM();
+	vm->maxBytes = 10000000 * sizeof(Object);
+	for (int i = 0; i < 16; i++) {
+		pushTree(vm, 17);
+	}
+	
+	double serial = 0;
+	int counts[] = {1, 2, 4, 8};
+	for (int i = 0; i < 4; i++) {
+		vm->markThreads = counts[i];
+		double start = now();
+		markAll(vm);
+		double seconds = now() - start;
+		if (i == 0) {
+			serial = seconds;
+		}
+		printf("%d threads: %.1f M objects/s, %.2fx.\n", counts[i], vm->numObjects / seconds / 1e6, serial / seconds);
+		
+		//sweeping clears the marks for the next round
+		sweep(vm);
+	}
+	freeVM(vm);
+}
+
+void markPerfTest() {
+	printf("Mark performance test.\n");
+	VM* vm = newVM();
+	vm->maxBytes = 10000000 * sizeof(Object);
+	pushTree(vm, 20);
+	
+	clock_t start = clock();
+	markAll(vm);
+	double markMs = (clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+	sweep(vm);
+	
+	printf("mark: %.1f M objects/s over %d objects.\n", vm->numObjects / markMs / 1000, vm->numObjects);
+	freeVM(vm);
+}
+
+//the way objects were allocated before they lived in pages: one malloc each, with a link to the previous
+//allocation in front of the object so every object is on one list
+void** mallocString(void** objects, const char* chars) {
+	size_t length = strlen(chars);
+	void** link = malloc(sizeof(void*) + stringSize(length));
+	Object* object = (Object*)(link + 1);
+	object->type = OBJ_STRING;
+	object->length = length;
+	memcpy(object->chars, chars, length + 1);
+	*link = objects;
+	return link;
+}
+
+//sweeping a heap where nothing survives frees the whole list
+void freeMallocStrings(void** objects) {
+	while (objects) {
+		void** next = *objects;
+		free(objects);
+		objects = next;
+	}
+}
+
+//the patterns of allocPerfTest on malloc and free, to compare against
+void mallocPerfTest() {
+	//churn: collect every INITIAL_GC_THRESHOLD bytes, which is how often a heap with nothing live collects
+	int threshold = INITIAL_GC_THRESHOLD / stringSize(strlen("garbage"));
+	void** objects = NULL;
+	clock_t start = clock();
+	for (int i = 0; i < 1000000; i++) {
+		objects = mallocString(objects, "garbage");
+		if (i % threshold == threshold - 1) {
+			freeMallocStrings(objects);
+			objects = NULL;
+		}
+	}
+	freeMallocStrings(objects);
+	double churnMs = (clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+	
+	objects = NULL;
+	start = clock();
+	for (int i = 0; i < 1000000; i++) {
+		objects = mallocString(objects, "garbage");
+	}
+	double allocMs = (clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+	start = clock();
+	freeMallocStrings(objects);
+	double sweepMs = (clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+	
+	printf("malloc churn: %.1f M objects/s, alloc: %.1f M objects/s, sweep: %.1f M objects/s.\n", 1000 / churnMs, 1000 / allocMs, 1000 / sweepMs);
+}
+
+void allocPerfTest() {
+	printf("Allocation performance test.\n");
+	VM* vm = newVM();
+	
+	//churn: every object is garbage as soon as it is popped
+	clock_t start = clock();
+	for (int i = 0; i < 1000000; i++) {
+		pushString(vm, "garbage");
+		pop(vm);
+	}
+	double churnMs = (clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+	
+	//sweep a heap of a million dead objects in one go
+	gc(vm);
+	vm->maxBytes = 2000000 * sizeof(Object);
+	start = clock();
+	for (int i = 0; i < 1000000; i++) {
+		pushString(vm, "garbage");
+		pop(vm);
+	}
+	double allocMs = (clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+	start = clock();
+	gc(vm);
+	double sweepMs = (clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+	
+	printf("churn: %.1f M objects/s, alloc: %.1f M objects/s, sweep: %.1f M objects/s.\n", 1000 / churnMs, 1000 / allocMs, 1000 / sweepMs);
+	freeVM(vm);
+	
+	mallocPerfTest();
+}
+
+//the benchmark suite: each allocation pattern runs under each collector, and the results come out as JSON
+//run as "gc bench", optionally with the results of an earlier run to compare against and how much worse counts as a regression
+//a metric regresses once it is more than 1 + tolerance times worse, and by default that is twice as bad, as on a shared
+//machine reruns of the same build were up to 1.7 times apart; on a quiet one a tighter tolerance can be passed
+#define BENCH_TOLERANCE 1.0
+//below these a total collection time or a pause percentile is mostly timer and scheduling noise
+#define BENCH_MIN_SECONDS 0.01
+#define BENCH_MIN_PAUSE 10e-6
+//each benchmark runs this many times and every metric is the median of the runs, which also leaves out the warm up of the first
+#define BENCH_REPETITIONS 5
+
+//short lived churn around a small live set
+void benchChurn(VM* vm) {
+	pushTree(vm, 10);
+	for (int i = 0; i < 8000000; i++) {
+		pushString(vm, "temp");
+		pushInt(vm, i);
+		pushPair(vm);
+		pop(vm);
+	}
+}
+
+//a long lived list that keeps growing, with garbage made along the way
+void benchGrowing(VM* vm) {
+	pushInt(vm, 0);
+	for (int i = 0; i < 2000000; i++) {
+		pushInt(vm, i);
+		Value next = vm->stack[0];
+		vm->stack[0] = vm->stack[1];
+		vm->stack[1] = next;
+		pushPair(vm);
+		for (int j = 0; j < 3; j++) {
+			pushString(vm, "garbage");
+			pop(vm);
+		}
+	}
+}
+
+//long chains of pairs, dropped and made again
+void benchDeepChains(VM* vm) {
+	for (int round = 0; round < 25; round++) {
+		pushIntList(vm, 300000);
+		pop(vm);
+	}
+}
+
+//wide trees of arrays, a few of them live at a time
+void benchWideTrees(VM* vm) {
+	for (int i = 0; i < 4; i++) {
+		pushInt(vm, 0);
+	}
+	for (int tree = 0; tree < 800; tree++) {
+		pushArray(vm);
+		for (int i = 0; i < 64; i++) {
+			pushArray(vm);
+			for (int j = 0; j < 64; j++) {
+				pushInt(vm, j);
+				pushString(vm, words[j % 8]);
+				pushPair(vm);
+				arrayAppend(vm);
+			}
+			arrayAppend(vm);
+		}
+		vm->stack[tree % 4] = pop(vm);
+	}
+}
+
+//rings of pairs with edges across them, a few of them live at a time
+void benchCycles(VM* vm) {
+	for (int i = 0; i < 8; i++) {
+		pushInt(vm, 0);
+	}
+	for (int ring = 0; ring < 10000; ring++) {
+		pushIntList(vm, 1000);
+		Value first = vm->stack[vm->stackSize - 1];
+		Object* node = asObject(first);
+		for (int i = 1; isObject(node->tail); i++) {
+			if (i % 10 == 0) {
+				setHead(vm, node, first);
+			}
+			node = asObject(node->tail);
+		}
+		setTail(vm, node, first);
+		vm->stack[ring % 8] = pop(vm);
+	}
+}
+
+typedef struct {
+	const char* name;
+	void (*run)(VM* vm);
+} Benchmark;
+
+typedef struct {
+	char name[64];
+	long allocations;
+	double seconds;
+	double allocationRate;
+	double gcSeconds;
+	double p50;
+	double p99;
+	double p999;
+	double maxPause;
+	size_t peakHeapBytes;
+	long peakRSS;
+} BenchmarkResult;
+
+//the high water mark of the resident set can be reset on Linux, so each run measures its own, elsewhere it is the peak of the process
+void resetPeakRSS() {
+	malloc_trim(0);
+	FILE* file = fopen("/proc/self/clear_refs", "w");
+	if (file) {
+		fputs("5", file);
+		fclose(file);
+	}
+}
+
+long peakRSS() {
+	FILE* file = fopen("/proc/self/status", "r");
+	if (file) {
+		char line[256];
+		long kilobytes = -1;
+		while (fgets(line, sizeof(line), file)) {
+			if (sscanf(line, "VmHWM: %ld kB", &kilobytes) == 1) {
+				break;
+			}
+		}
+		fclose(file);
+		if (kilobytes >= 0) {
+			return kilobytes * 1024;
+		}
+	}
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss * 1024;
+}
+
+BenchmarkResult runBenchmark(Benchmark* benchmark, const char* collector, GCConfig config) {
+	BenchmarkResult result;
+	snprintf(result.name, sizeof(result.name), "%s/%s", benchmark->name, collector);
+	resetPeakRSS();
+	VM* vm = newVMWith(config);
+	double start = now();
+	benchmark->run(vm);
+	result.seconds = now() - start;
+	GCStats stats = gcStats(vm);
+	result.peakRSS = peakRSS();
+	result.allocations = stats.objectsAllocated;
+	result.allocationRate = stats.objectsAllocated / result.seconds;
+	result.gcSeconds = stats.totalPause + stats.totalMinorPause + stats.totalLazySweep;
+	result.p50 = pausePercentile(&stats.pauses, 50);
+	result.p99 = pausePercentile(&stats.pauses, 99);
+	result.p999 = pausePercentile(&stats.pauses, 99.9);
+	result.maxPause = stats.pauses.max;
+	result.peakHeapBytes = stats.peakHeapBytes;
+	freeVM(vm);
+	return result;
+}
+
+int compareDoubles(const void* a, const void* b) {
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+double medianOf(double* values, int numValues) {
+	qsort(values, numValues, sizeof(double), compareDoubles);
+	return values[numValues / 2];
+}
+
+//the median of each metric over the runs, taken one metric at a time, so one slow run moves none of them
+BenchmarkResult medianResult(BenchmarkResult* runs, int numRuns) {
+	double metrics[9][BENCH_REPETITIONS];
+	for (int i = 0; i < numRuns; i++) {
+		metrics[0][i] = runs[i].seconds;
+		metrics[1][i] = runs[i].allocationRate;
+		metrics[2][i] = runs[i].gcSeconds;
+		metrics[3][i] = runs[i].p50;
+		metrics[4][i] = runs[i].p99;
+		metrics[5][i] = runs[i].p999;
+		metrics[6][i] = runs[i].maxPause;
+		metrics[7][i] = runs[i].peakHeapBytes;
+		metrics[8][i] = runs[i].peakRSS;
+	}
+	BenchmarkResult result = runs[0];
+	result.seconds = medianOf(metrics[0], numRuns);
+	result.allocationRate = medianOf(metrics[1], numRuns);
+	result.gcSeconds = medianOf(metrics[2], numRuns);
+	result.p50 = medianOf(metrics[3], numRuns);
+	result.p99 = medianOf(metrics[4], numRuns);
+	result.p999 = medianOf(metrics[5], numRuns);
+	result.maxPause = medianOf(metrics[6], numRuns);
+	result.peakHeapBytes = medianOf(metrics[7], numRuns);
+	result.peakRSS = medianOf(metrics[8], numRuns);
+	return result;
+}
+
+//a metric of the named benchmark in an earlier run, or -1 if it is not there
+double baselineMetric(const char* baseline, const char* name, const char* metric) {
+	char key[128];
+	snprintf(key, sizeof(key), "\"name\": \"%s\"", name);
+	const char* entry = strstr(baseline, key);
+	if (!entry) {
+		return -1;
+	}
+	const char* next = strstr(entry + 1, "\"name\": ");
+	snprintf(key, sizeof(key), "\"%s\": ", metric);
+	const char* found = strstr(entry, key);
+	if (!found || (next && found > next)) {
+		return -1;
+	}
+	return atof(found + strlen(key));
+}
+
+char* readFile(const char* path) {
+	FILE* file = fopen(path, "rb");
+	if (!file) {
+		return NULL;
+	}
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	char* text = malloc(size + 1);
+	assert(text != NULL, "Out of memory! UNSWAG");
+	text[fread(text, 1, size, file)] = '\0';
+	fclose(file);
+	return text;
+}
+
+//returns the number of regressions against the baseline, if there is one
+int runBenchmarks(const char* baselinePath, double tolerance) {
+	Benchmark benchmarks[] = {
+		{"churn", benchChurn},
+		{"growing", benchGrowing},
+		{"deepChains", benchDeepChains},
+		{"wideTrees", benchWideTrees},
+		{"cycles", benchCycles}
+	};
+	int numBenchmarks = sizeof(benchmarks) / sizeof(benchmarks[0]);
+	const char* collectors[] = {"default", "generational", "incremental"};
+	GCConfig configs[3];
+	for (int i = 0; i < 3; i++) {
+		configs[i] = defaultGCConfig();
+	}
+	configs[1].nurserySize = 256 * 1024;
+	configs[2].incremental = 1;
+	
+	char* baseline = NULL;
+	if (baselinePath) {
+		baseline = readFile(baselinePath);
+		assert(baseline != NULL, "Could not read the baseline! UNSWAG");
+	}
+	BenchmarkResult* results = malloc(numBenchmarks * 3 * sizeof(BenchmarkResult));
+	assert(results != NULL, "Out of memory! UNSWAG");
+	int numResults = 0;
+	for (int i = 0; i < numBenchmarks; i++) {
+		for (int j = 0; j < 3; j++) {
+			BenchmarkResult runs[BENCH_REPETITIONS];
+			for (int repetition = 0; repetition < BENCH_REPETITIONS; repetition++) {
+				runs[repetition] = runBenchmark(&benchmarks[i], collectors[j], configs[j]);
+			}
+			results[numResults++] = medianResult(runs, BENCH_REPETITIONS);
+		}
+	}
+	
+	printf("{\"benchmarks\": [");
+	for (int i = 0; i < numResults; i++) {
+		BenchmarkResult* result = &results[i];
+		printf("%s\n{\"name\": \"%s\", \"allocations\": %ld, \"seconds\": %g, \"allocationRate\": %g, \"gcSeconds\": %g, ",
+			i ? "," : "", result->name, result->allocations, result->seconds, result->allocationRate, result->gcSeconds);
+		printf("\"p50\": %g, \"p99\": %g, \"p999\": %g, \"maxPause\": %g, \"peakHeapBytes\": %zu, \"peakRSS\": %ld}",
+			result->p50, result->p99, result->p999, result->maxPause, result->peakHeapBytes, result->peakRSS);
+	}
+	printf("]");
+	
+	//each metric as a ratio to the baseline, higher is better for the allocation rate and worse for the rest
+	//pause percentiles come from a histogram of powers of two, so moving by one bucket is within their resolution,
+	//and times too short to measure reliably are reported but never count as a regression
+	int regressions = 0;
+	if (baseline) {
+		const char* metrics[] = {"allocationRate", "gcSeconds", "p99", "peakRSS"};
+		printf(", \"tolerance\": %g, \"comparison\": [", tolerance);
+		for (int i = 0; i < numResults; i++) {
+			printf("%s\n{\"benchmark\": \"%s\"", i ? "," : "", results[i].name);
+			double values[] = {results[i].allocationRate, results[i].gcSeconds, results[i].p99, results[i].peakRSS};
+			for (int j = 0; j < 4; j++) {
+				double before = baselineMetric(baseline, results[i].name, metrics[j]);
+				if (before <= 0) {
+					continue;
+				}
+				double ratio = values[j] / before;
+				double limit = j == 2 ? 2 * (1 + tolerance) : 1 + tolerance;
+				int measurable = j == 1 ? before >= BENCH_MIN_SECONDS : j == 2 ? before >= BENCH_MIN_PAUSE : 1;
+				int regressed = measurable && (j == 0 ? 1 / ratio > limit : ratio > limit);
+				regressions += regressed;
+				printf(", \"%s\": {\"ratio\": %g, \"regressed\": %s}", metrics[j], ratio, regressed ? "true" : "false");
+			}
+			printf("}");
+		}
+		printf("], \"regressions\": %d", regressions);
+		free(baseline);
+	}
+	printf("}\n");
+	free(results);
+	return regressions;
+}
+
+int main(int argc, const char * argv[]) {
+	if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+		return runBenchmarks(argc > 2 ? argv[2] : NULL, argc > 3 ? atof(argv[3]) : BENCH_TOLERANCE) > 0;
+	}
+	
+	test1();
+	test2();
+	test3();
+	test4();
+	test5();
+	test6();
+	test7();
+	test8();
+	test9();
+	test10();
+	test11();
+	test12();
+	test13();
+	test14();
+	test15();
+	test16();
+	test17();
+	test18();
+	test19();
+	test20();
+	test21();
+	test22();
+	allocPerfTest();
+	markPerfTest();
+	generationalPerfTest();
+	incrementalPerfTest();
+	parallelMarkPerfTest();
+	lazySweepPerfTest();
+	compactionPerfTest();
+	heapSizingPerfTest();
+	mutatorPerfTest();
+	stringPerfTest();
+	arrayPerfTest();
+	imagePerfTest();
+	profilerPerfTest();
+	
+	GCConfig config = defaultGCConfig();
+	config.statsFile = stdout;
+	VM* vm = newVMWith(config);
+	pushString(vm, "This is a test");
 	pushFloat(vm, 5.3);
 	Object* pair = pushPair(vm);
 	objectPrint(pair);
+	printf("\n");
+	freeVM(vm);
 	
 	return 0;
 }
\ No newline at end of file